@@ -3,7 +3,10 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 
 /* A block device. */
 struct block
@@ -24,6 +27,18 @@ struct block
 #endif
         read_cnt,        /* Number of sectors read. */
         write_cnt;       /* Number of sectors written. */
+    uint32_t read_hist[BLOCK_HIST_BUCKETS];  /* Latencies of reads. */
+    uint32_t write_hist[BLOCK_HIST_BUCKETS]; /* Latencies of writes. */
+
+    /* Request queue, see block_submit(). */
+    struct block *parent;               /* Use PARENT's queue instead. */
+    block_sector_t parent_start;        /* First sector within PARENT. */
+    struct lock queue_lock;             /* Guards the following members. */
+    struct condition queue_nonempty;    /* Signaled on submission. */
+    struct list queue;                  /* Requests ordered by sector. */
+    struct list queue_fifo;             /* Requests ordered by age. */
+    block_sector_t queue_head;          /* Sector after the last transfer. */
+    bool queue_running;                 /* Worker thread was started? */
   };
 
 /* List of all block devices. */
@@ -118,6 +133,18 @@ check_sector (struct block *block, block_sector_t sector)
     }
 }
 
+/* Verifies that the CNT sectors starting at SECTOR lie within
+   BLOCK, without wrapping around.  Panics if not. */
+static void
+check_sectors (struct block *block, block_sector_t sector, size_t cnt)
+{
+  check_sector (block, sector);
+  if (cnt > block->size - sector)
+    PANIC ("Access past end of device %s (sector=%"PRDSNu", cnt=%zu, "
+           "size=%"PRDSNu")\n", block_name (block), sector, cnt,
+           block->size);
+}
+
 /* Reads sector SECTOR from BLOCK into BUFFER, which must
    have room for BLOCK_SECTOR_SIZE bytes.
    Internally synchronizes accesses to block devices, so external
@@ -126,8 +153,9 @@ void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
   check_sector (block, sector);
+  uint64_t start = block_cycles ();
   block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_hist_add (block->read_hist, block_cycles () - start);
   __sync_fetch_and_add (&block->read_cnt, 1);
 }
 
@@ -141,10 +169,282 @@ block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
   check_sector (block, sector);
   ASSERT (block->type != BLOCK_FOREIGN);
+  uint64_t start = block_cycles ();
   block->ops->write (block->aux, sector, buffer);
+  block_hist_add (block->write_hist, block_cycles () - start);
   __sync_fetch_and_add (&block->write_cnt, 1);
 }
 
+/* Reads CNT sectors starting at SECTOR from BLOCK into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes.
+   Uses a single request per BLOCK_MULTIPLE_MAX sectors if the
+   driver supports it. */
+void
+block_read_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                     void *buffer)
+{
+  uint8_t *p = buffer;
+
+  if (cnt == 0)
+    return;
+  check_sectors (block, sector, cnt);
+  if (block->ops->read_multiple == NULL)
+    {
+      for (; cnt > 0; cnt--, sector++, p += BLOCK_SECTOR_SIZE)
+        block_read (block, sector, p);
+      return;
+    }
+
+  while (cnt > 0)
+    {
+      size_t n = cnt < BLOCK_MULTIPLE_MAX ? cnt : BLOCK_MULTIPLE_MAX;
+      uint64_t start = block_cycles ();
+      block->ops->read_multiple (block->aux, sector, n, p);
+      block_hist_add (block->read_hist, block_cycles () - start);
+      __sync_fetch_and_add (&block->read_cnt, n);
+      sector += n;
+      cnt -= n;
+      p += n * BLOCK_SECTOR_SIZE;
+    }
+}
+
+/* Writes CNT sectors starting at SECTOR to BLOCK from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Uses a single request per BLOCK_MULTIPLE_MAX sectors if the
+   driver supports it. */
+void
+block_write_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                      const void *buffer)
+{
+  const uint8_t *p = buffer;
+
+  if (cnt == 0)
+    return;
+  check_sectors (block, sector, cnt);
+  ASSERT (block->type != BLOCK_FOREIGN);
+  if (block->ops->write_multiple == NULL)
+    {
+      for (; cnt > 0; cnt--, sector++, p += BLOCK_SECTOR_SIZE)
+        block_write (block, sector, p);
+      return;
+    }
+
+  while (cnt > 0)
+    {
+      size_t n = cnt < BLOCK_MULTIPLE_MAX ? cnt : BLOCK_MULTIPLE_MAX;
+      uint64_t start = block_cycles ();
+      block->ops->write_multiple (block->aux, sector, n, p);
+      block_hist_add (block->write_hist, block_cycles () - start);
+      __sync_fetch_and_add (&block->write_cnt, n);
+      sector += n;
+      cnt -= n;
+      p += n * BLOCK_SECTOR_SIZE;
+    }
+}
+
+static void block_queue_worker (void *block_);
+
+/* Returns true if request A_ starts before request B_. */
+static bool
+block_request_less (const struct list_elem *a_, const struct list_elem *b_,
+                    void *aux UNUSED)
+{
+  const struct block_request *a = list_entry (a_, struct block_request, elem);
+  const struct block_request *b = list_entry (b_, struct block_request, elem);
+  return a->dev_sector < b->dev_sector;
+}
+
+/* Queues request R for BLOCK and returns immediately.  R's DONE
+   function will be called from BLOCK's worker thread once R's
+   sectors have been transferred.  R and its buffer must stay
+   valid until then. */
+void
+block_submit (struct block *block, struct block_request *r)
+{
+  ASSERT (r != NULL);
+  ASSERT (r->cnt > 0);
+  ASSERT (r->done != NULL);
+  check_sectors (block, r->sector, r->cnt);
+  ASSERT (!r->write || block->type != BLOCK_FOREIGN);
+
+  r->block = block;
+  r->dev_sector = r->sector;
+  r->start = block_cycles ();
+  r->deadline = timer_ticks () + BLOCK_DEADLINE_MS * TIMER_FREQ / 1000;
+  for (; block->parent != NULL; block = block->parent)
+    r->dev_sector += block->parent_start;
+
+  lock_acquire (&block->queue_lock);
+  if (!block->queue_running)
+    {
+      char name[16];
+      snprintf (name, sizeof name, "[%.7s-QUEUE]", block->name);
+      if (thread_create (name, PRI_DEFAULT, block_queue_worker, block)
+          == TID_ERROR)
+        PANIC ("Failed to start request queue of %s", block->name);
+      block->queue_running = true;
+    }
+  list_insert_ordered (&block->queue, &r->elem, block_request_less, NULL);
+  list_push_back (&block->queue_fifo, &r->fifo_elem);
+  cond_signal (&block->queue_nonempty, &block->queue_lock);
+  lock_release (&block->queue_lock);
+}
+
+/* Removes the request to serve next from BLOCK's queue, which
+   must not be empty: the oldest request if it is overdue,
+   otherwise the next one in ascending sector order from the
+   current head position, wrapping around at the end (C-LOOK).
+   BLOCK's queue_lock must be held. */
+static struct block_request *
+block_queue_next (struct block *block)
+{
+  struct block_request *r;
+  struct list_elem *e;
+
+  ASSERT (!list_empty (&block->queue));
+
+  r = list_entry (list_front (&block->queue_fifo),
+                  struct block_request, fifo_elem);
+  if (timer_ticks () < r->deadline)
+    {
+      for (e = list_begin (&block->queue); e != list_end (&block->queue);
+           e = list_next (e))
+        if (list_entry (e, struct block_request, elem)->dev_sector
+            >= block->queue_head)
+          break;
+      if (e == list_end (&block->queue))
+        e = list_begin (&block->queue);
+      r = list_entry (e, struct block_request, elem);
+    }
+  return r;
+}
+
+/* Removes the request to serve next from BLOCK's queue and the
+   requests that directly follow it in the same direction, up to
+   BLOCK_MERGE_MAX sectors, and moves them to RUN.  Returns the
+   total number of sectors.  BLOCK's queue_lock must be held. */
+static size_t
+block_queue_take_run (struct block *block, struct list *run)
+{
+  struct block_request *first = block_queue_next (block);
+  struct list_elem *e = list_next (&first->elem);
+  size_t cnt = first->cnt;
+
+  list_remove (&first->elem);
+  list_remove (&first->fifo_elem);
+  list_push_back (run, &first->elem);
+  while (e != list_end (&block->queue))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (r->write != first->write
+          || r->dev_sector != first->dev_sector + cnt
+          || cnt + r->cnt > BLOCK_MERGE_MAX)
+        break;
+      e = list_remove (&r->elem);
+      list_remove (&r->fifo_elem);
+      list_push_back (run, &r->elem);
+      cnt += r->cnt;
+    }
+  block->queue_head = first->dev_sector + cnt;
+  return cnt;
+}
+
+/* Transfers the requests of RUN, which are adjacent and have CNT
+   sectors in total, with a single request to BLOCK, using BOUNCE
+   if RUN has more than one request. */
+static void
+block_queue_transfer (struct block *block, struct list *run, size_t cnt,
+                      uint8_t *bounce)
+{
+  struct block_request *first = list_entry (list_front (run),
+                                            struct block_request, elem);
+  struct list_elem *e;
+  size_t ofs;
+
+  if (list_next (&first->elem) == list_end (run))
+    {
+      if (first->write)
+        block_write_multiple (block, first->dev_sector, cnt, first->buffer);
+      else
+        block_read_multiple (block, first->dev_sector, cnt, first->buffer);
+      return;
+    }
+
+  ASSERT (cnt <= BLOCK_MERGE_MAX);
+  if (first->write)
+    {
+      for (ofs = 0, e = list_begin (run); e != list_end (run);
+           e = list_next (e))
+        {
+          struct block_request *r = list_entry (e, struct block_request, elem);
+          memcpy (bounce + ofs, r->buffer, r->cnt * BLOCK_SECTOR_SIZE);
+          ofs += r->cnt * BLOCK_SECTOR_SIZE;
+        }
+      block_write_multiple (block, first->dev_sector, cnt, bounce);
+    }
+  else
+    {
+      block_read_multiple (block, first->dev_sector, cnt, bounce);
+      for (ofs = 0, e = list_begin (run); e != list_end (run);
+           e = list_next (e))
+        {
+          struct block_request *r = list_entry (e, struct block_request, elem);
+          memcpy (r->buffer, bounce + ofs, r->cnt * BLOCK_SECTOR_SIZE);
+          ofs += r->cnt * BLOCK_SECTOR_SIZE;
+        }
+    }
+}
+
+/* Serves the request queue of BLOCK. */
+static void
+block_queue_worker (void *block_)
+{
+  struct block *block = block_;
+  uint8_t *bounce = malloc (BLOCK_MERGE_MAX * BLOCK_SECTOR_SIZE);
+
+  if (bounce == NULL)
+    PANIC ("Failed to allocate request queue buffer of %s", block->name);
+  for (;;)
+    {
+      struct list run;
+      size_t cnt;
+
+      list_init (&run);
+      lock_acquire (&block->queue_lock);
+      while (list_empty (&block->queue))
+        cond_wait (&block->queue_nonempty, &block->queue_lock);
+      cnt = block_queue_take_run (block, &run);
+      lock_release (&block->queue_lock);
+
+      block_queue_transfer (block, &run, cnt, bounce);
+
+      while (!list_empty (&run))
+        {
+          struct block_request *r = list_entry (list_pop_front (&run),
+                                                struct block_request, elem);
+
+          /* Account requests to partitions to the partition, too,
+             including the time spent in the queue. */
+          if (r->block != block)
+            {
+              if (r->write)
+                {
+                  block_hist_add (r->block->write_hist,
+                                  block_cycles () - r->start);
+                  __sync_fetch_and_add (&r->block->write_cnt, r->cnt);
+                }
+              else
+                {
+                  block_hist_add (r->block->read_hist,
+                                  block_cycles () - r->start);
+                  __sync_fetch_and_add (&r->block->read_cnt, r->cnt);
+                }
+            }
+          r->done (r);
+        }
+    }
+}
+
 /* Returns the number of sectors in BLOCK. */
 block_sector_t
 block_size (struct block *block)
@@ -186,10 +486,50 @@ block_print_stats (void)
                   ,
                   block->name, block_type_name (block->type),
                   block->read_cnt, block->write_cnt);
+          if (block->read_cnt > 0)
+            block_print_hist ("  read latency", block->read_hist);
+          if (block->write_cnt > 0)
+            block_print_hist ("  write latency", block->write_hist);
         }
     }
 }
 
+/* Copies the statistics of BLOCK into STATS. */
+void
+block_get_stats (struct block *block, struct block_stats *stats)
+{
+  stats->read_cnt = block->read_cnt;
+  stats->write_cnt = block->write_cnt;
+  memcpy (stats->read_hist, block->read_hist, sizeof stats->read_hist);
+  memcpy (stats->write_hist, block->write_hist, sizeof stats->write_hist);
+}
+
+/* Counts a duration of CYCLES in HIST. */
+void
+block_hist_add (uint32_t hist[BLOCK_HIST_BUCKETS], uint64_t cycles)
+{
+  size_t i = 0;
+  cycles /= BLOCK_HIST_BASE;
+  while (cycles > 0 && i < BLOCK_HIST_BUCKETS - 1)
+    {
+      cycles >>= 1;
+      i++;
+    }
+  __sync_fetch_and_add (&hist[i], 1);
+}
+
+/* Prints HIST as a line, with NAME in front of it. */
+void
+block_print_hist (const char *name, const uint32_t hist[BLOCK_HIST_BUCKETS])
+{
+  size_t i;
+
+  printf ("%s (<%uk cycles, doubling):", name, BLOCK_HIST_BASE / 1024);
+  for (i = 0; i < BLOCK_HIST_BUCKETS; i++)
+    printf (" %"PRIu32, hist[i]);
+  printf ("\n");
+}
+
 /* Registers a new block device with the given NAME.  If
    EXTRA_INFO is non-null, it is printed as part of a user
    message.  The block device's SIZE in sectors and its TYPE must
@@ -212,6 +552,16 @@ block_register (const char *name, enum block_type type,
   block->aux = aux;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  memset (block->read_hist, 0, sizeof block->read_hist);
+  memset (block->write_hist, 0, sizeof block->write_hist);
+  block->parent = NULL;
+  block->parent_start = 0;
+  lock_init (&block->queue_lock);
+  cond_init (&block->queue_nonempty);
+  list_init (&block->queue);
+  list_init (&block->queue_fifo);
+  block->queue_head = 0;
+  block->queue_running = false;
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -223,6 +573,19 @@ block_register (const char *name, enum block_type type,
   return block;
 }
 
+/* Declares BLOCK to be a part of PARENT that starts at sector
+   START, so that requests submitted to BLOCK are queued and
+   ordered together with the requests for PARENT. */
+void
+block_set_parent (struct block *block, struct block *parent,
+                  block_sector_t start)
+{
+  ASSERT (block != parent);
+  ASSERT (start + block->size <= parent->size);
+  block->parent = parent;
+  block->parent_start = start;
+}
+
 /* Returns the block device corresponding to LIST_ELEM, or a null
    pointer if LIST_ELEM is the list end of all_blocks. */
 static struct block *
@@ -2,7 +2,9 @@
 #define DEVICES_BLOCK_H
 
 #include <stddef.h>
+#include <stdbool.h>
 #include <inttypes.h>
+#include <list.h>
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -53,22 +55,103 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, size_t cnt, void *);
+void block_write_multiple (struct block *, block_sector_t, size_t cnt,
+                           const void *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* Asynchronous requests.
+
+   block_submit() queues a request and returns at once.  Each
+   device has a worker thread that orders the queued requests by
+   sector (an elevator that also serves requests waiting for longer
+   than BLOCK_DEADLINE_MS first), merges adjacent requests of the
+   same direction into a single transfer and calls the DONE
+   function of each request in the worker thread once it has been
+   transferred.  Requests submitted to a partition are queued on
+   the disk the partition belongs to. */
+
+/* Most sectors merged into a single transfer. */
+#define BLOCK_MERGE_MAX 64
+
+/* Requests that wait for longer are served before all others. */
+#define BLOCK_DEADLINE_MS 100
+
+struct block_request;
+typedef void block_request_func (struct block_request *);
+
+struct block_request
+  {
+    /* Set by the submitter. */
+    block_sector_t sector;      /* First sector. */
+    size_t cnt;                 /* Number of sectors. */
+    void *buffer;               /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    bool write;                 /* Write BUFFER to the device? */
+    block_request_func *done;   /* Called when the transfer is done. */
+    void *aux;                  /* For use by DONE. */
+
+    /* Owned by the block layer until DONE is called. */
+    struct block *block;        /* Device the request was submitted to. */
+    block_sector_t dev_sector;  /* SECTOR on the queue's device. */
+    int64_t deadline;           /* timer_ticks() to be served by. */
+    uint64_t start;             /* block_cycles() when submitted. */
+    struct list_elem elem;      /* Element in the queue, by sector. */
+    struct list_elem fifo_elem; /* Element in the queue, by age. */
+  };
+
+void block_submit (struct block *, struct block_request *);
+
 /* Statistics. */
 void block_print_stats (void);
+
+/* Histograms of durations: bucket I counts durations of less than
+   BLOCK_HIST_BASE << I TSC cycles, the last bucket all longer ones. */
+#define BLOCK_HIST_BUCKETS 16
+#define BLOCK_HIST_BASE 1024
+
+struct block_stats
+  {
+    uint64_t read_cnt, write_cnt;               /* Sectors read/written. */
+    uint32_t read_hist[BLOCK_HIST_BUCKETS];     /* Latencies of reads. */
+    uint32_t write_hist[BLOCK_HIST_BUCKETS];    /* Latencies of writes. */
+  };
+
+void block_get_stats (struct block *, struct block_stats *);
+void block_hist_add (uint32_t hist[BLOCK_HIST_BUCKETS], uint64_t cycles);
+void block_print_hist (const char *name,
+                       const uint32_t hist[BLOCK_HIST_BUCKETS]);
+
+/* Reads the processor's time stamp counter. */
+static inline uint64_t
+block_cycles (void)
+{
+  uint64_t cycles;
+  asm volatile ("rdtsc" : "=A" (cycles));
+  return cycles;
+}
 
 /* Lower-level interface to block device drivers. */
 
+/* Most sectors a driver's read_multiple/write_multiple is asked for. */
+#define BLOCK_MULTIPLE_MAX 256
+
 struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Optional, transfer CNT consecutive sectors at once. */
+    void (*read_multiple) (void *aux, block_sector_t, size_t cnt,
+                           void *buffer);
+    void (*write_multiple) (void *aux, block_sector_t, size_t cnt,
+                            const void *buffer);
   };
 
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
                               const struct block_operations *, void *aux);
+void block_set_parent (struct block *, struct block *parent,
+                       block_sector_t start);
 
 #endif /* devices/block.h */
@@ -3,12 +3,15 @@
 #include <debug.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include "devices/block.h"
 #include "devices/partition.h"
+#include "devices/pci.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -30,10 +33,31 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master IDE port addresses, relative to the channel's
+   bmi_base.  (PCI IDE Controller Specification, PIIX datasheet.) */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bmi_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bmi_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bmi_base + 4)    /* PRD table. */
+
+/* Bus master command register bits. */
+#define BMC_START 0x01          /* Start/stop bus master transfer. */
+#define BMC_READ 0x08           /* Transfer from disk to memory. */
+
+/* Bus master status register bits. */
+#define BMS_ACTIVE 0x01         /* Transfer in progress. */
+#define BMS_ERR 0x02            /* Transfer failed (write 1 to clear). */
+#define BMS_IRQ 0x04            /* Disk interrupted (write 1 to clear). */
+
+/* PCI configuration space of the IDE controller. */
+#define PCI_REG_COMMAND 0x04    /* Command register. */
+#define PCI_COMMAND_MASTER 0x04 /* Enable bus mastering. */
+#define PCI_REG_BAR4 0x20       /* Bus master I/O ports. */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +73,27 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* A physical region descriptor, telling the bus master where to
+   transfer the next at most 64 kB.  A region must not cross a
+   64 kB boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address, must be even. */
+    uint16_t size;              /* Size in bytes, 0 means 64 kB. */
+    uint16_t flags;             /* PRD_EOT in the last descriptor. */
+  };
+
+#define PRD_EOT 0x8000          /* End of table. */
+
+/* A transfer of BLOCK_MULTIPLE_MAX sectors needs at most three
+   descriptors; rounded up so the table can be aligned to its size. */
+#define PRD_CNT 4
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +102,9 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    int multiple;               /* Sectors per interrupt of READ/WRITE
+                                   MULTIPLE, 0 if not supported. */
+    bool dma;                   /* Use READ/WRITE DMA? */
   };
 
 /* An ATA channel (aka controller).
@@ -72,6 +120,10 @@ struct channel
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bmi_base;          /* Bus master I/O port, 0 if none. */
+    struct prd prdt[PRD_CNT]    /* Bus master PRD table. */
+      __attribute__ ((aligned (sizeof (struct prd) * PRD_CNT)));
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -85,10 +137,15 @@ static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void set_multiple_mode (struct ata_disk *, int multiple);
+static uint16_t find_bus_master (void);
+static bool dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          void *, bool read);
+
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
-static void input_sector (struct channel *, void *);
-static void output_sector (struct channel *, const void *);
+static void input_sectors (struct channel *, void *, size_t cnt);
+static void output_sectors (struct channel *, const void *, size_t cnt);
 
 static void wait_until_idle (const struct ata_disk *);
 static bool wait_while_busy (const struct ata_disk *);
@@ -102,6 +159,7 @@ void
 ide_init (void) 
 {
   size_t chan_no;
+  uint16_t bmi_base = find_bus_master ();
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
     {
@@ -126,6 +184,7 @@ ide_init (void)
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->bmi_base = bmi_base != 0 ? bmi_base + chan_no * 8 : 0;
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +195,8 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 0;
+          d->dma = false;
         }
 
       /* Register interrupt handler. */
@@ -279,7 +340,7 @@ identify_ata_device (struct ata_disk *d)
       d->is_ata = false;
       return;
     }
-  input_sector (c, id);
+  input_sectors (c, id, 1);
 
   /* Calculate capacity.
      Read model name and serial number. */
@@ -303,6 +364,14 @@ identify_ata_device (struct ata_disk *d)
       return;
     }
 
+  /* Transfer as many sectors per interrupt as the disk supports.
+     Prefer DMA if the disk supports it (word 49, bit 8) and the
+     channel has a bus master. */
+  set_multiple_mode (d, (uint8_t) id[47 * 2]);
+  d->dma = c->bmi_base != 0 && (*(uint16_t *) &id[49 * 2] & 0x100) != 0;
+  if (d->dma)
+    strlcat (extra_info, ", DMA", sizeof extra_info);
+
   /* Register. */
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
                           &ide_operations, d);
@@ -337,63 +406,225 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
+/* Sends SET MULTIPLE MODE to disk D, so that READ/WRITE MULTIPLE
+   transfer MULTIPLE sectors per interrupt.  Leaves D's multiple at
+   0 if MULTIPLE is 0 or the disk refuses. */
+static void
+set_multiple_mode (struct ata_disk *d, int multiple)
+{
+  struct channel *c = d->channel;
+
+  d->multiple = 0;
+  if (multiple == 0)
+    return;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), multiple);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if ((inb (reg_alt_status (c)) & STA_ERR) == 0)
+    d->multiple = multiple;
+}
+
+/* Returns the base I/O port of the bus master registers of the
+   first PCI IDE controller that is capable of bus mastering,
+   after enabling bus mastering, or 0 if there is none. */
+static uint16_t
+find_bus_master (void)
+{
+  int iface;
+
+  /* Bit 7 of the programming interface announces a bus master. */
+  for (iface = 0x80; iface <= 0xff; iface++)
+    {
+      struct pci_dev *pd = pci_get_dev_by_class (PCI_MAJOR_MASS_STORAGE,
+                                                 PCI_MINOR_IDE, iface, 0);
+      uint32_t bar;
+
+      if (pd == NULL)
+        continue;
+      bar = pci_read_config32 (pd, PCI_REG_BAR4);
+      if ((bar & 1) == 0 || (bar & ~3u) == 0)
+        continue;
+      pci_write_config16 (pd, PCI_REG_COMMAND,
+                          pci_read_config16 (pd, PCI_REG_COMMAND)
+                          | PCI_COMMAND_MASTER);
+      return bar & ~3u;
+    }
+  return 0;
+}
+
+/* Transfers CNT sectors starting at SEC_NO between disk D and
+   BUFFER with READ/WRITE DMA, letting the CPU run other threads
+   meanwhile.  D's channel must be locked.  Returns false, without
+   having transferred anything meaningful, if BUFFER cannot be used
+   for DMA or the transfer failed. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              void *buffer, bool read)
+{
+  struct channel *c = d->channel;
+  uintptr_t addr, end;
+  uint8_t bm_status, status;
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&c->lock));
+
+  /* The bus master needs an even physical address. */
+  if (!d->dma || !is_kernel_vaddr (buffer) || ((uintptr_t) buffer & 1) != 0)
+    return false;
+
+  /* Build the PRD table, splitting at 64 kB boundaries. */
+  addr = vtop (buffer);
+  end = addr + cnt * BLOCK_SECTOR_SIZE;
+  for (i = 0; addr < end; i++)
+    {
+      uintptr_t size = 0x10000 - (addr & 0xffff);
+      if (size > end - addr)
+        size = end - addr;
+      ASSERT (i < PRD_CNT);
+      c->prdt[i].addr = addr;
+      c->prdt[i].size = size;
+      c->prdt[i].flags = 0;
+      addr += size;
+    }
+  c->prdt[i - 1].flags = PRD_EOT;
+
+  outl (reg_bm_prdt (c), vtop (c->prdt));
+  outb (reg_bm_command (c), read ? BMC_READ : 0);
+  outb (reg_bm_status (c), inb (reg_bm_status (c)) | BMS_ERR | BMS_IRQ);
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, read ? CMD_READ_DMA : CMD_WRITE_DMA);
+  outb (reg_bm_command (c), (read ? BMC_READ : 0) | BMC_START);
+  sema_down (&c->completion_wait);
+
+  outb (reg_bm_command (c), 0);
+  bm_status = inb (reg_bm_status (c));
+  outb (reg_bm_status (c), bm_status | BMS_ERR | BMS_IRQ);
+  status = inb (reg_alt_status (c));
+  if ((bm_status & BMS_ERR) != 0 || (status & STA_ERR) != 0)
+    {
+      printf ("%s: DMA %s failed, sector=%"PRDSNu", using PIO\n",
+              d->name, read ? "read" : "write", sec_no);
+      d->dma = false;
+      return false;
+    }
+  return true;
+}
+
+/* Reads CNT sectors starting at SEC_NO from disk D into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_read_multiple (void *d_, block_sector_t sec_no, size_t cnt, void *buffer)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  size_t per_irq = d->multiple > 0 ? (size_t) d->multiple : 1;
+  uint8_t *p = buffer;
+
+  ASSERT (cnt > 0 && cnt <= BLOCK_MULTIPLE_MAX);
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
+  if (dma_transfer (d, sec_no, cnt, buffer, true))
+    {
+      lock_release (&c->lock);
+      return;
+    }
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, d->multiple > 0 ? CMD_READ_MULTIPLE
+                                        : CMD_READ_SECTOR_RETRY);
+  while (cnt > 0)
+    {
+      size_t n = cnt < per_irq ? cnt : per_irq;
+      sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
+      input_sectors (c, p, n);
+      p += n * BLOCK_SECTOR_SIZE;
+      cnt -= n;
+    }
   lock_release (&c->lock);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
+/* Reads sector SEC_NO from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes. */
+static void
+ide_read (void *d_, block_sector_t sec_no, void *buffer)
+{
+  ide_read_multiple (d_, sec_no, 1, buffer);
+}
+
+/* Writes CNT sectors starting at SEC_NO to disk D from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes.  Returns
+   after the disk has acknowledged receiving the data.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+ide_write_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                    const void *buffer)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  size_t per_irq = d->multiple > 0 ? (size_t) d->multiple : 1;
+  const uint8_t *p = buffer;
+
+  ASSERT (cnt > 0 && cnt <= BLOCK_MULTIPLE_MAX);
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
+  if (dma_transfer (d, sec_no, cnt, (void *) buffer, false))
+    {
+      lock_release (&c->lock);
+      return;
+    }
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, d->multiple > 0 ? CMD_WRITE_MULTIPLE
+                                        : CMD_WRITE_SECTOR_RETRY);
+  while (cnt > 0)
+    {
+      size_t n = cnt < per_irq ? cnt : per_irq;
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
+      output_sectors (c, p, n);
+      sema_down (&c->completion_wait);
+      p += n * BLOCK_SECTOR_SIZE;
+      cnt -= n;
+    }
   lock_release (&c->lock);
 }
 
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes. */
+static void
+ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+{
+  ide_write_multiple (d_, sec_no, 1, buffer);
+}
+
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multiple,
+    ide_write_multiple
   };
-
+
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO to the disk's sector selection registers and CNT,
+   at most 256, to the sector count register.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= 256);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt == 256 ? 0 : cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -414,20 +645,21 @@ issue_pio_command (struct channel *c, uint8_t command)
   outb (reg_command (c), command);
 }
 
-/* Reads a sector from channel C's data register in PIO mode into
-   SECTOR, which must have room for BLOCK_SECTOR_SIZE bytes. */
+/* Reads CNT sectors from channel C's data register in PIO mode
+   into SECTORS, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes. */
 static void
-input_sector (struct channel *c, void *sector) 
+input_sectors (struct channel *c, void *sectors, size_t cnt) 
 {
-  insw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
+  insw (reg_data (c), sectors, cnt * BLOCK_SECTOR_SIZE / 2);
 }
 
-/* Writes SECTOR to channel C's data register in PIO mode.
-   SECTOR must contain BLOCK_SECTOR_SIZE bytes. */
+/* Writes SECTORS to channel C's data register in PIO mode.
+   SECTORS must contain CNT * BLOCK_SECTOR_SIZE bytes. */
 static void
-output_sector (struct channel *c, const void *sector) 
+output_sectors (struct channel *c, const void *sectors, size_t cnt) 
 {
-  outsw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
+  outsw (reg_data (c), sectors, cnt * BLOCK_SECTOR_SIZE / 2);
 }
 
 /* Low-level ATA primitives. */
@@ -515,6 +747,8 @@ interrupt_handler (struct intr_frame *f)
           if (c->expecting_interrupt) 
             {
               inb (reg_status (c));               /* Acknowledge interrupt. */
+              if (c->bmi_base != 0)
+                outb (reg_bm_status (c), inb (reg_bm_status (c)) | BMS_IRQ);
               sema_up (&c->completion_wait);      /* Wake up waiter. */
             }
           else
@@ -0,0 +1,85 @@
+/* fsstat.c
+
+   Prints statistics of the file system's cache and disk.
+   Each argument is run as a command, after which the statistics
+   of that run are printed, e.g. fsstat "cat file" "ls -l". */
+
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+
+static void
+print_hist (const char *name, const unsigned hist[FSSTAT_HIST_BUCKETS])
+{
+  int i;
+
+  printf ("  %-16s", name);
+  for (i = 0; i < FSSTAT_HIST_BUCKETS; i++)
+    printf (" %u", hist[i]);
+  printf ("\n");
+}
+
+/* Subtracts the counters of OLD from NEW. */
+static void
+diff_stats (struct fsstat *new, const struct fsstat *old)
+{
+  unsigned *n = (unsigned *) new;
+  const unsigned *o = (const unsigned *) old;
+  size_t i;
+
+  /* The current cache size is no counter. */
+  for (i = 1; i < sizeof *new / sizeof *n; i++)
+    n[i] -= o[i];
+}
+
+static void
+print_stats (const struct fsstat *st)
+{
+  unsigned accesses = st->hits + st->misses;
+
+  printf ("cache: %u pages, %u hits, %u misses (%u%% hits)\n",
+          st->cache_pages, st->hits, st->misses,
+          accesses > 0 ? st->hits * 100 / accesses : 0);
+  printf ("       %u evictions, %u writebacks, %u stalls\n",
+          st->evictions, st->writebacks, st->stalls);
+  printf ("disk:  %u reads, %u writes\n", st->reads, st->writes);
+  printf ("histograms (<%uk cycles, doubling):\n", FSSTAT_HIST_BASE / 1024);
+  print_hist ("lease durations", st->lease_hist);
+  print_hist ("read latency", st->read_hist);
+  print_hist ("write latency", st->write_hist);
+}
+
+int
+main (int argc, char *argv[]) 
+{
+  struct fsstat before, after;
+  int i;
+
+  if (!fsstat (&before))
+    {
+      printf ("fsstat failed\n");
+      return EXIT_FAILURE;
+    }
+  if (argc < 2)
+    {
+      print_stats (&before);
+      return EXIT_SUCCESS;
+    }
+
+  for (i = 1; i < argc; i++)
+    {
+      pid_t pid = exec (argv[i]);
+      if (pid == PID_ERROR)
+        {
+          printf ("\"%s\": exec failed\n", argv[i]);
+          return EXIT_FAILURE;
+        }
+      printf ("\"%s\": exit code %d\n", argv[i], wait (pid));
+
+      fsstat (&after);
+      diff_stats (&after, &before);
+      print_stats (&after);
+      fsstat (&before);
+    }
+  return EXIT_SUCCESS;
+}
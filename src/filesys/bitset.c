@@ -90,3 +90,59 @@ bitset_find_and_set_1 (char *bitset, size_t size)
     }
   return -1;
 }
+
+// Returns the count of unset bits in the first size bytes of bitset,
+// and stores the length of the longest run of unset bits in *longest_run.
+size_t
+bitset_count_zeros (const char *bitset, size_t size, size_t *longest_run)
+{
+  size_t result = 0, run = 0, longest = 0, i;
+  for (i = 0; i < size * 8; ++i)
+    {
+      if (bitset_get ((char *) bitset, i))
+        run = 0;
+      else
+        {
+          ++result;
+          if (++run > longest)
+            longest = run;
+        }
+    }
+  *longest_run = longest;
+  return result;
+}
+
+// Finds the shortest run of at least amount unset bits in the first
+// size bytes of bitset, or the longest run if there is no such run.
+// Returns the index of its first bit and stores its length in *run.
+// *run is 0 if all bits are set.
+size_t
+bitset_find_zeros (const char *bitset, size_t size, size_t amount, size_t *run)
+{
+  size_t best_start = 0, best_len = 0, start = 0, len = 0, i;
+  for (i = 0; i <= size * 8; ++i)
+    {
+      if (i < size * 8 && !bitset_get ((char *) bitset, i))
+        {
+          if (len++ == 0)
+            start = i;
+          continue;
+        }
+      if (len > 0)
+        {
+          bool fits = len >= amount, best_fits = best_len >= amount;
+          if (best_len == 0 ||
+              (fits && (!best_fits || len < best_len)) ||
+              (!fits && !best_fits && len > best_len))
+            {
+              best_start = start;
+              best_len = len;
+            }
+          if (best_len == amount)
+            break;
+        }
+      len = 0;
+    }
+  *run = best_len;
+  return best_start;
+}
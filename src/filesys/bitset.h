@@ -43,6 +43,14 @@ size_t bitset_find_and_set (char   *bitset,
                             void    *aux);
 off_t bitset_find_and_set_1 (char *bitset, size_t size);
 
+size_t bitset_count_zeros (const char *bitset,
+                           size_t      size,
+                           size_t     *longest_run);
+size_t bitset_find_zeros (const char *bitset,
+                          size_t      size,
+                          size_t      amount,
+                          size_t     *run);
+
 static inline void
 bitset_mark_range (char *bitset, size_t start, size_t amount)
 {
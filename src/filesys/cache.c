@@ -1,6 +1,9 @@
 #include "cache.h"
 #include "threads/malloc.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+#include "devices/timer.h"
 
 #include <stdio.h>
 
@@ -24,7 +27,27 @@
 //#define BC_DEBUG(...) printf (__VA_ARGS__)
 #define BC_DEBUG(...)
 
-// TODO: implement interval-wise flushing (clock?)
+#define BC_FLUSH_INTERVAL_MS 1000 // write back all dirty pages this often
+#define BC_FLUSH_POLL_MS     50   // how often the flusher tests the ratio
+#define BC_DIRTY_RATIO       50   // % of dirty pages that wakes the flusher
+#define BC_DIRTY_RATIO_LOW   25   // % of dirty pages the flusher stops at
+#define BC_FLUSH_BATCH       8    // pages written per flusher iteration
+#define BC_FLUSH_MANY        32   // pages block_cache_flush_many() queues
+
+#define BC_READAHEAD_MIN     2    // ascending reads that start read-ahead
+#define BC_READAHEAD_WINDOW  8    // sectors to read ahead
+#define BC_READAHEAD_GAP     4    // sectors a read may skip in a stream
+#define BC_EVICT_SCAN        8    // unleased lru pages searched for clean ones
+
+#define BC_GROW_FREE_PERCENT 25   // % of free user frames needed to grow
+#define BC_CHUNK_PAGES (PGSIZE / sizeof (struct block_page))
+
+// A frame of the user pool the cache grew by.
+struct block_cache_chunk
+{
+  struct allocator allocator; // BC_CHUNK_PAGES pages in one frame
+  struct list_elem elem;      // struct block_cache::chunks
+};
 
 static unsigned
 block_cache_page_hash (const struct hash_elem *e, void *bc UNUSED)
@@ -33,67 +56,887 @@ block_cache_page_hash (const struct hash_elem *e, void *bc UNUSED)
   struct block_page *ee = hash_entry (e, struct block_page, hash_elem);
   typedef char _CASSERT[0 - !(sizeof (unsigned) == sizeof (ee->nth))];
   ASSERT (ee->magic == BC_PAGE_MAGIC);
-  return (unsigned) ee->nth;
+  // all sectors of a shard share nth % BC_SHARDS, so mix the bits:
+  return hash_int ((int) ee->nth);
 }
 
 static bool
 block_cache_page_less (const struct hash_elem *a,
                        const struct hash_elem *b,
-                       void                   *bc)
+                       void                   *bc UNUSED)
+{
+  struct block_page *aa = hash_entry (a, struct block_page, hash_elem);
+  struct block_page *bb = hash_entry (b, struct block_page, hash_elem);
+  ASSERT (aa->magic == BC_PAGE_MAGIC);
+  ASSERT (bb->magic == BC_PAGE_MAGIC);
+  return aa->nth < bb->nth;
+}
+
+static inline struct block_cache_shard *
+block_cache_shard_of (struct block_cache *bc, block_sector_t nth)
+{
+  return &bc->shards[nth % BC_SHARDS];
+}
+
+// shard->lock must be held
+static struct block_page *
+block_cache_lookup (struct block_cache_shard *shard, block_sector_t nth)
+{
+  struct block_page key;
+  key.nth = nth;
+  key.magic = BC_PAGE_MAGIC;
+  struct hash_elem *e = hash_find (&shard->hash, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct block_page, hash_elem) : NULL;
+}
+
+// shard->lock must be held
+static void
+block_cache_write_back (struct block_cache       *bc,
+                        struct block_cache_shard *shard,
+                        struct block_page        *page)
+{
+  ASSERT (page->magic == BC_PAGE_MAGIC);
+  
+  if (!page->dirty)
+    return;
+  page->dirty = false;
+  if (page->counted_dirty)
+    {
+      page->counted_dirty = false;
+      --shard->dirty_count;
+    }
+  ++shard->writebacks;
+  block_write (bc->device, page->nth, &page->data);
+}
+
+// Puts an unleased page back into the lru, shard->lock must be held.
+static void
+block_cache_lru_return (struct block_cache_shard *shard,
+                        struct block_page        *page)
+{
+  // The flusher leases pages w/o removing them from the lru:
+  if (!lru_is_interior (&page->lru_elem))
+    lru_use (&shard->lru, &page->lru_elem);
+  if (page->dirty && !page->counted_dirty)
+    {
+      page->counted_dirty = true;
+      ++shard->dirty_count;
+    }
+}
+
+// Marks a dirty page as being written back, shard->lock must be held.
+// No new lease of the page is granted until block_cache_end_write(), but
+// the current lessees may return it meanwhile.
+static void
+block_cache_start_write (struct block_cache_shard *shard,
+                         struct block_page        *page)
+{
+  ASSERT (lock_held_by_current_thread (&shard->lock));
+  ASSERT (!page->writing);
+  
+  page->writing = true;
+  page->dirty = false;
+  if (page->counted_dirty)
+    {
+      page->counted_dirty = false;
+      --shard->dirty_count;
+    }
+  ++shard->writebacks;
+}
+
+// Ends the writing state of page, shard->lock must be held.
+// Returns true if the lessees returned the page while it was written, then
+// it went back into the lru like in block_cache_unlease().
+static bool
+block_cache_end_write (struct block_cache_shard *shard,
+                       struct block_page        *page)
 {
-  return block_cache_page_hash (a, bc) < block_cache_page_hash (b, bc);
+  ASSERT (lock_held_by_current_thread (&shard->lock));
+  ASSERT (page->writing);
+  
+  page->writing = false;
+  cond_broadcast (&shard->io_done, &shard->lock);
+  if (page->lease_counter > 0)
+    return false;
+  block_cache_lru_return (shard, page);
+  return true;
+}
+
+// Drops one lease of page, shard->lock must be held.
+// Returns true if the page went back into the lru, then the caller
+// should call block_cache_notify_returned() after releasing shard->lock.
+static bool
+block_cache_unlease (struct block_cache_shard *shard, struct block_page *page)
+{
+  ASSERT (lock_held_by_current_thread (&shard->lock));
+  ASSERT (page->lease_counter > 0);
+  ASSERT (!page->io_pending);
+  
+  if (--page->lease_counter > 0)
+    return false;
+  block_hist_add (shard->lease_hist, block_cycles () - page->lease_start);
+  if (page->writing)
+    return false; // block_cache_end_write() returns it
+  block_cache_lru_return (shard, page);
+  return true;
+}
+
+// Wakes threads waiting for a page to evict. No shard lock may be held.
+static void
+block_cache_notify_returned (struct block_cache *bc)
+{
+  if (bc->evict_waiters == 0)
+    return;
+  lock_acquire (&bc->evict_lock);
+  cond_broadcast (&bc->page_returned, &bc->evict_lock);
+  lock_release (&bc->evict_lock);
+}
+
+static size_t
+block_cache_dirty_count (struct block_cache *bc)
+{
+  size_t result = 0, i;
+  for (i = 0; i < BC_SHARDS; ++i)
+    result += bc->shards[i].dirty_count; // racy read is good enough
+  return result;
+}
+
+// Leases sector nth for writing it back, if it is cached, dirty and unused.
+// The page keeps its position in the lru. No shard lock may be held.
+static struct block_page *
+block_cache_lease_dirty (struct block_cache *bc, block_sector_t nth)
+{
+  struct block_cache_shard *shard = block_cache_shard_of (bc, nth);
+  lock_acquire (&shard->lock);
+  struct block_page *page = block_cache_lookup (shard, nth);
+  if (page != NULL &&
+      (!page->dirty || page->lease_counter > 0 || page->io_pending ||
+       page->writing))
+    page = NULL;
+  if (page != NULL)
+    {
+      ++page->lease_counter;
+      page->lease_start = block_cycles ();
+      block_cache_start_write (shard, page);
+    }
+  lock_release (&shard->lock);
+  return page;
+}
+
+// Completion of a write-behind request.
+static void
+block_cache_written (struct block_request *r)
+{
+  sema_up (r->aux);
+}
+
+// Queues the write of a page in the writing state. done is up'd when the
+// page was written.
+static void
+block_cache_submit_write (struct block_cache *bc,
+                          struct block_page  *page,
+                          struct semaphore   *done)
+{
+  ASSERT (page->writing);
+  
+  struct block_request *r = &page->request;
+  r->sector = page->nth;
+  r->cnt = 1;
+  r->buffer = &page->data;
+  r->write = true;
+  r->done = &block_cache_written;
+  r->aux = done;
+  block_submit (bc->device, r);
+}
+
+// Writes back up to max dirty pages of shard, least recently used first,
+// so that eviction will find clean pages. Returns count of written pages.
+static size_t
+block_cache_write_behind_shard (struct block_cache       *bc,
+                                struct block_cache_shard *shard,
+                                size_t                    max)
+{
+  size_t result = 0;
+  while (result < max)
+    {
+      struct block_page *batch[BC_FLUSH_BATCH];
+      size_t count = 0, i;
+      
+      lock_acquire (&shard->lock);
+      struct lru_elem *e;
+      for (e = lru_peek_least (&shard->lru);
+           e != NULL && count < BC_FLUSH_BATCH && result + count < max;
+           e = lru_peek_next (&shard->lru, e))
+        {
+          struct block_page *page = lru_entry (e, struct block_page, lru_elem);
+          ASSERT (page->magic == BC_PAGE_MAGIC);
+          if (!page->dirty || page->lease_counter > 0 || page->writing)
+            continue;
+            
+          // lease page, but leave it in the lru to retain its position:
+          ++page->lease_counter;
+          page->lease_start = block_cycles ();
+          block_cache_start_write (shard, page);
+          batch[count++] = page;
+        }
+      lock_release (&shard->lock);
+      
+      if (count == 0)
+        break;
+      
+      // Queue the pages together with the dirty sectors following them, so
+      // the device can merge them into larger transfers.
+      // Nobody else can lease the pages until they are written.
+      struct block_page *pages[BC_FLUSH_BATCH * BC_IO_RUN];
+      struct semaphore done;
+      size_t written = 0;
+      sema_init (&done, 0);
+      for (i = 0; i < count; ++i)
+        {
+          struct block_page *page = batch[i];
+          block_sector_t nth = page->nth;
+          size_t run = 0;
+          do
+            {
+              pages[written++] = page;
+              block_cache_submit_write (bc, page, &done);
+              if (++run == BC_IO_RUN || ++nth >= block_size (bc->device))
+                break;
+              page = block_cache_lease_dirty (bc, nth);
+            }
+          while (page != NULL);
+        }
+      for (i = 0; i < written; ++i)
+        sema_down (&done);
+      BC_DEBUG ("BC flusher wrote %u pages\n", written);
+      
+      bool returned = false;
+      for (i = 0; i < written; ++i)
+        {
+          struct block_cache_shard *owner;
+          owner = block_cache_shard_of (bc, pages[i]->nth);
+          lock_acquire (&owner->lock);
+          block_cache_end_write (owner, pages[i]);
+          returned |= block_cache_unlease (owner, pages[i]);
+          lock_release (&owner->lock);
+        }
+      if (returned)
+        block_cache_notify_returned (bc);
+      
+      result += written;
+    }
+  return result;
+}
+
+static void
+block_cache_write_behind (struct block_cache *bc, size_t max)
+{
+  size_t i;
+  for (i = 0; i < BC_SHARDS && max > 0; ++i)
+    max -= block_cache_write_behind_shard (bc, &bc->shards[i], max);
+}
+
+static void
+block_cache_flusher (void *bc_)
+{
+  struct block_cache *bc = bc_;
+  ASSERT (bc != NULL);
+  ASSERT (intr_get_level () == INTR_ON);
+  
+  int64_t last_flush = timer_ticks ();
+  while (!bc->threads_stop)
+    {
+      timer_msleep (BC_FLUSH_POLL_MS);
+      
+      size_t dirty = block_cache_dirty_count (bc);
+      if (timer_elapsed (last_flush) >=
+          BC_FLUSH_INTERVAL_MS * TIMER_FREQ / 1000)
+        {
+          block_cache_write_behind (bc, bc->cache_size);
+          last_flush = timer_ticks ();
+        }
+      else if (dirty * 100 >= bc->cache_size * BC_DIRTY_RATIO)
+        block_cache_write_behind (bc, dirty - bc->cache_size *
+                                              BC_DIRTY_RATIO_LOW / 100);
+    }
+  sema_up (&bc->flusher_down);
+}
+
+// Takes the least recently used unleased page of the next shard, preferring
+// a clean one among the BC_EVICT_SCAN least recently used unleased pages.
+// bc->evict_lock must be held. Returns NULL if all are leased.
+// A dirty victim is returned in the writing state and still hashed, so that
+// its lookups wait until the caller wrote it w/o holding any lock.
+static struct block_page *
+block_cache_evict (struct block_cache *bc)
+{
+  ASSERT (lock_held_by_current_thread (&bc->evict_lock));
+  
+  size_t i;
+  for (i = 0; i < BC_SHARDS; ++i)
+    {
+      struct block_cache_shard *shard = &bc->shards[bc->evict_hand];
+      bc->evict_hand = (bc->evict_hand + 1) % BC_SHARDS;
+      
+      lock_acquire (&shard->lock);
+      struct block_page *victim = NULL;
+      struct lru_elem *e;
+      size_t scanned = 0;
+      for (e = lru_peek_least (&shard->lru);
+           e != NULL && scanned < BC_EVICT_SCAN;
+           e = lru_peek_next (&shard->lru, e))
+        {
+          struct block_page *page = lru_entry (e, struct block_page, lru_elem);
+          ASSERT (page->magic == BC_PAGE_MAGIC);
+          if (page->lease_counter > 0)
+            continue; // being written back by the flusher
+          ++scanned;
+          if (victim == NULL)
+            victim = page;
+          if (!page->dirty)
+            {
+              victim = page;
+              break;
+            }
+        }
+      if (victim == NULL)
+        {
+          lock_release (&shard->lock);
+          continue;
+        }
+        
+      BC_DEBUG ("BC evicting %u\n", victim->nth);
+      ++shard->evictions;
+      lru_dispose (&shard->lru, &victim->lru_elem, false);
+      if (victim->dirty)
+        {
+          ++victim->lease_counter; // the writer's, so it stays out of the lru
+          block_cache_start_write (shard, victim);
+        }
+      else
+        {
+          struct hash_elem *f UNUSED = hash_delete (&shard->hash,
+                                                    &victim->hash_elem);
+          ASSERT (f == &victim->hash_elem);
+        }
+      lock_release (&shard->lock);
+      return victim;
+    }
+  return NULL;
+}
+
+// Adds a frame of the user pool to the cache, if it is not too scarce.
+// bc->evict_lock must be held.
+static bool
+block_cache_grow (struct block_cache *bc)
+{
+  ASSERT (lock_held_by_current_thread (&bc->evict_lock));
+  
+  if (bc->cache_size + BC_CHUNK_PAGES > bc->max_size)
+    return false;
+  size_t ufree, usize;
+  palloc_fill_ratio (NULL, NULL, &ufree, &usize);
+  if (ufree * 100 < usize * BC_GROW_FREE_PERCENT)
+    return false;
+    
+  struct block_cache_chunk *chunk = malloc (sizeof (*chunk));
+  if (chunk == NULL)
+    return false;
+  if (!allocator_init (&chunk->allocator, true, BC_CHUNK_PAGES,
+                       sizeof (struct block_page)))
+    {
+      free (chunk);
+      return false;
+    }
+  list_push_back (&bc->chunks, &chunk->elem);
+  bc->cache_size += BC_CHUNK_PAGES;
+  bc->pages_left += BC_CHUNK_PAGES;
+  BC_DEBUG ("BC grew to %u pages\n", bc->cache_size);
+  return true;
+}
+
+// bc->evict_lock must be held, bc->pages_left > 0.
+static struct block_page *
+block_cache_alloc_slot (struct block_cache *bc)
+{
+  ASSERT (bc->pages_left > 0);
+  
+  struct block_page *result = allocator_alloc (&bc->pages_allocator, 1);
+  struct list_elem *e;
+  for (e = list_begin (&bc->chunks);
+       result == NULL && e != list_end (&bc->chunks);
+       e = list_next (e))
+    {
+      struct block_cache_chunk *chunk;
+      chunk = list_entry (e, struct block_cache_chunk, elem);
+      result = allocator_alloc (&chunk->allocator, 1);
+    }
+  ASSERT (result != NULL);
+  --bc->pages_left;
+  return result;
+}
+
+// bc->evict_lock must be held, unless the cache is being destroyed.
+static void
+block_cache_free_slot (struct block_cache *bc, struct block_page *page)
+{
+  ++bc->pages_left;
+  if (allocator_contains (&bc->pages_allocator, page))
+    {
+      allocator_free (&bc->pages_allocator, page, 1);
+      return;
+    }
+  struct list_elem *e;
+  for (e = list_begin (&bc->chunks); e != list_end (&bc->chunks);
+       e = list_next (e))
+    {
+      struct block_cache_chunk *chunk;
+      chunk = list_entry (e, struct block_cache_chunk, elem);
+      if (allocator_contains (&chunk->allocator, page))
+        {
+          allocator_free (&chunk->allocator, page, 1);
+          return;
+        }
+    }
+  PANIC ("Page %p does not belong to block cache %p.", page, bc);
+}
+
+// Returns an unused page, either a new or an evicted one.
+// If all pages are leased, waits for one to be returned, or returns NULL
+// unless may_wait.
+static struct block_page *
+block_cache_alloc_page (struct block_cache *bc, bool may_wait)
+{
+  struct block_page *result;
+  bool write_victim = false;
+  
+  lock_acquire (&bc->evict_lock);
+  for (;;)
+    {
+      if (bc->pages_left > 0 || block_cache_grow (bc))
+        {
+          result = block_cache_alloc_slot (bc);
+          result->magic = BC_PAGE_MAGIC;
+          break;
+        }
+        
+      // count as waiter before looking, so no return goes unnoticed:
+      ++bc->evict_waiters;
+      result = block_cache_evict (bc);
+      if (result != NULL)
+        write_victim = result->writing;
+      else if (may_wait)
+        {
+          BC_DEBUG ("BC all pages are leased\n");
+          ++bc->stalls;
+          cond_wait (&bc->page_returned, &bc->evict_lock);
+        }
+      --bc->evict_waiters;
+      if (result != NULL || !may_wait)
+        break;
+    }
+  lock_release (&bc->evict_lock);
+  if (result == NULL)
+    return NULL;
+    
+  if (write_victim)
+    {
+      block_write (bc->device, result->nth, &result->data);
+      struct block_cache_shard *shard = block_cache_shard_of (bc, result->nth);
+      lock_acquire (&shard->lock);
+      struct hash_elem *f UNUSED = hash_delete (&shard->hash,
+                                                &result->hash_elem);
+      ASSERT (f == &result->hash_elem);
+      block_cache_end_write (shard, result);
+      lock_release (&shard->lock);
+    }
+  
+  memset (&result->lru_elem, 0, sizeof (result->lru_elem));
+  result->dirty = false;
+  result->counted_dirty = false;
+  result->io_pending = false;
+  result->writing = false;
+  result->lease_counter = 0;
+  return result;
+}
+
+// Gives back a page of block_cache_alloc_page() that was not needed.
+static void
+block_cache_free_page (struct block_cache *bc, struct block_page *page)
+{
+  ASSERT (page->magic == BC_PAGE_MAGIC);
+  ASSERT (!lru_is_interior (&page->lru_elem));
+  
+  lock_acquire (&bc->evict_lock);
+  block_cache_free_slot (bc, page);
+  cond_broadcast (&bc->page_returned, &bc->evict_lock);
+  lock_release (&bc->evict_lock);
+}
+
+// Evicts all pages of chunk. bc->evict_lock must be held.
+// Fails on dirty pages, which are left to the flusher: the caller may hold
+// vm_lock, so no I/O is done here.
+static bool
+block_cache_empty_chunk (struct block_cache       *bc,
+                         struct block_cache_chunk *chunk)
+{
+  size_t i;
+  for (i = 0; i < BC_CHUNK_PAGES; ++i)
+    {
+      struct block_page *page = allocator_get (&chunk->allocator, i);
+      if (page == NULL)
+        continue;
+        
+      // A page that is not hashed was just allocated by someone else.
+      block_sector_t nth = page->nth;
+      struct block_cache_shard *shard = block_cache_shard_of (bc, nth);
+      lock_acquire (&shard->lock);
+      if (block_cache_lookup (shard, nth) != page ||
+          page->lease_counter > 0 || page->io_pending || page->writing ||
+          page->dirty)
+        {
+          lock_release (&shard->lock);
+          return false;
+        }
+      ++shard->evictions;
+      lru_dispose (&shard->lru, &page->lru_elem, false);
+      hash_delete (&shard->hash, &page->hash_elem);
+      lock_release (&shard->lock);
+      
+      allocator_free (&chunk->allocator, page, 1);
+      ++bc->pages_left;
+    }
+  return true;
+}
+
+bool
+block_cache_shrink (struct block_cache *bc)
+{
+  ASSERT (bc != NULL);
+  ASSERT (bc->magic == BC_MAGIC);
+  ASSERT (intr_get_level () == INTR_ON);
+  
+  bool result = false;
+  lock_acquire (&bc->evict_lock);
+  struct list_elem *e;
+  for (e = list_rbegin (&bc->chunks); e != list_rend (&bc->chunks);
+       e = list_prev (e))
+    {
+      struct block_cache_chunk *chunk;
+      chunk = list_entry (e, struct block_cache_chunk, elem);
+      if (!block_cache_empty_chunk (bc, chunk))
+        continue;
+        
+      list_remove (&chunk->elem);
+      allocator_destroy (&chunk->allocator);
+      free (chunk);
+      bc->cache_size -= BC_CHUNK_PAGES;
+      bc->pages_left -= BC_CHUNK_PAGES;
+      BC_DEBUG ("BC shrank to %u pages\n", bc->cache_size);
+      result = true;
+      break;
+    }
+  lock_release (&bc->evict_lock);
+  return result;
+}
+
+// Returns a leased page of nth. If *retreived is false, the page was not
+// cached and is marked io_pending: the caller must fill it w/o holding any
+// lock, then call block_cache_io_done().
+// Prefetches are not included in the hit ratio, and return NULL instead of
+// waiting if all pages are leased.
+static struct block_page *
+block_cache_retreive (struct block_cache *bc,
+                      block_sector_t      nth,
+                      bool               *retreived,
+                      bool                prefetch)
+{
+  ASSERT (bc != NULL);
+  ASSERT (retreived != NULL);
+  ASSERT (intr_get_level () == INTR_ON);
+  
+  struct block_cache_shard *shard = block_cache_shard_of (bc, nth);
+  struct block_page *result, *fresh = NULL;
+  
+  lock_acquire (&shard->lock);
+  for (;;)
+    {
+      result = block_cache_lookup (shard, nth);
+      if (result != NULL)
+        {
+          if (result->io_pending || result->writing)
+            {
+              cond_wait (&shard->io_done, &shard->lock);
+              continue;
+            }
+          // BC_DEBUG ("BC found %u (%p)\n", nth, &result->data);
+          lru_dispose (&shard->lru, &result->lru_elem, false);
+          if (result->lease_counter++ == 0)
+            result->lease_start = block_cycles ();
+          *retreived = true;
+          if (!prefetch)
+            ++shard->hits;
+          break;
+        }
+        
+      if (fresh != NULL)
+        {
+          // BC_DEBUG ("BC created %u (%p)\n", nth, &fresh->data);
+          result = fresh;
+          fresh = NULL;
+          result->nth = nth;
+          result->lease_counter = 1;
+          result->lease_start = block_cycles ();
+          result->io_pending = true;
+          struct hash_elem *f UNUSED = hash_insert (&shard->hash,
+                                                    &result->hash_elem);
+          ASSERT (f == NULL);
+          *retreived = false;
+          if (!prefetch)
+            ++shard->misses;
+          break;
+        }
+        
+      // getting a page may write back a victim, so don't hold the lock:
+      // a prefetch must not wait for other threads to return their pages:
+      lock_release (&shard->lock);
+      fresh = block_cache_alloc_page (bc, !prefetch);
+      if (fresh == NULL)
+        return NULL;
+      lock_acquire (&shard->lock);
+    }
+  lock_release (&shard->lock);
+  
+  if (fresh != NULL) // someone else retreived nth in the meantime
+    block_cache_free_page (bc, fresh);
+  ASSERT (result->magic == BC_PAGE_MAGIC);
+  return result;
+}
+
+// Ends the io_pending state of a page returned by block_cache_retreive().
+static void
+block_cache_io_done (struct block_cache *bc, struct block_page *page)
+{
+  struct block_cache_shard *shard = block_cache_shard_of (bc, page->nth);
+  
+  lock_acquire (&shard->lock);
+  ASSERT (page->io_pending);
+  page->io_pending = false;
+  cond_broadcast (&shard->io_done, &shard->lock);
+  lock_release (&shard->lock);
+}
+
+// Fills the count io_pending pages of run, which hold consecutive sectors,
+// and returns them as not yet referenced.
+static void
+block_cache_read_run (struct block_cache  *bc,
+                      struct block_page  **run,
+                      size_t               count)
+{
+  size_t i;
+  if (count == 0)
+    return;
+  else if (count == 1)
+    block_read (bc->device, run[0]->nth, &run[0]->data);
+  else
+    {
+      uint8_t *buffer = bc->prefetch_buffer;
+      block_read_multiple (bc->device, run[0]->nth, count, buffer);
+      for (i = 0; i < count; ++i)
+        memcpy (&run[i]->data, &buffer[i * BLOCK_SECTOR_SIZE],
+                BLOCK_SECTOR_SIZE);
+    }
+    
+  for (i = 0; i < count; ++i)
+    {
+      struct block_cache_shard *shard = block_cache_shard_of (bc, run[i]->nth);
+      block_cache_io_done (bc, run[i]);
+      
+      // the first real read should not count as reuse:
+      lock_acquire (&shard->lock);
+      bool returned = block_cache_unlease (shard, run[i]);
+      lru_unreference (&run[i]->lru_elem);
+      lock_release (&shard->lock);
+      if (returned)
+        block_cache_notify_returned (bc);
+    }
+}
+
+// Loads the count sectors starting at first that are not cached yet.
+// Consecutive missing sectors are read with a single block_read_multiple().
+static void
+block_cache_prefetch_run (struct block_cache *bc,
+                          block_sector_t      first,
+                          size_t              count)
+{
+  struct block_page *run[BC_IO_RUN];
+  size_t pending = 0, i;
+  
+  ASSERT (count <= BC_IO_RUN);
+  for (i = 0; i < count; ++i)
+    {
+      block_sector_t nth = first + i;
+      struct block_cache_shard *shard = block_cache_shard_of (bc, nth);
+      lock_acquire (&shard->lock);
+      bool present = block_cache_lookup (shard, nth) != NULL;
+      lock_release (&shard->lock);
+      
+      struct block_page *page = NULL;
+      bool retreived = true;
+      if (!present)
+        page = block_cache_retreive (bc, nth, &retreived, true);
+      if (page != NULL && !retreived)
+        {
+          run[pending++] = page;
+          continue;
+        }
+        
+      // the run of missing sectors ends here:
+      block_cache_read_run (bc, run, pending);
+      pending = 0;
+      if (page != NULL)
+        {
+          lock_acquire (&shard->lock);
+          bool returned = block_cache_unlease (shard, page);
+          lock_release (&shard->lock);
+          if (returned)
+            block_cache_notify_returned (bc);
+        }
+      else if (!present)
+        break; // all pages are leased, drop the rest
+    }
+  block_cache_read_run (bc, run, pending);
+}
+
+static void
+block_cache_prefetcher (void *bc_)
+{
+  struct block_cache *bc = bc_;
+  ASSERT (bc != NULL);
+  ASSERT (intr_get_level () == INTR_ON);
+  
+  for (;;)
+    {
+      sema_down (&bc->prefetch_sema);
+      if (bc->threads_stop)
+        break;
+        
+      // take the next sector and the consecutive sectors queued after it:
+      lock_acquire (&bc->prefetch_lock);
+      ASSERT (bc->prefetch_count > 0);
+      block_sector_t first = bc->prefetch_queue[bc->prefetch_head];
+      size_t count = 0;
+      do
+        {
+          bc->prefetch_head = (bc->prefetch_head + 1) % BC_PREFETCH_QUEUE;
+          --bc->prefetch_count;
+          ++count;
+        }
+      while (count < BC_IO_RUN && bc->prefetch_count > 0 &&
+             bc->prefetch_queue[bc->prefetch_head] == first + count &&
+             sema_try_down (&bc->prefetch_sema));
+      lock_release (&bc->prefetch_lock);
+      
+      block_cache_prefetch_run (bc, first, count);
+    }
+  sema_up (&bc->prefetch_down);
 }
 
 bool
 block_cache_init (struct block_cache *bc,
                   struct block       *device,
                   size_t              cache_size,
-                  bool                in_userspace)
+                  size_t              max_size,
+                  bool                in_userspace,
+                  enum lru_policy     policy)
 {
   ASSERT (bc != NULL);
   ASSERT (device != NULL);
   ASSERT (cache_size > 0);
+  ASSERT (max_size >= cache_size);
   
   memset (bc, 0, sizeof (*bc));
   bc->device = device;
-  if (!allocator_init (&bc->pages_allocator, in_userspace, cache_size,
+  bc->prefetch_buffer = malloc (BC_IO_RUN * BLOCK_SECTOR_SIZE);
+  if (bc->prefetch_buffer == NULL ||
+      !allocator_init (&bc->pages_allocator, in_userspace, cache_size,
                        sizeof (struct block_page)))
-    return false;
-  sema_init (&bc->use_count, cache_size);
-  lru_init (&bc->pages_disposable, 0, NULL, bc);
-  hash_init (&bc->hash, block_cache_page_hash, block_cache_page_less, bc);
-  lock_init (&bc->bc_lock);
+    {
+      free (bc->prefetch_buffer);
+      return false;
+    }
+    
+  size_t i;
+  for (i = 0; i < BC_SHARDS; ++i)
+    {
+      struct block_cache_shard *shard = &bc->shards[i];
+      lock_init (&shard->lock);
+      lru_init (&shard->lru, 0, NULL, bc);
+      lru_set_policy (&shard->lru, policy);
+      hash_init (&shard->hash, block_cache_page_hash, block_cache_page_less,
+                 bc);
+      cond_init (&shard->io_done);
+    }
+    
+  lock_init (&bc->evict_lock);
+  list_init (&bc->chunks);
+  bc->pages_left = cache_size;
+  cond_init (&bc->page_returned);
+  bc->cache_size = cache_size;
+  bc->max_size = max_size;
+  sema_init (&bc->flusher_down, 0);
+  lock_init (&bc->prefetch_lock);
+  sema_init (&bc->prefetch_sema, 0);
+  sema_init (&bc->prefetch_down, 0);
   bc->magic = BC_MAGIC;
-  return true;
+  
+  bc->flusher_thread = thread_create ("[BC-FLUSHER]", PRI_DEFAULT,
+                                      &block_cache_flusher, bc);
+  if (bc->flusher_thread != TID_ERROR)
+    {
+      bc->prefetch_thread = thread_create ("[BC-PREFETCH]", PRI_DEFAULT,
+                                           &block_cache_prefetcher, bc);
+      if (bc->prefetch_thread != TID_ERROR)
+        return true;
+      bc->threads_stop = true;
+      sema_down (&bc->flusher_down);
+    }
+    
+  for (i = 0; i < BC_SHARDS; ++i)
+    hash_destroy (&bc->shards[i].hash, NULL);
+  allocator_destroy (&bc->pages_allocator);
+  free (bc->prefetch_buffer);
+  bc->magic ^= -1u;
+  return false;
 }
 
 static void
 block_cache_flush_all_sub (struct hash_elem *e, void *bc_)
 {
+  ASSERT (e != NULL);
   struct block_cache *bc = bc_;
   ASSERT (bc != NULL);
-  ASSERT (e != NULL);
-  
   struct block_page *ee = hash_entry (e, struct block_page, hash_elem);
   typedef char _CASSERT[0 - !(sizeof (unsigned) == sizeof (ee->nth))];
   ASSERT (ee->magic == BC_PAGE_MAGIC);
   
-  block_cache_flush (bc, ee);
+  if (!ee->io_pending)
+    block_cache_write_back (bc, block_cache_shard_of (bc, ee->nth), ee);
 }
 
 static void
 block_cache_destroy_sub (struct hash_elem *e, void *bc_)
 {
+  ASSERT (e != NULL);
   struct block_cache *bc = bc_;
   ASSERT (bc != NULL);
-  ASSERT (e != NULL);
-  
   struct block_page *ee = hash_entry (e, struct block_page, hash_elem);
   typedef char _CASSERT[0 - !(sizeof (unsigned) == sizeof (ee->nth))];
   ASSERT (ee->magic == BC_PAGE_MAGIC);
+  ASSERT (!ee->io_pending);
   
-  block_cache_flush (bc, ee);
-  allocator_free (&bc->pages_allocator, ee, 1);
+  block_cache_write_back (bc, block_cache_shard_of (bc, ee->nth), ee);
+  block_cache_free_slot (bc, ee);
 }
 
 void
@@ -103,82 +946,91 @@ block_cache_destroy (struct block_cache *bc)
   ASSERT (bc->magic == BC_MAGIC);
   ASSERT (intr_get_level () == INTR_ON);
   
-  hash_destroy (&bc->hash, &block_cache_destroy_sub);
+  bc->threads_stop = true;
+  sema_up (&bc->prefetch_sema);
+  sema_down (&bc->prefetch_down);
+  sema_down (&bc->flusher_down);
+  
+  size_t i;
+  for (i = 0; i < BC_SHARDS; ++i)
+    hash_destroy (&bc->shards[i].hash, &block_cache_destroy_sub);
   allocator_destroy (&bc->pages_allocator);
+  while (!list_empty (&bc->chunks))
+    {
+      struct list_elem *e = list_pop_front (&bc->chunks);
+      struct block_cache_chunk *chunk;
+      chunk = list_entry (e, struct block_cache_chunk, elem);
+      allocator_destroy (&chunk->allocator);
+      free (chunk);
+    }
+  free (bc->prefetch_buffer);
   
   bc->magic ^= -1u;
 }
 
-// exits with bc->bc_lock locked!
-static struct block_page *
-block_cache_retreive (struct block_cache *bc,
-                      block_sector_t      nth,
-                      bool               *retreived)
+// Queues sectors for the prefetcher, bc->prefetch_lock must be held.
+static void
+block_cache_prefetch_locked (struct block_cache *bc,
+                             block_sector_t      first,
+                             size_t              count)
 {
-  ASSERT (bc != NULL);
-  ASSERT (intr_get_level () == INTR_ON);
-    
-start:
-  lock_acquire (&bc->bc_lock);
+  ASSERT (lock_held_by_current_thread (&bc->prefetch_lock));
   
-  struct block_page *result;
-  struct block_page key;
-  key.nth = nth;
-  key.magic = BC_PAGE_MAGIC;
-  struct hash_elem *e = hash_find (&bc->hash, &key.hash_elem);
-  if (e != NULL)
-    {
-      if (retreived)
-        *retreived = true;
-      result = hash_entry (e, struct block_page, hash_elem);
-      // BC_DEBUG ("BC found %u (%p)\n", nth, &result->data);
-      goto end;
-    }
-    
-  if (retreived)
-    *retreived = false;
+  block_sector_t size = block_size (bc->device);
+  if (first >= size)
+    return;
+  if (count > size - first)
+    count = size - first;
   
-  if (sema_try_down (&bc->use_count))
+  for (; count > 0 && bc->prefetch_count < BC_PREFETCH_QUEUE; --count)
     {
-      result = allocator_alloc (&bc->pages_allocator, 1);
-      result->magic = BC_PAGE_MAGIC;
-      memset (&result->lru_elem, 0, sizeof (result->lru_elem));
+      size_t i = (bc->prefetch_head + bc->prefetch_count) % BC_PREFETCH_QUEUE;
+      bc->prefetch_queue[i] = first++;
+      ++bc->prefetch_count;
+      sema_up (&bc->prefetch_sema);
     }
-  else if (lru_is_empty (&bc->pages_disposable))
+}
+
+// Detects sequential reads and queues the sectors following them.
+// A read that continues none of the streams replaces the least recently
+// used one, reading the same sector again is no interruption. A read up to
+// BC_READAHEAD_GAP sectors ahead continues a stream, as cache hits skip the
+// tracking if the lock is contended.
+// bc->prefetch_lock must be held.
+static void
+block_cache_readahead (struct block_cache *bc, block_sector_t nth)
+{
+  ASSERT (lock_held_by_current_thread (&bc->prefetch_lock));
+  
+  struct block_cache_stream *stream = NULL;
+  size_t i;
+  for (i = 0; i < BC_STREAMS && stream == NULL; ++i)
+    if (nth >= bc->streams[i].last_read &&
+        nth - bc->streams[i].last_read <= BC_READAHEAD_GAP)
+      stream = &bc->streams[i];
+  if (stream == NULL)
     {
-      BC_DEBUG ("BC lru_is_empty (%u)\n", nth);
-      
-      lock_release (&bc->bc_lock);
-      sema_down (&bc->use_count);
-      
-      sema_up (&bc->use_count);
-      goto start;
+      stream = &bc->streams[0];
+      for (i = 1; i < BC_STREAMS; ++i)
+        if (bc->streams[i].last_use < stream->last_use)
+          stream = &bc->streams[i];
+      stream->seq_reads = 0;
+      stream->readahead_end = 0;
     }
-  else
+  else if (stream->last_read < nth)
+    ++stream->seq_reads;
+  stream->last_read = nth;
+  stream->last_use = ++bc->streams_clock;
+  
+  if (stream->seq_reads >= BC_READAHEAD_MIN &&
+      nth + BC_READAHEAD_WINDOW / 2 >= stream->readahead_end)
     {
-      struct lru_elem *e = lru_pop_least (&bc->pages_disposable);
-      result = lru_entry (e, struct block_page, lru_elem);
-      ASSERT (result->magic == BC_PAGE_MAGIC);
-      BC_DEBUG ("BC reusing %u as %u\n", result->nth, nth);
-      
-      block_cache_flush (bc, result);
-      
-      struct hash_elem *f UNUSED = hash_delete (&bc->hash, &result->hash_elem);
-      ASSERT (f == &result->hash_elem);
+      block_sector_t first = nth + 1 > stream->readahead_end ?
+                             nth + 1 : stream->readahead_end;
+      block_sector_t end = nth + 1 + BC_READAHEAD_WINDOW;
+      stream->readahead_end = end;
+      block_cache_prefetch_locked (bc, first, end - first);
     }
-    
-  result->lease_counter = 0;
-  result->nth = nth;
-  struct hash_elem *f UNUSED = hash_insert (&bc->hash, &result->hash_elem);
-  ASSERT (f == NULL);
-  
-  // BC_DEBUG ("BC created %u (%p)\n", nth, &result->data);
-  
-end:
-  ASSERT (result->magic == BC_PAGE_MAGIC);
-  lru_dispose (&bc->pages_disposable, &result->lru_elem, false);
-  ++result->lease_counter;
-  return result;
 }
 
 struct block_page *
@@ -189,15 +1041,24 @@ block_cache_read (struct block_cache *bc, block_sector_t nth)
   ASSERT (intr_get_level () == INTR_ON);
   
   bool retreived;
-  struct block_page *result = block_cache_retreive (bc, nth, &retreived);
+  struct block_page *result = block_cache_retreive (bc, nth, &retreived,
+                                                          false);
   ASSERT (result != NULL);
   BC_DEBUG ("BC read %d [%u]\n", nth, result->lease_counter);
   if (!retreived)
     {
       block_read (bc->device, nth, &result->data);
-      result->dirty = false;
+      block_cache_io_done (bc, result);
     }
-  lock_release (&bc->bc_lock);
+    
+  // hits must not serialize on the lock, a miss waited for the disk anyway:
+  if (!retreived)
+    lock_acquire (&bc->prefetch_lock);
+  else if (!lock_try_acquire (&bc->prefetch_lock))
+    return result;
+  block_cache_readahead (bc, nth);
+  lock_release (&bc->prefetch_lock);
+  
   return result;
 }
 
@@ -209,17 +1070,17 @@ block_cache_write (struct block_cache *bc, block_sector_t nth)
   ASSERT (intr_get_level () == INTR_ON);
   
   bool retreived;
-  struct block_page *result = block_cache_retreive (bc, nth, &retreived);
+  struct block_page *result = block_cache_retreive (bc, nth, &retreived,
+                                                          false);
   ASSERT (result != NULL);
   BC_DEBUG ("BC write %d [%u]\n", nth, result->lease_counter);
   if (!retreived)
     {
       // FIXME: concurrency failures in calling code
       block_read (bc->device, nth, &result->data);
-      result->dirty = false;
+      block_cache_io_done (bc, result);
     }
   result->dirty = true;
-  lock_release (&bc->bc_lock);
   return result;
 }
 
@@ -230,20 +1091,92 @@ block_cache_return (struct block_cache *bc, struct block_page *page)
   ASSERT (bc->magic == BC_MAGIC);
   ASSERT (page != NULL);
   ASSERT (page->magic == BC_PAGE_MAGIC);
+  ASSERT (intr_get_level () == INTR_ON);
   
-  BC_DEBUG ("BC return %d (%s) [%u].\n", page->nth,
-            page->dirty ? "DIRTY" : "clean", page->lease_counter);
-  
+  struct block_cache_shard *shard = block_cache_shard_of (bc, page->nth);
+  lock_acquire (&shard->lock);
   ASSERT (page->lease_counter > 0);
-  ASSERT (!lru_is_interior (&page->lru_elem));
+  bool returned = block_cache_unlease (shard, page);
+  lock_release (&shard->lock);
+  if (returned)
+    block_cache_notify_returned (bc);
+}
+
+void
+block_cache_prefetch (struct block_cache *bc,
+                      block_sector_t      first,
+                      size_t              count)
+{
+  ASSERT (bc != NULL);
+  ASSERT (bc->magic == BC_MAGIC);
   
-  lock_acquire (&bc->bc_lock);
-  if (--page->lease_counter == 0)
+  lock_acquire (&bc->prefetch_lock);
+  block_cache_prefetch_locked (bc, first, count);
+  lock_release (&bc->prefetch_lock);
+}
+
+void
+block_cache_get_stats (struct block_cache       *bc,
+                       struct block_cache_stats *stats)
+{
+  ASSERT (bc != NULL);
+  ASSERT (bc->magic == BC_MAGIC);
+  ASSERT (stats != NULL);
+  
+  // racy reads are good enough
+  memset (stats, 0, sizeof (*stats));
+  stats->pages = bc->cache_size;
+  stats->stalls = bc->stalls;
+  size_t i, j;
+  for (i = 0; i < BC_SHARDS; ++i)
+    {
+      struct block_cache_shard *shard = &bc->shards[i];
+      stats->hits += shard->hits;
+      stats->misses += shard->misses;
+      stats->evictions += shard->evictions;
+      stats->writebacks += shard->writebacks;
+      for (j = 0; j < BLOCK_HIST_BUCKETS; ++j)
+        stats->lease_hist[j] += shard->lease_hist[j];
+    }
+}
+
+void
+block_cache_print_stats (struct block_cache *bc)
+{
+  struct block_cache_stats stats;
+  block_cache_get_stats (bc, &stats);
+  
+  printf ("%s cache: %u pages, %u hits, %u misses (%u%% hits), "
+          "%u evictions, %u writebacks, %u stalls\n",
+          block_name (bc->device), stats.pages, stats.hits, stats.misses,
+          block_cache_hit_ratio (bc, NULL, NULL), stats.evictions,
+          stats.writebacks, stats.stalls);
+  block_print_hist ("  lease durations", stats.lease_hist);
+}
+
+unsigned
+block_cache_hit_ratio (struct block_cache *bc,
+                       size_t             *hits,
+                       size_t             *misses)
+{
+  ASSERT (bc != NULL);
+  ASSERT (bc->magic == BC_MAGIC);
+  
+  size_t h = 0, m = 0, i;
+  for (i = 0; i < BC_SHARDS; ++i)
     {
-      // block_cache_flush (bc, page);
-      lru_use (&bc->pages_disposable, &page->lru_elem);
+      h += bc->shards[i].hits; // racy read is good enough
+      m += bc->shards[i].misses;
     }
-  lock_release (&bc->bc_lock);
+  if (hits)
+    *hits = h;
+  if (misses)
+    *misses = m;
+  if (h + m == 0)
+    return 0;
+  if (h > SIZE_MAX / 100)
+    return h / ((h + m) / 100);
+  return h * 100 / (h + m);
 }
 
 void
@@ -255,11 +1188,94 @@ block_cache_flush (struct block_cache *bc, struct block_page *page)
   ASSERT (page->magic == BC_PAGE_MAGIC);
   ASSERT (intr_get_level () == INTR_ON);
   
-  if (!page->dirty)
+  struct block_cache_shard *shard = block_cache_shard_of (bc, page->nth);
+  lock_acquire (&shard->lock);
+  while (page->writing)
+    cond_wait (&shard->io_done, &shard->lock);
+  bool dirty = page->dirty;
+  if (dirty)
+    block_cache_start_write (shard, page);
+  lock_release (&shard->lock);
+  if (!dirty)
     return;
     
   block_write (bc->device, page->nth, &page->data);
-  page->dirty = false;
+  lock_acquire (&shard->lock);
+  bool returned = block_cache_end_write (shard, page);
+  lock_release (&shard->lock);
+  if (returned)
+    block_cache_notify_returned (bc);
+}
+
+// Writes back the dirty ones of up to BC_FLUSH_MANY leased pages.
+static void
+block_cache_flush_batch (struct block_cache  *bc,
+                         struct block_page  **pages,
+                         size_t               count)
+{
+  ASSERT (count <= BC_FLUSH_MANY);
+  
+  // The pages are leased by the caller, so the flusher leaves them alone,
+  // but another lessee may be flushing one of them. Lessees may return a
+  // page while it is written.
+  struct block_page *written[BC_FLUSH_MANY];
+  struct semaphore done;
+  size_t written_count = 0, i;
+  sema_init (&done, 0);
+  for (i = 0; i < count; ++i)
+    {
+      struct block_page *page = pages[i];
+      ASSERT (page->magic == BC_PAGE_MAGIC);
+      ASSERT (page->lease_counter > 0);
+      
+      struct block_cache_shard *shard = block_cache_shard_of (bc, page->nth);
+      lock_acquire (&shard->lock);
+      while (page->writing)
+        cond_wait (&shard->io_done, &shard->lock);
+      bool dirty = page->dirty;
+      if (dirty)
+        block_cache_start_write (shard, page);
+      lock_release (&shard->lock);
+      
+      if (dirty)
+        {
+          block_cache_submit_write (bc, page, &done);
+          written[written_count++] = page;
+        }
+    }
+  for (i = 0; i < written_count; ++i)
+    sema_down (&done);
+    
+  bool returned = false;
+  for (i = 0; i < written_count; ++i)
+    {
+      struct block_page *page = written[i];
+      struct block_cache_shard *shard = block_cache_shard_of (bc, page->nth);
+      lock_acquire (&shard->lock);
+      returned |= block_cache_end_write (shard, page);
+      lock_release (&shard->lock);
+    }
+  if (returned)
+    block_cache_notify_returned (bc);
+}
+
+void
+block_cache_flush_many (struct block_cache  *bc,
+                        struct block_page  **pages,
+                        size_t               count)
+{
+  ASSERT (bc != NULL);
+  ASSERT (bc->magic == BC_MAGIC);
+  ASSERT (pages != NULL || count == 0);
+  ASSERT (intr_get_level () == INTR_ON);
+  
+  while (count > 0)
+    {
+      size_t n = count < BC_FLUSH_MANY ? count : BC_FLUSH_MANY;
+      block_cache_flush_batch (bc, pages, n);
+      pages += n;
+      count -= n;
+    }
 }
 
 void
@@ -269,7 +1285,11 @@ block_cache_flush_all (struct block_cache *bc)
   ASSERT (bc->magic == BC_MAGIC);
   ASSERT (intr_get_level () == INTR_ON);
   
-  lock_acquire (&bc->bc_lock);
-  hash_apply (&bc->hash, &block_cache_flush_all_sub);
-  lock_release (&bc->bc_lock);
+  size_t i;
+  for (i = 0; i < BC_SHARDS; ++i)
+    {
+      lock_acquire (&bc->shards[i].lock);
+      hash_apply (&bc->shards[i].hash, &block_cache_flush_all_sub);
+      lock_release (&bc->shards[i].lock);
+    }
 }
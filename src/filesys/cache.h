@@ -7,25 +7,87 @@
 #include <hash.h>
 #include "threads/synch.h"
 #include "devices/block.h"
+#include "threads/thread.h"
 #include "vm/lru.h"
 #include "vm/allocator.h"
 
 // block_cache may be used concurrently w/o destroying metadata,
 // but caller must be aware of any races for the actual (block device's) data.
 // Reading, writing and flushing depends on INTR_ON.
+// The pages are split into BC_SHARDS independently locked shards by sector,
+// and no shard lock is held while a missing sector is read.
+// A page is not leased while its write-behind is in flight, so the device
+// never gets a page that is changed meanwhile.
+// A write-behind thread cleans dirty pages in the background, every
+// BC_FLUSH_INTERVAL_MS or as soon as BC_DIRTY_RATIO % of the cache is dirty.
+// Another thread loads prefetched sectors, see block_cache_prefetch().
+// The cache grows up to max_size pages with user frames while the user pool
+// has free frames, block_cache_shrink() gives such frames back once the
+// flusher has cleaned their pages.
+
+#define BC_SHARDS         8  // count of independently locked shards
+#define BC_PREFETCH_QUEUE 32 // max. count of sectors waiting to be prefetched
+#define BC_IO_RUN         8  // max. sectors the threads transfer at once
+#define BC_STREAMS        4  // sequential readers read-ahead is tracked for
 
 typedef char block_data[BLOCK_SECTOR_SIZE];
 
+struct block_cache_shard
+{
+  struct lock       lock;        // guards the members and the shard's pages
+  struct lru        lru;         // returned pages (the cache)
+  struct hash       hash;        // [nth -> struct block_page]
+  struct condition  io_done;     // signaled when a page's io_pending ends
+  size_t            dirty_count; // dirty pages in lru
+  size_t            hits;        // lookups that found their sector
+  size_t            misses;      // lookups that had to read their sector
+  size_t            evictions;   // pages reused for another sector
+  size_t            writebacks;  // dirty pages written to the device
+  uint32_t          lease_hist[BLOCK_HIST_BUCKETS]; // lease durations
+};
+
+// A sequential reader, as detected by block_cache_read().
+struct block_cache_stream
+{
+  block_sector_t    last_read;        // sector of the last read
+  size_t            seq_reads;        // count of ascending reads in a row
+  block_sector_t    readahead_end;    // sectors below are already queued
+  size_t            last_use;         // block_cache::streams_clock of it
+};
+
 struct block_cache
 {
 /* public */
   struct block     *device;           // associated block device
 /* private: */
-  struct semaphore  use_count;        // count of items left in pages_allocator
+  struct block_cache_shard shards[BC_SHARDS]; // [nth % BC_SHARDS]
+  
+  struct lock       evict_lock;       // guards the following members
   struct allocator  pages_allocator;  // allocator of struct block_page
-  struct lru        pages_disposable; // returned pages (the cache)
-  struct hash       hash;             // [nth -> struct block_page]
-  struct lock       bc_lock;          // concurrent modification lock
+  struct list       chunks;           // grown struct block_cache_chunk
+  size_t            pages_left;       // count of unallocated pages
+  size_t            evict_hand;       // shard to take the next victim from
+  struct condition  page_returned;    // signaled when a page enters an lru
+  volatile size_t   evict_waiters;    // threads waiting for page_returned
+  size_t            stalls;           // waits for page_returned
+  size_t            cache_size;       // current max. count of pages
+  size_t            max_size;         // cache_size may grow up to this
+  
+  tid_t             flusher_thread;   // write-behind thread
+  volatile bool     threads_stop;     // tells the flusher/prefetcher to exit
+  struct semaphore  flusher_down;     // up'd by the exiting flusher
+  
+  struct lock       prefetch_lock;    // guards the prefetch/read-ahead members
+  block_sector_t    prefetch_queue[BC_PREFETCH_QUEUE]; // ring buffer
+  size_t            prefetch_head;    // index of the next sector to load
+  size_t            prefetch_count;   // sectors in prefetch_queue
+  struct semaphore  prefetch_sema;    // up'd for every queued sector
+  tid_t             prefetch_thread;  // loads the queued sectors
+  struct semaphore  prefetch_down;    // up'd by the exiting prefetcher
+  void             *prefetch_buffer;  // BC_IO_RUN sectors, used by prefetcher
+  
+  struct block_cache_stream streams[BC_STREAMS]; // for read-ahead
+  size_t            streams_clock;    // count of reads, ages the streams
   
   uint32_t          magic;            // ensures the struct is initialized
 };
@@ -39,15 +101,22 @@ struct block_page
   uint32_t         magic; // ensure user does not write too much data
   
   size_t           lease_counter; // how often this block was leased
+  uint64_t         lease_start; // block_cycles() when lease_counter left 0
+  bool             counted_dirty; // included in block_cache_shard::dirty_count
+  bool             io_pending; // data is being read from the device
+  bool             writing; // request is queued, data is being written
   block_sector_t   nth;// nth sector of the block device
-  struct lru_elem  lru_elem; // struct block_cache::pages_disposable
-  struct hash_elem hash_elem; // struct block_cache::hash
+  struct lru_elem  lru_elem; // struct block_cache_shard::lru
+  struct hash_elem hash_elem; // struct block_cache_shard::hash
+  struct block_request request; // write-behind, valid while writing
 };
 
 bool block_cache_init (struct block_cache *bc,
                        struct block       *device,
                        size_t              cache_size,
-                       bool                in_userspace);
+                       size_t              max_size,
+                       bool                in_userspace,
+                       enum lru_policy     policy);
 void block_cache_destroy (struct block_cache *bc);
 
 // result::data will contain blocks data
@@ -60,8 +129,43 @@ struct block_page *block_cache_write (struct block_cache *bc,
 // Holding more than one page at a time may render a deadlock!
 void block_cache_return (struct block_cache *bc, struct block_page *page);
 
+// Queues [first, first+count[ to be read in the background.
+// Does not block, sectors are dropped if the queue is full.
+void block_cache_prefetch (struct block_cache *bc,
+                           block_sector_t      first,
+                           size_t              count);
+
+// Frees a frame that was used to grow the cache.
+// Returns false if there is none or its pages are in use.
+bool block_cache_shrink (struct block_cache *bc);
+
+struct block_cache_stats
+{
+  size_t   pages;      // current max. count of pages
+  size_t   hits;       // reads and writes that found their sector
+  size_t   misses;     // reads and writes that had to read their sector
+  size_t   evictions;  // pages reused for another sector
+  size_t   writebacks; // dirty pages written to the device
+  size_t   stalls;     // waits because every page was leased
+  uint32_t lease_hist[BLOCK_HIST_BUCKETS]; // how long pages were leased
+};
+
+void block_cache_get_stats (struct block_cache       *bc,
+                            struct block_cache_stats *stats);
+void block_cache_print_stats (struct block_cache *bc);
+
+// hit ratio of reads and writes (not prefetches) in percent
+unsigned block_cache_hit_ratio (struct block_cache *bc,
+                                size_t             *hits,
+                                size_t             *misses);
+
 void block_cache_flush (struct block_cache *bc, struct block_page *page);
 void block_cache_flush_all (struct block_cache *bc);
+// Writes back the dirty ones of count distinct pages, which the caller has
+// leased, all queued at once, so the device can sort and merge them.
+void block_cache_flush_many (struct block_cache  *bc,
+                             struct block_page  **pages,
+                             size_t               count);
 
 // Convenience methods:
 
@@ -12,6 +12,7 @@ struct file
     struct pifs_inode *inode;      /* File's inode. */
     off_t              pos;        /* Current position. */
     bool               deny_write; /* Has file_deny_write() been called? */
+    struct pifs_readdir_cursor readdir; /* Position of file_readdir(). */
   };
 
 /* Opens a file for the given INODE, of which it takes ownership,
@@ -30,6 +31,8 @@ file_open (struct pifs_inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->readdir.sector = 0;
+      file->readdir.slot = 0;
       return file;
     }
   else
@@ -143,6 +146,47 @@ file_write_at (struct file *file, const void *buffer, off_t size,
   return pifs_write (file->inode, file_ofs, size, buffer);
 }
 
+/* Reads the next entry of the directory FILE into NAME, which has
+   room for SIZE bytes including the null terminator, and advances
+   FILE's directory position.  Returns false at the end of the
+   directory, if FILE is no directory, or if the name does not fit.
+   In the latter case the position is unaffected. */
+bool
+file_readdir (struct file *file, char *name, off_t size)
+{
+  ASSERT (file != NULL);
+  ASSERT (file->magic == FILE_MAGIC);
+  ASSERT (size > 0);
+  
+  return pifs_readdir (file->inode, &file->readdir, &size, name);
+}
+
+/* Allocates the first LENGTH bytes of FILE on disk in as few runs
+   of consecutive sectors as possible, growing FILE with zeros if it
+   is shorter.  Returns true if successful, false if the disk is too
+   full.  The file's current position is unaffected. */
+bool
+file_allocate (struct file *file, off_t length)
+{
+  ASSERT (file != NULL);
+  ASSERT (file->magic == FILE_MAGIC);
+  ASSERT (length >= 0);
+  
+  return pifs_allocate (file->inode, length);
+}
+
+/* Moves the data of FILE into as few runs of consecutive sectors
+   as possible.  FILE can be read and written meanwhile.  Returns
+   false if FILE is a directory. */
+bool
+file_defrag (struct file *file)
+{
+  ASSERT (file != NULL);
+  ASSERT (file->magic == FILE_MAGIC);
+  
+  return pifs_defrag (file->inode);
+}
+
 /* Prevents write operations on FILE's underlying inode
    until file_allow_write() is called or FILE is closed. */
 void
@@ -154,7 +198,7 @@ file_deny_write (struct file *file)
   if (!file->deny_write) 
     {
       file->deny_write = true;
-      ++file->inode->deny_write_cnt;
+      __sync_add_and_fetch (&file->inode->deny_write_cnt, 1);
     }
 }
 
@@ -171,7 +215,7 @@ file_allow_write (struct file *file)
     {
       file->deny_write = false;
       ASSERT (file->inode->deny_write_cnt > 0);
-      --file->inode->deny_write_cnt;
+      __sync_sub_and_fetch (&file->inode->deny_write_cnt, 1);
     }
 }
 
@@ -18,6 +18,11 @@ off_t file_read (struct file *, void *, off_t);
 off_t file_read_at (struct file *, void *, off_t size, off_t start);
 off_t file_write (struct file *, const void *, off_t);
 off_t file_write_at (struct file *, const void *, off_t size, off_t start);
+bool file_allocate (struct file *, off_t length);
+bool file_defrag (struct file *);
+
+/* Reading directories. */
+bool file_readdir (struct file *, char *name, off_t size);
 
 /* Preventing writes. */
 void file_deny_write (struct file *);
@@ -11,10 +11,20 @@
 #include "threads/malloc.h"
 
 #define FS_CACHE_SIZE 64
+#define FS_CACHE_MAX_SIZE 1024
 #define FS_CACHE_IN_USERSPACE false
+#define FS_CACHE_POLICY LRU_POLICY_2Q
+
+typedef char _CASSERT_FSSTAT_HIST[0 - !(FSSTAT_HIST_BUCKETS ==
+                                        BLOCK_HIST_BUCKETS &&
+                                        FSSTAT_HIST_BASE == BLOCK_HIST_BASE)];
 
 static bool fs_initialized;
 
+/* Initial and max. count of cached sectors, see -fs-cache. */
+size_t fs_cache_size = FS_CACHE_SIZE;
+size_t fs_cache_max_size = FS_CACHE_MAX_SIZE;
+
 /* Partition that contains the file system. */
 static struct block       *fs_device;
 static struct block_cache  fs_cache;
@@ -34,8 +44,19 @@ filesys_init (bool format)
   fs_device = block_get_role (BLOCK_FILESYS);
   if (fs_device == NULL)
     PANIC ("No file system device found, can't initialize file system.");
-  if (!block_cache_init (&fs_cache, fs_device, FS_CACHE_SIZE,
-                         FS_CACHE_IN_USERSPACE))
+  if (fs_cache_size == 0)
+    fs_cache_size = FS_CACHE_SIZE;
+  if (fs_cache_size < PIFS_CACHE_MIN)
+    {
+      printf ("Filesys cache needs at least %u sectors, using %u.\n",
+              PIFS_CACHE_MIN, PIFS_CACHE_MIN);
+      fs_cache_size = PIFS_CACHE_MIN;
+    }
+  if (fs_cache_max_size < fs_cache_size)
+    fs_cache_max_size = fs_cache_size;
+  if (!block_cache_init (&fs_cache, fs_device, fs_cache_size,
+                         fs_cache_max_size, FS_CACHE_IN_USERSPACE,
+                         FS_CACHE_POLICY))
     PANIC ("Filesys cache could not be intialized.");
   if (!pifs_init (&fs_pifs, &fs_cache))
     PANIC ("PIFS could not be intialized.");
@@ -68,10 +89,51 @@ filesys_done (void)
   ASSERT (intr_get_level () == INTR_ON);
     
   pifs_destroy (&fs_pifs);
+  block_cache_print_stats (&fs_cache);
   block_cache_destroy (&fs_cache);
   printf ("Filesystem has shut down.\n");
 }
 
+/* Gives a frame of the file system cache back to the user pool.
+   Returns false if the cache could not shrink. */
+bool
+filesys_cache_shrink (void)
+{
+  if (!fs_initialized)
+    return false;
+  return block_cache_shrink (&fs_cache);
+}
+
+/* Fills STATS with the statistics of the file system cache and device. */
+void
+filesys_get_stats (struct fsstat *stats)
+{
+  ASSERT (stats != NULL);
+  ASSERT (fs_initialized);
+  
+  struct block_cache_stats cache;
+  struct block_stats device;
+  block_cache_get_stats (&fs_cache, &cache);
+  block_get_stats (fs_device, &device);
+  
+  stats->cache_pages = cache.pages;
+  stats->hits = cache.hits;
+  stats->misses = cache.misses;
+  stats->evictions = cache.evictions;
+  stats->writebacks = cache.writebacks;
+  stats->stalls = cache.stalls;
+  stats->reads = device.read_cnt;
+  stats->writes = device.write_cnt;
+  
+  size_t i;
+  for (i = 0; i < FSSTAT_HIST_BUCKETS; ++i)
+    {
+      stats->lease_hist[i] = cache.lease_hist[i];
+      stats->read_hist[i] = device.read_hist[i];
+      stats->write_hist[i] = device.write_hist[i];
+    }
+}
+
 /* Creates a file named NAME with the given INITIAL_SIZE.
    Returns true if successful, false otherwise.
    Fails if a file named NAME already exists,
@@ -84,38 +146,15 @@ filesys_create (const char *name, off_t initial_size)
   if (!inode)
     return false;
     
-  if (initial_size <= 0)
-    {
-      pifs_close (inode);
-      return true;
-    }
-    
-  void *space = malloc (512);
-  if (!space)
+  // allocate the initial size at once, so it gets a contiguous run:
+  
+  if (initial_size > 0 && !pifs_allocate (inode, initial_size))
     {
       pifs_delete_file (inode);
       pifs_close (inode);
       return false;
     }
-  memset (space, 0, 512);
-    
-  size_t pos = 0;
-  while (initial_size > 0)
-    {
-      off_t len = initial_size > 512 ? 512  : initial_size;
-      off_t wrote = pifs_write (inode, pos, len, space);
-      if (wrote < 0)
-        {
-          free (space);
-          pifs_delete_file (inode);
-          pifs_close (inode);
-          return false;
-        }
-      pos += wrote;
-      initial_size -= wrote;
-    }
     
-  free (space);
   pifs_close (inode);
   return true;
 }
@@ -2,12 +2,17 @@
 #define FILESYS_FILESYS_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <fsstat.h>
 #include "filesys/off_t.h"
 
 extern struct pifs_device fs_pifs;
+extern size_t fs_cache_size, fs_cache_max_size;
 
 void filesys_init (bool format);
 void filesys_done (void);
+bool filesys_cache_shrink (void);
+void filesys_get_stats (struct fsstat *stats);
 
 bool filesys_create (const char *name, off_t initial_size);
 bool filesys_create_folder (const char *name);
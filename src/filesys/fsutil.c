@@ -25,9 +25,9 @@ fsutil_ls (char **argv UNUSED)
     PANIC ("root dir open failed");
     
   char name[32];
-  size_t nth = 0;
+  struct pifs_readdir_cursor cursor = { 0, 0 };
   off_t len = sizeof (name);
-  while (pifs_readdir (dir, nth++, &len, name))
+  while (pifs_readdir (dir, &cursor, &len, name))
     printf ("%.*s\n", len, name);
     
   pifs_close (dir);
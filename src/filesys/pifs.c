@@ -1,6 +1,7 @@
 #include "pifs.h"
 #include "bitset.h"
 
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
@@ -12,8 +13,10 @@
 #include "threads/malloc.h"
 #include "threads/interrupt.h"
 #include "userprog/process.h"
+#include "devices/timer.h"
 
 #define PIFS_NAME_LENGTH 16
+#define PIFS_DENTRY_MAX 256 // max. count of cached lookups
 
 #define PIFS_DEBUG_DESTROY_HEADER
 
@@ -39,6 +42,8 @@ typedef uint32_t pifs_magic;
 #define PIFS_MAGIC_FOLDER MAGIC4 ("FLDR")
 #define PIFS_MAGIC_FILE   MAGIC4 ("FILE")
 #define PIFS_MAGIC_NAME   MAGIC4 ("NAME")
+#define PIFS_MAGIC_INDEX  MAGIC4 ("INDX")
+#define PIFS_MAGIC_JOURNAL MAGIC4 ("JRNL")
 
 typedef uint32_t pifs_ptr;
 typedef char _CASSERT_PIFS_PTR_SIZE[0 - !(sizeof (pifs_ptr) ==
@@ -50,6 +55,55 @@ typedef char _CASSERT_PIFS_PTR_SIZE[0 - !(sizeof (pifs_ptr) ==
                                   /* ~12 MB per block (w/ min. fragmentation) */
 #define PIFS_COUNT_LONG_NAME_CHARS 491
 #define PIFS_COUNT_FILE_REF_COUNT_MAX 255
+#define PIFS_COUNT_INDEX_BUCKETS 122
+
+// A file without blocks keeps up to this many bytes in its inode sector,
+// where the block refs would be. It is moved to a block when it grows.
+#define PIFS_INLINE_MAX (PIFS_COUNT_FILE_BLOCKS * 5)
+
+// Growing a file preallocates as many blocks as it already has, up to this
+// many, so that appends find their space in the same run. The preallocated
+// blocks beyond the end of the file are freed when it is closed.
+#define PIFS_PREALLOC_MAX 128
+
+// Files closed with more runs than this are defragmented in background.
+#define PIFS_DEFRAG_EXTENTS 16
+#define PIFS_DEFRAG_BATCH 16 // blocks copied, then written at once
+#define PIFS_ZERO_BATCH 16 // blocks of a filled hole zeroed, then written
+
+// The journal is a descriptor block followed by the images of up to
+// PIFS_JOURNAL_MAX metadata sectors. Every operation that changes metadata
+// runs as a handle, which reserves credits for the sectors it may change.
+#define PIFS_JOURNAL_BLOCKS (1 + PIFS_JOURNAL_MAX)
+#define PIFS_JOURNAL_INTERVAL_MS 1000 // commit at least this often
+#define PIFS_GROW_RUNS_MAX 8 // runs allocated by one step of pifs_grow_file
+#define PIFS_GROW_BLOCKS_MAX (PIFS_GROW_RUNS_MAX * PIFS_COUNT_FILE_BLOCKS)
+#define PIFS_CREDITS_GROW 12 // headers of the runs and the new extend,
+                             // first, last and new extend of the file
+#define PIFS_CREDITS_CREATE 8 // headers of the inode, index and new extend,
+                              // inode, index, first and new extend of folder
+#define PIFS_CREDITS_UNLINK 1 // extend of the parent folder
+#define PIFS_CREDITS_INLINE 1 // inode of a file with inlined data
+#define PIFS_CREDITS_FREE 3 // the (up to) two headers of a run and an extend
+#define PIFS_CREDITS_FILL 4 // headers of the run and a new extend, the extend
+                            // of the hole and the new extend
+#define PIFS_CREDITS_DEFRAG 4 // headers of the new and the (up to) two old
+                              // runs and the extend, or two extends and a
+                              // header
+
+typedef char _CASSERT_PIFS_JOURNAL_SHARE[0 - !(PIFS_CACHE_MIN *
+                                               PIFS_JOURNAL_CACHE_PERCENT /
+                                               100 >= PIFS_CREDITS_GROW)];
+typedef char _CASSERT_PIFS_CACHE_MIN[0 - !(1 + PIFS_DEFRAG_BATCH + 1 +
+                                           BC_IO_RUN + PIFS_CACHE_MIN *
+                                           PIFS_JOURNAL_CACHE_PERCENT / 100 <=
+                                           PIFS_CACHE_MIN * 3 / 4)];
+                            
+// A ref with start == 0 is a hole: its blocks are not allocated and read as
+// zeros. Growing a file sparsely adds at most this many blocks of holes at
+// once, so that one step needs at most one new extend.
+#define PIFS_GROW_HOLE_MAX ((PIFS_COUNT_FILE_BLOCKS - 1) * \
+                            PIFS_COUNT_FILE_REF_COUNT_MAX)
 
 struct pifs_inode_header
 {
@@ -78,7 +132,8 @@ struct pifs_header
   pifs_ptr          extends; // if there are too many blocks
   pifs_ptr          root_folder; // sector of the root folder
   struct pifs_attrs unused; // unused for this inode type
-  pifs_ptr          long_name; // name of device (not implemented)
+  pifs_ptr          journal; // first block of the journal, 0 if none
+                             // (was the unimplemented name of the device)
   
   uint16_t          blocks_count; // number of elements in the used_map
                                   // must by devidable by 8
@@ -99,17 +154,37 @@ struct pifs_folder
   struct pifs_attrs        attrs; // not implemented
   pifs_ptr                 long_name; // not implemented
   
-  char                     padding[14];
+  pifs_ptr                 index; // struct pifs_index, 0 if unindexed
+                                  // (only used in the first extend)
+  pifs_ptr                 bucket_next; // next extend of the same bucket
+  char                     padding[6];
   
   uint8_t                  entries_count; // # of items in ::entries
-  // TODO: An optimization would be sorting the entries in an extend.
-  //       I don't think sorting over all extends would be much of a speed-up.
   struct pifs_folder_entry entries[PIFS_COUNT_FOLDER_ENTRIES];
 } PACKED;
 
+// Index of a folder whose first extend overflowed.
+// Each extend created after the index holds names of a single bucket only,
+// and is linked in both the folder's extends list and the bucket's list.
+// A name is looked up in the first extend, then in the extends of its
+// bucket, then in the legacy extends, which were created before the index
+// (by older versions of pifs, which left the padding zeroed).
+struct pifs_index
+{
+  pifs_magic               magic; // = PIFS_MAGIC_INDEX
+  pifs_ptr                 unused1; // unused for this inode type
+  pifs_ptr                 parent_folder; // first extend of the folder
+  struct pifs_attrs        unused3; // unused for this inode type
+  pifs_ptr                 unused4; // unused for this inode type
+  
+  pifs_ptr                 legacy; // first unbucketed extend
+  pifs_ptr                 buckets[PIFS_COUNT_INDEX_BUCKETS]; // first extends
+  char                     padding[3];
+} PACKED;
+
 struct pifs_file_block_ref
 {
-  pifs_ptr start;
+  pifs_ptr start; // 0 for a hole
   uint8_t  count;
 } PACKED;
 
@@ -124,7 +199,23 @@ struct pifs_file
   uint32_t                   length; // total file length
   
   uint8_t                    blocks_count; // # of elements in ::blocks
-  struct pifs_file_block_ref blocks[PIFS_COUNT_FILE_BLOCKS];
+  union // the data of a file without blocks and extends is inlined:
+  {
+    struct pifs_file_block_ref blocks[PIFS_COUNT_FILE_BLOCKS];
+    char                       inline_data[PIFS_INLINE_MAX];
+  } PACKED;
+} PACKED;
+
+// Descriptor of the last committed journal transaction.
+// If it is valid at mount, the images are written to their targets again.
+struct pifs_journal
+{
+  pifs_magic        magic; // = PIFS_MAGIC_JOURNAL
+  uint32_t          sequence; // of the transaction
+  uint32_t          count; // images following this block, 0 if written
+  uint32_t          checksum; // of sequence and images
+  pifs_ptr          targets[PIFS_JOURNAL_MAX]; // sector of each image
+  char              padding[496 - 4 * PIFS_JOURNAL_MAX];
 } PACKED;
 
 typedef char _CASSERT_PIFS_NAME_SIZE[0 - !(sizeof (struct pifs_long_name) ==
@@ -135,6 +226,14 @@ typedef char _CASSERT_PIFS_FOLDER_SIZE[0 - !(sizeof (struct pifs_folder) ==
                                              BLOCK_SECTOR_SIZE)];
 typedef char _CASSERT_PIFS_FILE_SIZE[0 - !(sizeof (struct pifs_file) ==
                                            BLOCK_SECTOR_SIZE)];
+typedef char _CASSERT_PIFS_INDEX_SIZE[0 - !(sizeof (struct pifs_index) ==
+                                            BLOCK_SECTOR_SIZE)];
+typedef char _CASSERT_PIFS_INLINE_SIZE[0 - !(sizeof (((struct pifs_file *) 0)
+                                                    ->inline_data) ==
+                                            sizeof (((struct pifs_file *) 0)
+                                                    ->blocks))];
+typedef char _CASSERT_PIFS_JOURNAL_SIZE[0 - !(sizeof (struct pifs_journal) ==
+                                              BLOCK_SECTOR_SIZE)];
 
 #define _MIN(X,Y)                        \
   ({                                     \
@@ -150,6 +249,318 @@ typedef char _CASSERT_PIFS_FILE_SIZE[0 - !(sizeof (struct pifs_file) ==
     _x >= _y ? _x : _y;                  \
   })
 
+// In-memory summary of the free blocks of a pifs_header, so that the
+// allocator only reads the header that will satisfy the request.
+struct pifs_free_group
+{
+  pifs_ptr         sector; // of the pifs_header
+  pifs_ptr         offset; // block of the first bit of the used_map
+  size_t           len; // bytes of the used_map in use
+  size_t           free; // count of free blocks
+  size_t           longest; // longest run of free blocks
+  struct list_elem elem; // struct pifs_device::free_buckets, by longest
+};
+
+static size_t
+pifs_free_bucket (size_t longest)
+{
+  size_t result = 0;
+  while (longest > 0 && result < PIFS_FREE_BUCKETS - 1)
+    {
+      longest >>= 1;
+      ++result;
+    }
+  return result;
+}
+
+static bool
+pifs_free_less (const struct list_elem *a,
+                const struct list_elem *b,
+                void                   *aux UNUSED)
+{
+  return list_entry (a, struct pifs_free_group, elem)->longest <
+         list_entry (b, struct pifs_free_group, elem)->longest;
+}
+
+// Recomputes the summary of group from its header, whose used_map changed,
+// and moves it to its place in the buckets.
+static void
+pifs_free_update (struct pifs_device     *pifs,
+                  struct pifs_free_group *group,
+                  struct pifs_header     *header)
+{
+  size_t old_longest = group->longest;
+  group->free = bitset_count_zeros (header->used_map, group->len,
+                                    &group->longest);
+  if (group->longest != old_longest)
+    {
+      size_t bucket = pifs_free_bucket (group->longest);
+      list_remove (&group->elem);
+      list_insert_ordered (&pifs->free_buckets[bucket], &group->elem,
+                           &pifs_free_less, NULL);
+    }
+}
+
+// Reads all headers to build the free block summaries.
+static bool
+pifs_free_build (struct pifs_device *pifs)
+{
+  size_t i, count = 0;
+  pifs_ptr cur = 0;
+  do
+    {
+      struct block_page *page = block_cache_read (pifs->bc, cur);
+      struct pifs_header *header = (void *) &page->data;
+      if (header->magic != PIFS_MAGIC_HEADER)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(magic = 0x%08X).", cur, header->magic);
+      cur = header->extends;
+      block_cache_return (pifs->bc, page);
+      ++count;
+    }
+  while (cur != 0);
+  
+  free (pifs->free_groups);
+  pifs->free_groups = calloc (count, sizeof (*pifs->free_groups));
+  pifs->free_groups_count = count;
+  if (pifs->free_groups == NULL)
+    return false;
+  for (i = 0; i < PIFS_FREE_BUCKETS; ++i)
+    list_init (&pifs->free_buckets[i]);
+  
+  pifs_ptr offset = 0;
+  for (i = 0, cur = 0; i < count; ++i)
+    {
+      struct pifs_free_group *group = &pifs->free_groups[i];
+      struct block_page *page = block_cache_read (pifs->bc, cur);
+      struct pifs_header *header = (void *) &page->data;
+      if (header->blocks_count / 8 > PIFS_COUNT_USED_MAP_ENTRIES)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(blocks_count = %u).", cur, header->blocks_count);
+      group->sector = cur;
+      group->offset = offset;
+      group->len = header->blocks_count / 8;
+      group->longest = 0;
+      list_push_back (&pifs->free_buckets[0], &group->elem);
+      pifs_free_update (pifs, group, header);
+      
+      offset += header->blocks_count;
+      cur = header->extends;
+      block_cache_return (pifs->bc, page);
+    }
+  return true;
+}
+
+// Returns the group with the shortest free run of at least amount blocks,
+// or with the longest free run if no group has such a run, or NULL if all
+// blocks are used.
+// As the buckets are ordered, only amount's own bucket is walked, the best
+// group of any other bucket is its first or last one.
+static struct pifs_free_group *
+pifs_free_best (struct pifs_device *pifs, size_t amount)
+{
+  size_t bucket = pifs_free_bucket (amount), i;
+  struct list_elem *e;
+  for (e = list_begin (&pifs->free_buckets[bucket]);
+       e != list_end (&pifs->free_buckets[bucket]);
+       e = list_next (e))
+    {
+      struct pifs_free_group *g;
+      g = list_entry (e, struct pifs_free_group, elem);
+      if (g->longest >= amount)
+        return g;
+    }
+  for (i = bucket + 1; i < PIFS_FREE_BUCKETS; ++i)
+    if (!list_empty (&pifs->free_buckets[i]))
+      return list_entry (list_front (&pifs->free_buckets[i]),
+                         struct pifs_free_group, elem);
+    
+  // take the group with the longest run below amount:
+  for (i = bucket + 1; i-- > 1; )
+    if (!list_empty (&pifs->free_buckets[i]))
+      return list_entry (list_back (&pifs->free_buckets[i]),
+                         struct pifs_free_group, elem);
+  return NULL;
+}
+
+// Returns the group containing block, in O(log n).
+static struct pifs_free_group *
+pifs_free_group_of (struct pifs_device *pifs, pifs_ptr block)
+{
+  size_t lo = 0, hi = pifs->free_groups_count;
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (pifs->free_groups[mid].offset <= block)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  ASSERT (lo > 0);
+  return &pifs->free_groups[lo - 1];
+}
+
+static uint32_t
+pifs_journal_checksum (const struct pifs_journal *desc, const char *images)
+{
+  return hash_bytes (images, desc->count * BLOCK_SECTOR_SIZE) ^
+         hash_bytes (desc->targets, desc->count * sizeof (pifs_ptr)) ^
+         desc->sequence;
+}
+
+// Writes the running transaction to the journal with one sequential write,
+// commits it by writing the descriptor, writes its sectors in place, and
+// clears the descriptor again. The latter must be done before the next
+// transaction reuses the journal.
+// No operation may start meanwhile.
+static void
+pifs_journal_commit (struct pifs_device *pifs)
+{
+  if (pifs->journal == 0)
+    return;
+    
+  lock_acquire (&pifs->journal_lock);
+  while (pifs->journal_committing)
+    cond_wait (&pifs->journal_changed, &pifs->journal_lock);
+  if (pifs->journal_count == 0)
+    {
+      lock_release (&pifs->journal_lock);
+      return;
+    }
+  pifs->journal_committing = true;
+  while (pifs->journal_handles > 0)
+    cond_wait (&pifs->journal_changed, &pifs->journal_lock);
+  lock_release (&pifs->journal_lock);
+  
+  size_t count = pifs->journal_count, i;
+  struct pifs_journal *desc = pifs->journal_buffer;
+  char *images = (char *) pifs->journal_buffer + BLOCK_SECTOR_SIZE;
+  memset (desc, 0, sizeof (*desc));
+  desc->magic = PIFS_MAGIC_JOURNAL;
+  desc->sequence = ++pifs->journal_sequence;
+  desc->count = count;
+  for (i = 0; i < count; ++i)
+    {
+      struct block_page *page = pifs->journal_pages[i];
+      desc->targets[i] = page->nth;
+      memcpy (&images[i * BLOCK_SECTOR_SIZE], &page->data, BLOCK_SECTOR_SIZE);
+    }
+  desc->checksum = pifs_journal_checksum (desc, images);
+  PIFS_DEBUG ("PIFS committing transaction %u of %u blocks.\n",
+              desc->sequence, count);
+  
+  struct block *device = pifs->bc->device;
+  block_write_multiple (device, pifs->journal + 1, count, images);
+  block_write (device, pifs->journal, desc);
+  
+  block_cache_flush_many (pifs->bc, pifs->journal_pages, count);
+  
+  // checkpoint: the targets are written, so that later changes, which need
+  // not be journaled, are not reverted by a replay at the next mount:
+  desc->count = 0;
+  block_write (device, pifs->journal, desc);
+  
+  for (i = 0; i < count; ++i)
+    block_cache_return (pifs->bc, pifs->journal_pages[i]);
+    
+  lock_acquire (&pifs->journal_lock);
+  pifs->journal_count = 0;
+  pifs->journal_committing = false;
+  cond_broadcast (&pifs->journal_changed, &pifs->journal_lock);
+  lock_release (&pifs->journal_lock);
+}
+
+// Max. sectors of a transaction. The journal holds a lease on each, so
+// a small cache gets small transactions.
+static size_t
+pifs_journal_limit (struct pifs_device *pifs)
+{
+  return _MIN (pifs->bc->cache_size * PIFS_JOURNAL_CACHE_PERCENT / 100,
+               (size_t) PIFS_JOURNAL_MAX);
+}
+
+// Starts an operation that changes at most credits metadata sectors.
+// Commits the running transaction if it has no room for them.
+// A thread must not start an operation inside of another one, and must not
+// wait for pifs_rwlock or an inode's rwlock inside of one.
+static void
+pifs_journal_start (struct pifs_device *pifs, size_t credits)
+{
+  if (pifs->journal == 0)
+    return;
+  ASSERT (credits <= pifs_journal_limit (pifs));
+    
+  lock_acquire (&pifs->journal_lock);
+  while (pifs->journal_committing ||
+         pifs->journal_count + pifs->journal_credits + credits >
+         pifs_journal_limit (pifs))
+    {
+      lock_release (&pifs->journal_lock);
+      pifs_journal_commit (pifs);
+      lock_acquire (&pifs->journal_lock);
+    }
+  ++pifs->journal_handles;
+  pifs->journal_credits += credits;
+  lock_release (&pifs->journal_lock);
+}
+
+static void
+pifs_journal_stop (struct pifs_device *pifs, size_t credits)
+{
+  if (pifs->journal == 0)
+    return;
+    
+  lock_acquire (&pifs->journal_lock);
+  ASSERT (pifs->journal_handles > 0);
+  ASSERT (pifs->journal_credits >= credits);
+  pifs->journal_credits -= credits;
+  if (--pifs->journal_handles == 0)
+    cond_broadcast (&pifs->journal_changed, &pifs->journal_lock);
+  lock_release (&pifs->journal_lock);
+}
+
+// Marks the metadata sector in page dirty, as part of the running
+// transaction. The journal leases the page until it is committed, so that it
+// is not written in place before.
+static void
+pifs_journal_dirty (struct pifs_device *pifs, struct block_page *page)
+{
+  page->dirty = true;
+  if (pifs->journal == 0)
+    return;
+    
+  lock_acquire (&pifs->journal_lock);
+  ASSERT (pifs->journal_handles > 0);
+  size_t i;
+  for (i = 0; i < pifs->journal_count; ++i)
+    if (pifs->journal_pages[i] == page)
+      break;
+  if (i == pifs->journal_count)
+    {
+      ASSERT (pifs->journal_count < PIFS_JOURNAL_MAX);
+      // The caller's lease kept the flusher from writing the page since it
+      // was changed, this one waits for a flush of another lessee.
+      struct block_page *lease UNUSED = block_cache_read (pifs->bc, page->nth);
+      ASSERT (lease == page);
+      pifs->journal_pages[pifs->journal_count++] = page;
+    }
+  lock_release (&pifs->journal_lock);
+}
+
+static void
+pifs_journal_fun (void *pifs_)
+{
+  struct pifs_device *pifs = pifs_;
+  ASSERT (intr_get_level () == INTR_ON);
+  
+  while (!pifs->journal_stop)
+    {
+      timer_msleep (PIFS_JOURNAL_INTERVAL_MS);
+      pifs_journal_commit (pifs);
+    }
+  sema_up (&pifs->journal_thread_down);
+}
+
 static void
 pifs_dealloc_blocks (struct pifs_device *pifs, pifs_ptr start, size_t count)
 {
@@ -160,36 +571,123 @@ pifs_dealloc_blocks (struct pifs_device *pifs, pifs_ptr start, size_t count)
   if (count == 0)
     return;
     
-  size_t pos;
-  pifs_ptr cur;
-  for (pos = 0, cur = 0; pos < start + count; /* done in code */)
+  lock_acquire (&pifs->alloc_lock);
+  struct pifs_free_group *group = pifs_free_group_of (pifs, start);
+  struct pifs_free_group *end = &pifs->free_groups[pifs->free_groups_count];
+  for (; group < end && group->offset < start + count; ++group)
     {
-      struct block_page *page = block_cache_read (pifs->bc, cur);
+      struct block_page *page = block_cache_read (pifs->bc, group->sector);
       ASSERT (page != NULL); // assertion is valid when write-locked!
       struct pifs_header *header = (void *) &page->data[0];
       if (header->magic != PIFS_MAGIC_HEADER)
         PANIC ("Block %"PRDSNu" of filesystem is messed up "
-               "(magic = 0x%08X).", cur, header->magic);
+               "(magic = 0x%08X).", group->sector, header->magic);
                
+      pifs_ptr pos = group->offset;
       pifs_ptr intersection_start = _MAX (pos, start);
       pifs_ptr intersection_end = _MIN (pos+header->blocks_count, start+count);
       if (intersection_start < intersection_end)
         {
           PIFS_DEBUG ("    de-allocating [%u,%u[ in %u [%u,%u[)\n",
-                      intersection_start, intersection_end, cur,
+                      intersection_start, intersection_end, group->sector,
                       pos, pos+header->blocks_count);
           bitset_reset_range (&header->used_map[0], intersection_start-pos,
-                                                    intersection_end-pos);
-          page->dirty = true;
+                              intersection_end-intersection_start);
+          pifs_journal_dirty (pifs, page);
+          pifs_free_update (pifs, group, header);
         }
       
-      pos += header->blocks_count;
-      cur = header->extends;
-      
       block_cache_return (pifs->bc, page);
-      if (cur == 0)
-        break;
     }
+  lock_release (&pifs->alloc_lock);
+}
+
+// Frees the blocks that were preallocated beyond the end of the file,
+// and the extends that become empty by doing so.
+// Returns the count of runs the blocks of the file are in afterwards.
+static size_t
+pifs_trim_file (struct pifs_inode *inode)
+{
+  ASSERT (!inode->is_directory);
+  struct pifs_device *pifs = inode->pifs;
+  size_t keep = DIV_ROUND_UP (inode->length, BLOCK_SECTOR_SIZE);
+  size_t runs = 0;
+  pifs_ptr expected = 0;
+  
+  pifs_ptr cur = inode->sector, prev = 0;
+  while (cur != 0)
+    {
+      struct block_page *page = block_cache_read (pifs->bc, cur);
+      ASSERT (page != NULL); // assertion is valid when write-locked!
+      struct pifs_file *extend = (void *) &page->data;
+      if (extend->magic != PIFS_MAGIC_FILE)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(magic = 0x%08X).", cur, extend->magic);
+      if (extend->blocks_count > PIFS_COUNT_FILE_BLOCKS)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(blocks_count = %u).", cur, extend->blocks_count);
+               
+      size_t i, count = 0, used = 0;
+      for (i = 0; i < extend->blocks_count && keep > 0; ++i)
+        {
+          used = _MIN (keep, (size_t) extend->blocks[i].count);
+          keep -= used;
+          count = i + 1;
+        }
+        
+      // free the unused refs from the back, so that every step leaves a
+      // consistent extend behind:
+      while (extend->blocks_count > count)
+        {
+          struct pifs_file_block_ref *ref;
+          ref = &extend->blocks[extend->blocks_count - 1];
+          pifs_journal_start (pifs, PIFS_CREDITS_FREE);
+          if (ref->start != 0)
+            pifs_dealloc_blocks (pifs, ref->start, ref->count);
+          --extend->blocks_count;
+          pifs_journal_dirty (pifs, page);
+          pifs_journal_stop (pifs, PIFS_CREDITS_FREE);
+        }
+      if (count > 0 && used < extend->blocks[count - 1].count)
+        {
+          struct pifs_file_block_ref *ref = &extend->blocks[count - 1];
+          pifs_journal_start (pifs, PIFS_CREDITS_FREE);
+          if (ref->start != 0)
+            pifs_dealloc_blocks (pifs, ref->start + used, ref->count - used);
+          ref->count = used;
+          pifs_journal_dirty (pifs, page);
+          pifs_journal_stop (pifs, PIFS_CREDITS_FREE);
+        }
+        
+      for (i = 0; i < extend->blocks_count; ++i)
+        if (extend->blocks[i].start != 0)
+          {
+            if (extend->blocks[i].start != expected)
+              ++runs;
+            expected = extend->blocks[i].start + extend->blocks[i].count;
+          }
+        
+      pifs_ptr next = extend->extends;
+      block_cache_return (pifs->bc, page);
+      
+      if (count == 0 && prev != 0)
+        {
+          // unlink the unused extend:
+          
+          pifs_journal_start (pifs, PIFS_CREDITS_FREE);
+          pifs_dealloc_blocks (pifs, cur, 1);
+          page = block_cache_read (pifs->bc, prev);
+          ASSERT (page != NULL);
+          ((struct pifs_file *) &page->data)->extends = next;
+          pifs_journal_dirty (pifs, page);
+          block_cache_return (pifs->bc, page);
+          pifs_journal_stop (pifs, PIFS_CREDITS_FREE);
+        }
+      else
+        prev = cur;
+      cur = next;
+    }
+  return runs;
 }
 
 struct pifs_deletor_item
@@ -198,6 +696,58 @@ struct pifs_deletor_item
   struct list_elem   elem;
 };
 
+// Hands the closed file to the defragmenter if its blocks are in many runs,
+// which keeps it open meanwhile. Returns false if it does not.
+// pifs_rwlock must be held.
+static bool
+pifs_defrag_queue (struct pifs_inode *inode, size_t runs)
+{
+  struct pifs_device *pifs = inode->pifs;
+  if (inode->defrag_queued || pifs->defrag_stop || runs <= PIFS_DEFRAG_EXTENTS)
+    return false;
+    
+  struct pifs_deletor_item *item = malloc (sizeof (*item));
+  if (item == NULL)
+    return false;
+  memset (item, 0, sizeof (*item));
+  item->inode = inode;
+  inode->defrag_queued = true;
+  __sync_add_and_fetch (&inode->open_count, 1);
+  
+  intr_disable ();
+  list_push_back (&pifs->defrag_list, &item->elem);
+  sema_up (&pifs->defrag_sema);
+  intr_enable ();
+  return true;
+}
+
+static void
+pifs_defrag_fun (void *pifs_)
+{
+  struct pifs_device *pifs = pifs_;
+  ASSERT (intr_get_level () == INTR_ON);
+  
+  for (;;)
+    {
+      sema_down (&pifs->defrag_sema);
+      if (pifs->defrag_stop)
+        break;
+        
+      intr_disable ();
+      struct list_elem *e = list_pop_front (&pifs->defrag_list);
+      intr_enable ();
+      
+      struct pifs_deletor_item *ee;
+      ee = list_entry (e, struct pifs_deletor_item, elem);
+      struct pifs_inode *inode = ee->inode;
+      free (ee);
+      
+      pifs_defrag (inode);
+      pifs_close (inode);
+    }
+  sema_up (&pifs->defrag_thread_down);
+}
+
 static void
 pifs_deletor_fun (void *pifs_)
 { 
@@ -236,6 +786,20 @@ pifs_deletor_fun (void *pifs_)
             {
               // not accessable anymore:
               
+              // give back what was preallocated for appends:
+              
+              size_t runs = 0;
+              if (!inode->is_directory)
+                runs = pifs_trim_file (inode);
+                
+              // the defragmenter keeps a fragmented file open for a while:
+              
+              if (!inode->is_directory && pifs_defrag_queue (inode, runs))
+                {
+                  rwlock_release_write (&pifs->pifs_rwlock);
+                  continue;
+                }
+              
               struct hash_elem *hash_e UNUSED;
               hash_e = hash_delete (&pifs->open_inodes, &inode->elem);
               ASSERT (hash_e == &inode->elem);
@@ -270,8 +834,14 @@ pifs_deletor_fun (void *pifs_)
                       
                       size_t i;
                       for (i = 0; i < file->blocks_count; ++i)
-                        pifs_dealloc_blocks (pifs, file->blocks[i].start,
-                                                   file->blocks[i].count);
+                        {
+                          if (file->blocks[i].start == 0)
+                            continue; // a hole
+                          pifs_journal_start (pifs, PIFS_CREDITS_FREE);
+                          pifs_dealloc_blocks (pifs, file->blocks[i].start,
+                                                     file->blocks[i].count);
+                          pifs_journal_stop (pifs, PIFS_CREDITS_FREE);
+                        }
                     }
                   else if (header->magic == PIFS_MAGIC_FOLDER)
                     {
@@ -288,30 +858,179 @@ pifs_deletor_fun (void *pifs_)
                                "(entries_count = %u).", s,
                                folder->entries_count);
                       
-                      // there is nothing to do for a folder ...
+                      if (folder->index != 0)
+                        {
+                          pifs_journal_start (pifs, PIFS_CREDITS_FREE);
+                          pifs_dealloc_blocks (pifs, folder->index, 1);
+                          pifs_journal_stop (pifs, PIFS_CREDITS_FREE);
+                        }
                     }
                   else
                     PANIC ("Block %"PRDSNu" of filesystem is messed up "
                            "(magic = 0x%08X).", s, header->magic);
                   s = header->extends;
                   
+                  pifs_journal_start (pifs, PIFS_CREDITS_FREE);
                   if (header->long_name != 0)
                     pifs_dealloc_blocks (pifs, header->long_name, 1);
                   
 #                 ifdef PIFS_DEBUG_DESTROY_HEADER
                   header->magic ^= -1u;
-                  page->dirty = true;
+                  pifs_journal_dirty (pifs, page);
 #                 endif
+                  pifs_journal_stop (pifs, PIFS_CREDITS_FREE);
                   block_cache_return (pifs->bc, page);
                 }
               while (s != 0);
             }
+          free (inode->extents);
           free (inode);
         }
       rwlock_release_write (&pifs->pifs_rwlock);
     }
 }
 
+// A cached result of looking up a name in a folder.
+// The dentries are guarded by pifs_rwlock, like the folders themselves, and
+// by dentries_lock, as lookups under a read lock change them, too.
+struct pifs_dentry
+{
+  pifs_ptr         folder; // first extend of the folder
+  char             name[PIFS_NAME_LENGTH]; // zero padded
+  pifs_ptr         child; // 0 if folder does not contain name
+  struct hash_elem hash_elem; // struct pifs_device::dentries
+  struct list_elem lru_elem; // struct pifs_device::dentries_lru
+};
+
+static unsigned
+pifs_dentry_hash (const struct hash_elem *e, void *pifs UNUSED)
+{
+  struct pifs_dentry *ee = hash_entry (e, struct pifs_dentry, hash_elem);
+  return hash_bytes (ee->name, sizeof (ee->name)) ^
+         hash_bytes (&ee->folder, sizeof (ee->folder));
+}
+
+static bool
+pifs_dentry_less (const struct hash_elem *a,
+                  const struct hash_elem *b,
+                  void                   *pifs UNUSED)
+{
+  struct pifs_dentry *aa = hash_entry (a, struct pifs_dentry, hash_elem);
+  struct pifs_dentry *bb = hash_entry (b, struct pifs_dentry, hash_elem);
+  if (aa->folder != bb->folder)
+    return aa->folder < bb->folder;
+  return memcmp (aa->name, bb->name, sizeof (aa->name)) < 0;
+}
+
+static struct pifs_dentry *
+pifs_dentry_find (struct pifs_device *pifs,
+                  pifs_ptr            folder,
+                  const char         *name,
+                  size_t              name_len)
+{
+  ASSERT (name_len <= PIFS_NAME_LENGTH);
+  struct pifs_dentry key;
+  key.folder = folder;
+  memset (key.name, 0, sizeof (key.name));
+  memcpy (key.name, name, name_len);
+  struct hash_elem *e = hash_find (&pifs->dentries, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct pifs_dentry, hash_elem) : NULL;
+}
+
+// Returns true and sets *child if the lookup of name in folder is cached.
+// *child = 0 means that folder does not contain name.
+static bool
+pifs_dentry_lookup (struct pifs_device *pifs,
+                    pifs_ptr            folder,
+                    const char         *name,
+                    size_t              name_len,
+                    pifs_ptr           *child)
+{
+  lock_acquire (&pifs->dentries_lock);
+  struct pifs_dentry *d = pifs_dentry_find (pifs, folder, name, name_len);
+  if (d != NULL)
+    {
+      list_remove (&d->lru_elem);
+      list_push_back (&pifs->dentries_lru, &d->lru_elem);
+      *child = d->child;
+    }
+  lock_release (&pifs->dentries_lock);
+  return d != NULL;
+}
+
+// Caches that name in folder is child, or does not exist if child == 0.
+static void
+pifs_dentry_insert (struct pifs_device *pifs,
+                    pifs_ptr            folder,
+                    const char         *name,
+                    size_t              name_len,
+                    pifs_ptr            child)
+{
+  lock_acquire (&pifs->dentries_lock);
+  struct pifs_dentry *d = pifs_dentry_find (pifs, folder, name, name_len);
+  if (d != NULL)
+    {
+      list_remove (&d->lru_elem);
+      list_push_back (&pifs->dentries_lru, &d->lru_elem);
+      d->child = child;
+      lock_release (&pifs->dentries_lock);
+      return;
+    }
+    
+  if (pifs->dentries_count >= PIFS_DENTRY_MAX)
+    {
+      // reuse the least recently used dentry:
+      struct list_elem *e = list_pop_front (&pifs->dentries_lru);
+      d = list_entry (e, struct pifs_dentry, lru_elem);
+      hash_delete (&pifs->dentries, &d->hash_elem);
+    }
+  else
+    {
+      d = malloc (sizeof (*d));
+      if (d == NULL)
+        {
+          lock_release (&pifs->dentries_lock);
+          return;
+        }
+      ++pifs->dentries_count;
+    }
+    
+  d->folder = folder;
+  memset (d->name, 0, sizeof (d->name));
+  memcpy (d->name, name, name_len);
+  d->child = child;
+  hash_insert (&pifs->dentries, &d->hash_elem);
+  list_push_back (&pifs->dentries_lru, &d->lru_elem);
+  lock_release (&pifs->dentries_lock);
+}
+
+// Drops the dentries pointing to sector and the dentries of the folder
+// sector, as sector is about to be deleted.
+static void
+pifs_dentry_forget (struct pifs_device *pifs, pifs_ptr sector)
+{
+  lock_acquire (&pifs->dentries_lock);
+  struct list_elem *e = list_begin (&pifs->dentries_lru);
+  while (e != list_end (&pifs->dentries_lru))
+    {
+      struct pifs_dentry *d = list_entry (e, struct pifs_dentry, lru_elem);
+      e = list_next (e);
+      if (d->child != sector && d->folder != sector)
+        continue;
+      list_remove (&d->lru_elem);
+      hash_delete (&pifs->dentries, &d->hash_elem);
+      --pifs->dentries_count;
+      free (d);
+    }
+  lock_release (&pifs->dentries_lock);
+}
+
+static void
+pifs_dentry_destroy (struct hash_elem *e, void *pifs UNUSED)
+{
+  free (hash_entry (e, struct pifs_dentry, hash_elem));
+}
+
 static unsigned
 pifs_open_inodes_hash (const struct hash_elem *e, void *pifs)
 {
@@ -331,9 +1050,60 @@ pifs_open_inodes_less (const struct hash_elem *a,
   return pifs_open_inodes_hash (a, pifs) < pifs_open_inodes_hash (b, pifs);
 }
 
-bool
-pifs_init (struct pifs_device *pifs, struct block_cache *bc)
-{
+static inline struct pifs_header *
+pifs_header (struct pifs_device *pifs)
+{
+  return (struct pifs_header *) &pifs->header_block->data;
+}
+
+// Writes the sectors of the last committed transaction in place again, as
+// the system might have stopped before they all were written. A transaction
+// whose commit was interrupted is ignored, its sectors were not touched yet.
+static void
+pifs_journal_replay (struct pifs_device *pifs)
+{
+  if (pifs->journal == 0)
+    return;
+    
+  struct block *device = pifs->bc->device;
+  struct pifs_journal *desc = pifs->journal_buffer;
+  char *images = (char *) pifs->journal_buffer + BLOCK_SECTOR_SIZE;
+  block_read (device, pifs->journal, desc);
+  if (desc->magic != PIFS_MAGIC_JOURNAL || desc->count > PIFS_JOURNAL_MAX)
+    {
+      printf ("PIFS journal in %"PRDSNu" is messed up, not using it.\n",
+              pifs->journal);
+      pifs->journal = 0;
+      return;
+    }
+  pifs->journal_sequence = desc->sequence;
+  if (desc->count == 0)
+    return;
+    
+  block_read_multiple (device, pifs->journal + 1, desc->count, images);
+  if (pifs_journal_checksum (desc, images) != desc->checksum)
+    return;
+  size_t i;
+  for (i = 0; i < desc->count; ++i)
+    if (desc->targets[i] >= block_size (device))
+      return;
+      
+  for (i = 0; i < desc->count; ++i)
+    {
+      const char *image = &images[i * BLOCK_SECTOR_SIZE];
+      block_write (device, desc->targets[i], image);
+      if (desc->targets[i] == pifs->header_block->nth)
+        memcpy (&pifs->header_block->data, image, BLOCK_SECTOR_SIZE);
+    }
+  printf ("PIFS replayed %u journaled block(s).\n", desc->count);
+  
+  desc->count = 0;
+  block_write (device, pifs->journal, desc);
+}
+
+bool
+pifs_init (struct pifs_device *pifs, struct block_cache *bc)
+{
   ASSERT (pifs != NULL);
   ASSERT (bc != NULL);
   ASSERT (intr_get_level () == INTR_ON);
@@ -343,17 +1113,45 @@ pifs_init (struct pifs_device *pifs, struct block_cache *bc)
   hash_init (&pifs->open_inodes, &pifs_open_inodes_hash, &pifs_open_inodes_less,
              pifs);
   rwlock_init (&pifs->pifs_rwlock);
+  lock_init (&pifs->open_inodes_lock);
+  lock_init (&pifs->alloc_lock);
+  lock_init (&pifs->dentries_lock);
+  hash_init (&pifs->dentries, &pifs_dentry_hash, &pifs_dentry_less, pifs);
+  list_init (&pifs->dentries_lru);
   sema_init (&pifs->deletor_sema, 0);
   list_init (&pifs->deletor_list);
   sema_init (&pifs->deletor_thread_down, 0);
+  lock_init (&pifs->journal_lock);
+  cond_init (&pifs->journal_changed);
+  sema_init (&pifs->journal_thread_down, 0);
+  sema_init (&pifs->defrag_sema, 0);
+  list_init (&pifs->defrag_list);
+  sema_init (&pifs->defrag_thread_down, 0);
+  
+  pifs->journal_buffer = malloc (PIFS_JOURNAL_BLOCKS * BLOCK_SECTOR_SIZE);
+  if (pifs->journal_buffer == NULL)
+    return false;
   
   pifs->deletor_thread = thread_create ("[PIFS-DELETOR]", PRI_MAX,
                                         &pifs_deletor_fun, pifs);
   ASSERT (pifs->deletor_thread != TID_ERROR);
+  pifs->journal_thread = thread_create ("[PIFS-JOURNAL]", PRI_DEFAULT,
+                                        &pifs_journal_fun, pifs);
+  ASSERT (pifs->journal_thread != TID_ERROR);
+  pifs->defrag_thread = thread_create ("[PIFS-DEFRAG]", PRI_MIN,
+                                       &pifs_defrag_fun, pifs);
+  ASSERT (pifs->defrag_thread != TID_ERROR);
   
   pifs->header_block = block_cache_read (pifs->bc, 0);
   ASSERT (pifs->header_block != NULL);
   
+  // an unformatted device gets its summaries in pifs_format():
+  if (pifs_sanity_check (pifs))
+    {
+      pifs->journal = pifs_header (pifs)->journal;
+      pifs_journal_replay (pifs);
+      return pifs_free_build (pifs);
+    }
   return true;
 }
 
@@ -383,6 +1181,12 @@ pifs_destroy (struct pifs_device *pifs)
   ASSERT (pifs != NULL);
   ASSERT (intr_get_level () == INTR_ON);
   
+  // stop the defragmenter, the files it did not get to are closed below:
+  
+  pifs->defrag_stop = true;
+  sema_up (&pifs->defrag_sema);
+  sema_down (&pifs->defrag_thread_down);
+  
   // close all open inodes:
   
   intr_disable ();
@@ -399,15 +1203,21 @@ pifs_destroy (struct pifs_device *pifs)
   intr_enable ();
   sema_down (&pifs->deletor_thread_down);
   
+  // commit what is left and stop the journal thread:
+  
+  pifs->journal_stop = true;
+  sema_down (&pifs->journal_thread_down);
+  pifs_journal_commit (pifs);
+  
   // destroy the pifs_device:
   
   hash_destroy (&pifs->open_inodes, &pifs_destroy_sub2);
-}
-
-static inline struct pifs_header *
-pifs_header (struct pifs_device *pifs)
-{
-  return (struct pifs_header *) &pifs->header_block->data;
+  hash_destroy (&pifs->dentries, &pifs_dentry_destroy);
+  free (pifs->free_groups);
+  free (pifs->journal_buffer);
+  while (!list_empty (&pifs->defrag_list))
+    free (list_entry (list_pop_front (&pifs->defrag_list),
+                      struct pifs_deletor_item, elem));
 }
 
 bool
@@ -448,6 +1258,7 @@ pifs_format (struct pifs_device *pifs)
   
   PIFS_DEBUG ("PIFS is formatting free-maps.\n");
   
+  pifs->journal = 0; // nothing to journal until the device is formatted
   init_header (pifs->header_block);
   bitset_mark (header->used_map, 0);
   
@@ -490,6 +1301,22 @@ pifs_format (struct pifs_device *pifs)
       block_cache_return (pifs->bc, page);
     }
   
+  // write an empty journal, unless it would take more than 1/8 of the device:
+  
+  if (PIFS_JOURNAL_BLOCKS * 8 <= block_size (pifs->bc->device))
+    {
+      PIFS_DEBUG ("PIFS is formatting journal (%u).\n", nth_block);
+      
+      struct pifs_journal *desc = pifs->journal_buffer;
+      memset (desc, 0, sizeof (*desc));
+      desc->magic = PIFS_MAGIC_JOURNAL;
+      block_write (pifs->bc->device, nth_block, desc);
+      
+      bitset_mark_range (header->used_map, nth_block, PIFS_JOURNAL_BLOCKS);
+      header->journal = nth_block;
+      nth_block += PIFS_JOURNAL_BLOCKS;
+    }
+  
   // write root directory:
   
   PIFS_DEBUG ("PIFS is formatting root directory (%u).\n", nth_block);
@@ -507,7 +1334,9 @@ pifs_format (struct pifs_device *pifs)
   block_cache_return (pifs->bc, page);
   
   pifs->header_block->dirty = true;
-  return true;
+  pifs->journal = header->journal;
+  pifs->journal_sequence = 0;
+  return pifs_free_build (pifs);
 }
 
 bool
@@ -521,6 +1350,100 @@ pifs_sanity_check (struct pifs_device *pifs)
          (header->used_map[0] & 1);
 }
 
+// Returns the block of the entry called name in the folder extend, which
+// is stored in sector cur, or 0 if there is none.
+static pifs_ptr
+pifs_folder_find (pifs_ptr                  cur,
+                  const struct pifs_folder *folder,
+                  const char               *name,
+                  size_t                    name_len)
+{
+  if (folder->entries_count > PIFS_COUNT_FOLDER_ENTRIES)
+    PANIC ("Block %"PRDSNu" of filesystem is messed up.", cur);
+    
+  PIFS_DEBUG ("PIFS: In %u, looking for '%.*s'. Folder size = %u.\n",
+              cur, name_len, name, folder->entries_count);
+  
+  unsigned i;
+  for (i = 0; i < folder->entries_count; ++i)
+    {
+      const char *entry = &folder->entries[i].name[0];
+      if (!((memcmp (entry, name, name_len) == 0) &&
+            (name_len < PIFS_NAME_LENGTH ? entry[name_len] == 0 : true)))
+        continue;
+      if (folder->entries[i].block == 0)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up.", cur);
+      return folder->entries[i].block;
+    }
+  return 0;
+}
+
+// Looks up name in the folder extends starting with cur, following
+// bucket_next if by_bucket, or extends otherwise.
+static pifs_ptr
+pifs_folder_find_chain (struct pifs_device *pifs,
+                        pifs_ptr            cur,
+                        bool                by_bucket,
+                        const char         *name,
+                        size_t              name_len)
+{
+  pifs_ptr result = 0;
+  while (cur != 0 && result == 0)
+    {
+      struct block_page *page = block_cache_read (pifs->bc, cur);
+      struct pifs_folder *folder = (void *) &page->data;
+      if (folder->magic != PIFS_MAGIC_FOLDER)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up (magic = 0x%08X).",
+               cur, folder->magic);
+      result = pifs_folder_find (cur, folder, name, name_len);
+      pifs_ptr next = by_bucket ? folder->bucket_next : folder->extends;
+      if (next == cur)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(cur == next extend).", cur);
+      cur = next;
+      block_cache_return (pifs->bc, page);
+    }
+  return result;
+}
+
+static unsigned
+pifs_name_bucket (const char *name, size_t name_len)
+{
+  return hash_bytes (name, strnlen (name, name_len)) %
+         PIFS_COUNT_INDEX_BUCKETS;
+}
+
+static struct block_page *
+pifs_index_read (struct pifs_device *pifs, pifs_ptr index)
+{
+  struct block_page *page = block_cache_read (pifs->bc, index);
+  struct pifs_index *idx = (void *) &page->data;
+  if (idx->magic != PIFS_MAGIC_INDEX)
+    PANIC ("Block %"PRDSNu" of filesystem is messed up (magic = 0x%08X).",
+           index, idx->magic);
+  return page;
+}
+
+// Looks up name in the extends after the first one of an indexed folder.
+static pifs_ptr
+pifs_index_find (struct pifs_device *pifs,
+                 pifs_ptr            index,
+                 const char         *name,
+                 size_t              name_len)
+{
+  struct block_page *page = pifs_index_read (pifs, index);
+  struct pifs_index *idx = (void *) &page->data;
+  pifs_ptr bucket = idx->buckets[pifs_name_bucket (name, name_len)];
+  pifs_ptr legacy = idx->legacy;
+  block_cache_return (pifs->bc, page);
+  
+  pifs_ptr result = pifs_folder_find_chain (pifs, bucket, true,
+                                            name, name_len);
+  if (result == 0)
+    result = pifs_folder_find_chain (pifs, legacy, false, name, name_len);
+  return result;
+}
+
 static block_sector_t
 pifs_open_traverse (struct pifs_device  *pifs,
                     pifs_ptr             cur, 
@@ -559,6 +1482,14 @@ pifs_open_traverse (struct pifs_device  *pifs,
       return pifs_open_traverse (pifs, cur, path_);
     }
     
+  pifs_ptr next_block;
+  if (pifs_dentry_lookup (pifs, cur, *path_, path_elem_len, &next_block))
+    {
+      if (next_block == 0)
+        return cur;
+      goto found;
+    }
+    
   struct block_page *page = block_cache_read (pifs->bc, cur);
   struct pifs_inode_header *header = (void *) &page->data;
   if (header->magic != PIFS_MAGIC_FOLDER)
@@ -585,58 +1516,167 @@ pifs_open_traverse (struct pifs_device  *pifs,
       return pifs_open_traverse (pifs, cur, path_);
     }
     
-  pifs_ptr extends = cur;
-  for (;;)
+  // look in the first extend, then in the index or all further extends:
+  
+  struct pifs_folder *folder = (void *) header;
+  next_block = pifs_folder_find (cur, folder, *path_, path_elem_len);
+  pifs_ptr index = folder->index;
+  pifs_ptr extends = folder->extends;
+  block_cache_return (pifs->bc, page);
+  
+  if (next_block == 0 && index != 0)
+    next_block = pifs_index_find (pifs, index, *path_, path_elem_len);
+  else if (next_block == 0)
+    next_block = pifs_folder_find_chain (pifs, extends, false,
+                                         *path_, path_elem_len);
+  pifs_dentry_insert (pifs, cur, *path_, path_elem_len, next_block);
+  if (next_block == 0)
     {
-      struct pifs_folder *folder = (void *) header;
-      if (folder->entries_count > PIFS_COUNT_FOLDER_ENTRIES)
-        PANIC ("Block %"PRDSNu" of filesystem is messed up.", cur);
-        
-      PIFS_DEBUG ("PIFS: In %u (%u), looking for '%.*s'. Folder size = %u.\n",
-                  cur, extends, path_elem_len, *path_, folder->entries_count);
-      
-      unsigned i;
-      for (i = 0; i < folder->entries_count; ++i)
+      PIFS_DEBUG ("  Nothing found for '%s' in %u.\n", *path_, cur);
+      return cur;
+    }
+    
+found:
+  PIFS_DEBUG ("  Found '%.*s' in %u. Next '%s'.\n", path_elem_len, *path_,
+              next_block, next);
+  *path_ = next;
+  if (*next == 0)
+    return next_block;
+    
+  // We are not finished yet
+  return pifs_open_traverse (pifs, next_block, path_); // TCO
+}
+
+// Appends count blocks starting at sector start to the extent map of
+// inode, which must be loaded.
+static bool
+pifs_extents_append (struct pifs_inode *inode, pifs_ptr start, size_t count)
+{
+  ASSERT (inode->extents != NULL);
+  ASSERT (count > 0);
+  
+  size_t offset = 0;
+  if (inode->extents_count > 0)
+    {
+      struct pifs_extent *last = &inode->extents[inode->extents_count-1];
+      offset = last->offset + last->count;
+      if (last->start == 0 ? start == 0 : last->start + last->count == start)
         {
-          const char *name = &folder->entries[i].name[0];
-          PIFS_DEBUG ("    %u (%u) contains '%.*s'.\n", cur, extends,
-                      PIFS_NAME_LENGTH, name);
-          if (!((memcmp (name, *path_, path_elem_len) == 0) &&
-                (path_elem_len < PIFS_NAME_LENGTH ? name[path_elem_len] == 0
-                                                  : true)))
-            continue;
-            
-          // found!
-            
-          pifs_ptr next_block = folder->entries[i].block;
-          PIFS_DEBUG ("  Found '%.*s' in %u. Next '%s'.\n", PIFS_NAME_LENGTH,
-                      name, next_block, next);
-          if (next_block == 0)
-            PANIC ("Block %"PRDSNu" of filesystem is messed up.", cur);
-          block_cache_return (pifs->bc, page);
-          
-          *path_ = next;
-          if (*next == 0)
-            return next_block;
-            
-          // We are not finished yet
-          return pifs_open_traverse (pifs, next_block, path_); // TCO
+          last->count += count;
+          return true;
         }
-          
-      extends = folder->extends;
-      block_cache_return (pifs->bc, page);
-      if (extends == 0)
+    }
+    
+  if (inode->extents_count == inode->extents_capacity)
+    {
+      size_t capacity = inode->extents_capacity * 2;
+      struct pifs_extent *extents;
+      extents = realloc (inode->extents, capacity * sizeof (*extents));
+      if (extents == NULL)
+        return false;
+      inode->extents = extents;
+      inode->extents_capacity = capacity;
+    }
+    
+  struct pifs_extent *e = &inode->extents[inode->extents_count++];
+  e->offset = offset;
+  e->start = start;
+  e->count = count;
+  return true;
+}
+
+static void
+pifs_extents_drop (struct pifs_inode *inode)
+{
+  free (inode->extents);
+  inode->extents = NULL;
+  inode->extents_count = 0;
+  inode->extents_capacity = 0;
+}
+
+// Builds the extent map of the file inode from its block refs.
+static bool
+pifs_extents_load (struct pifs_inode *inode)
+{
+  ASSERT (!inode->is_directory);
+  if (inode->extents != NULL)
+    return true;
+    
+  inode->extents_capacity = 4;
+  inode->extents_count = 0;
+  inode->extents = malloc (inode->extents_capacity *
+                           sizeof (*inode->extents));
+  if (inode->extents == NULL)
+    return false;
+    
+  pifs_ptr cur = inode->sector;
+  while (cur != 0)
+    {
+      struct block_page *page = block_cache_read (inode->pifs->bc, cur);
+      struct pifs_file *extend = (void *) &page->data;
+      if (extend->magic != PIFS_MAGIC_FILE)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(magic = 0x%08X).", cur, extend->magic);
+      if (extend->blocks_count > PIFS_COUNT_FILE_BLOCKS)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(blocks_count = %u).", cur, extend->blocks_count);
+               
+      size_t i;
+      bool ok = true;
+      for (i = 0; i < extend->blocks_count && ok; ++i)
         {
-          PIFS_DEBUG ("  Nothing found for '%s' in %u.\n", *path_, cur);
-          return cur;
+          struct pifs_file_block_ref *ref = &extend->blocks[i];
+          if (ref->count == 0)
+            PANIC ("Block %"PRDSNu" of filesystem is messed up "
+                   "(ref[%u].start = %u, count == 0).",
+                   cur, i, ref->start);
+          ok = pifs_extents_append (inode, ref->start, ref->count);
         }
         
-      page = block_cache_read (pifs->bc, extends);
-      header = (void *) &page->data;
-      if (header->magic != PIFS_MAGIC_FOLDER)
-        PANIC ("Block %"PRDSNu" of filesystem is messed up (magic = 0x%08X).",
-               cur, header->magic);
+      if (cur == extend->extends)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(cur = cur->extends).", cur);
+      cur = extend->extends;
+      block_cache_return (inode->pifs->bc, page);
+      if (!ok)
+        {
+          pifs_extents_drop (inode);
+          return false;
+        }
+    }
+  return true;
+}
+
+// Finds the sector of the nth block of the file inode, and how many
+// consecutive blocks start there. Returns false if nth is not allocated.
+// The sector of a block in a hole is 0.
+static bool
+pifs_extents_lookup (struct pifs_inode *inode,
+                     size_t             nth,
+                     pifs_ptr          *sector,
+                     size_t            *run)
+{
+  ASSERT (inode->extents != NULL);
+  
+  // find the last extent with offset <= nth:
+  size_t lo = 0, hi = inode->extents_count;
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (inode->extents[mid].offset <= nth)
+        lo = mid + 1;
+      else
+        hi = mid;
     }
+  if (lo == 0)
+    return false;
+    
+  const struct pifs_extent *e = &inode->extents[lo-1];
+  if (nth >= e->offset + e->count)
+    return false;
+  *sector = e->start != 0 ? e->start + (nth - e->offset) : 0;
+  *run = e->offset + e->count - nth;
+  return true;
 }
 
 static struct pifs_inode *
@@ -651,6 +1691,7 @@ pifs_alloc_inode (struct pifs_device  *pifs, pifs_ptr cur)
   memset (result, 0, sizeof (*result));
   result->pifs = pifs;
   result->sector = cur;
+  rwlock_init (&result->rwlock);
   
   struct block_page *page = block_cache_read (pifs->bc, cur);
   struct pifs_folder *folder = (void *) &page->data;
@@ -680,55 +1721,134 @@ pifs_alloc_inode (struct pifs_device  *pifs, pifs_ptr cur)
       struct pifs_file *file = (struct pifs_file *) folder;
       result->is_directory = false;
       result->length = file->length;
+      result->inlined = file->blocks_count == 0 && file->extends == 0;
     }
   else
     PANIC ("Block %"PRDSNu" of filesystem is messed up.", cur);
   block_cache_return (pifs->bc, page);
   
-  if (result != NULL)
+  if (!result->is_directory)
+    pifs_extents_load (result); // or on first access if out of memory
+  
+  return result;
+}
+
+// Adds an inode of pifs_alloc_inode() to open_inodes. If another opener of
+// the sector was faster, frees it and returns the other one.
+static struct pifs_inode *
+pifs_open_inodes_insert (struct pifs_device *pifs, struct pifs_inode *inode)
+{
+  if (inode == NULL)
+    return NULL;
+    
+  lock_acquire (&pifs->open_inodes_lock);
+  struct hash_elem *e = hash_insert (&pifs->open_inodes, &inode->elem);
+  lock_release (&pifs->open_inodes_lock);
+  if (e == NULL)
+    return inode;
+    
+  free (inode->extents);
+  free (inode);
+  return hash_entry (e, struct pifs_inode, elem);
+}
+
+// Marks up to amount blocks of the best fitting free run as used.
+// Returns the count of blocks marked and stores the first one in *start.
+static size_t
+pifs_alloc_run (struct pifs_device *pifs, size_t amount, pifs_ptr *start)
+{
+  lock_acquire (&pifs->alloc_lock);
+  struct pifs_free_group *group = pifs_free_best (pifs, amount);
+  if (group == NULL)
+    {
+      lock_release (&pifs->alloc_lock);
+      return 0;
+    }
+    
+  struct block_page *page = block_cache_read (pifs->bc, group->sector);
+  struct pifs_header *header = (void *) &page->data;
+  if (header->magic != PIFS_MAGIC_HEADER)
+    PANIC ("Block %"PRDSNu" of filesystem is messed up "
+           "(magic = 0x%08X).", group->sector, header->magic);
+           
+  size_t run;
+  size_t bit = bitset_find_zeros (header->used_map, group->len, amount, &run);
+  if (run > amount)
+    run = amount;
+  if (run > 0)
     {
-      struct hash_elem *e UNUSED;
-      e = hash_insert (&pifs->open_inodes, &result->elem);
-      ASSERT (e == NULL);
+      bitset_mark_range (header->used_map, bit, run);
+      pifs_journal_dirty (pifs, page);
     }
+  pifs_free_update (pifs, group, header);
+  block_cache_return (pifs->bc, page);
   
-  return result;
+  *start = group->offset + bit;
+  lock_release (&pifs->alloc_lock);
+  return run;
 }
 
-static pifs_ptr
-pifs_alloc_block (struct pifs_device *pifs)
+// Finds the best fitting free run for amount blocks without marking it.
+// Returns its length and stores its first block in *start.
+static size_t
+pifs_find_run (struct pifs_device *pifs, size_t amount, pifs_ptr *start)
 {
-  pifs_ptr cur = 0, result = 0, offset = 0;
-  do
+  lock_acquire (&pifs->alloc_lock);
+  struct pifs_free_group *group = pifs_free_best (pifs, amount);
+  size_t run = 0;
+  if (group != NULL)
     {
-      struct block_page *page = block_cache_read (pifs->bc, cur);
+      struct block_page *page = block_cache_read (pifs->bc, group->sector);
       struct pifs_header *header = (void *) &page->data;
       if (header->magic != PIFS_MAGIC_HEADER)
-          PANIC ("Block %"PRDSNu" of filesystem is messed up "
-                 "(magic = 0x%08X).", cur, header->magic);
-      if (header->magic % 8 != 0)
-          PANIC ("Block %"PRDSNu" of filesystem is messed up "
-                 "(blocks_count = 0x%08X).", cur, header->blocks_count);
-                 
-      int len = header->blocks_count / 8;
-      if (len > PIFS_COUNT_USED_MAP_ENTRIES)
-          PANIC ("Block %"PRDSNu" of filesystem is messed up "
-                 "(apparent len = %u).", cur, len);
-                 
-      off_t bit_result = bitset_find_and_set_1 (&header->used_map[0], len);
-      if (bit_result > 0)
-        {
-          result = bit_result + offset;
-          page->dirty = true;
-        }
-      else
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(magic = 0x%08X).", group->sector, header->magic);
+      size_t bit = bitset_find_zeros (header->used_map, group->len, amount,
+                                      &run);
+      *start = group->offset + bit;
+      block_cache_return (pifs->bc, page);
+    }
+  lock_release (&pifs->alloc_lock);
+  return run;
+}
+
+// Marks up to amount free blocks as used that follow each other from sector
+// on, in the group of sector. Returns the count of blocks marked.
+static size_t
+pifs_alloc_at (struct pifs_device *pifs, pifs_ptr sector, size_t amount)
+{
+  lock_acquire (&pifs->alloc_lock);
+  struct pifs_free_group *group = pifs_free_group_of (pifs, sector);
+  size_t bit = sector - group->offset, run = 0;
+  if (bit < group->len * 8 && group->free > 0)
+    {
+      struct block_page *page = block_cache_read (pifs->bc, group->sector);
+      struct pifs_header *header = (void *) &page->data;
+      if (header->magic != PIFS_MAGIC_HEADER)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(magic = 0x%08X).", group->sector, header->magic);
+      while (run < amount && bit + run < group->len * 8u &&
+             !bitset_get (header->used_map, bit + run))
+        ++run;
+      if (run > 0)
         {
-          offset += PIFS_COUNT_USED_MAP_ENTRIES;
-          cur = header->extends;
+          bitset_mark_range (header->used_map, bit, run);
+          pifs_journal_dirty (pifs, page);
+          pifs_free_update (pifs, group, header);
         }
       block_cache_return (pifs->bc, page);
     }
-  while (result == 0 && cur != 0);
+  lock_release (&pifs->alloc_lock);
+  return run;
+}
+
+static pifs_ptr
+pifs_alloc_block (struct pifs_device *pifs)
+{
+  pifs_ptr result;
+  if (pifs_alloc_run (pifs, 1, &result) == 0)
+    return 0;
+  ASSERT (result != 0);
   return result;
 }
 
@@ -790,9 +1910,11 @@ pifs_alloc_multiple_cb (block_sector_t sector, void *aux_)
 }
 
 // caller has to init. *list
+// Takes at most max_runs runs, so that few headers change.
 static size_t
 pifs_alloc_multiple (struct pifs_device *pifs,
                      size_t              amount,
+                     size_t              max_runs,
                      struct list        *list)
 {
   ASSERT (list != NULL);
@@ -805,38 +1927,18 @@ pifs_alloc_multiple (struct pifs_device *pifs,
     .result = 0,
   };
   
-  pifs_ptr cur = 0;
-  do
+  // take the best fitting runs until amount is satisfied:
+  
+  for (; amount > 0 && max_runs > 0; --max_runs)
     {
-      struct block_page *page = block_cache_read (pifs->bc, cur);
-      struct pifs_header *header = (void *) &page->data;
-      if (header->magic != PIFS_MAGIC_HEADER)
-          PANIC ("Block %"PRDSNu" of filesystem is messed up "
-                 "(magic = 0x%08X).", cur, header->magic);
-      if (header->magic % 8 != 0)
-          PANIC ("Block %"PRDSNu" of filesystem is messed up "
-                 "(blocks_count = 0x%08X).", cur, header->blocks_count);
-                 
-      int len = header->blocks_count / 8;
-      if (len > PIFS_COUNT_USED_MAP_ENTRIES)
-          PANIC ("Block %"PRDSNu" of filesystem is messed up "
-                 "(apparent len = %u).", cur, len);
-                 
-      size_t left = bitset_find_and_set (&header->used_map[0], len, amount,
-                                         pifs_alloc_multiple_cb, &aux);
-      
-      ASSERT (left <= amount);
-      cur = header->extends;
-      aux.offset += header->blocks_count;
-      
-      if (left != amount)
-        {
-          page->dirty = true;
-          amount = left;
-        }
-      block_cache_return (pifs->bc, page);
+      pifs_ptr start;
+      size_t run = pifs_alloc_run (pifs, amount, &start), i;
+      if (run == 0)
+        break;
+      for (i = 0; i < run; ++i)
+        pifs_alloc_multiple_cb (start + i, &aux);
+      amount -= run;
     }
-  while (amount > 0 && cur != 0);
   
   return aux.result;
 }
@@ -854,29 +1956,119 @@ pifs_alloc_multiple_free_list (struct list *list)
     }
 }
 
+// Returns the page of an extend of the folder, whose first extend head is
+// full, that has room for name. Creates the folder's index, and a new
+// extend for name's bucket, if needed. Returns NULL if the disk is full.
 static struct block_page *
-pifs_create (struct pifs_device  *pifs,
-             pifs_ptr             parent_folder_ptr,
-             const char          *name,
-             size_t               name_len,
-             pifs_ptr            *new_block_)
+pifs_index_slot (struct pifs_device *pifs,
+                 pifs_ptr            head,
+                 const char         *name,
+                 size_t              name_len)
 {
-  ASSERT (pifs != NULL);
-  ASSERT (parent_folder_ptr != 0);
-  ASSERT (name != NULL);
-  ASSERT (*name != 0);
-  ASSERT (name_len > 0 && name_len <= PIFS_NAME_LENGTH);
-  ASSERT (new_block_ != NULL);
+  struct block_page *head_page = block_cache_read (pifs->bc, head);
+  struct pifs_folder *head_folder = (void *) &head_page->data;
+  if (head_folder->index == 0)
+    {
+      // the extends that already exist become the legacy extends:
+      
+      pifs_ptr index = pifs_alloc_block (pifs);
+      if (index == 0)
+        {
+          block_cache_return (pifs->bc, head_page);
+          return NULL;
+        }
+      PIFS_DEBUG ("PIFS creating index %u for %u.\n", index, head);
+      struct block_page *page = block_cache_write (pifs->bc, index);
+      struct pifs_index *idx = (void *) &page->data;
+      memset (idx, 0, sizeof (*idx));
+      idx->magic = PIFS_MAGIC_INDEX;
+      idx->parent_folder = head;
+      idx->legacy = head_folder->extends;
+      pifs_journal_dirty (pifs, page);
+      block_cache_return (pifs->bc, page);
+      
+      head_folder->index = index;
+      pifs_journal_dirty (pifs, head_page);
+    }
+    
+  struct block_page *index_page = pifs_index_read (pifs, head_folder->index);
+  struct pifs_index *idx = (void *) &index_page->data;
+  unsigned bucket = pifs_name_bucket (name, name_len);
   
-  PIFS_DEBUG ("PIFS creating '%.*s' in %u.\n", name_len, name,
-              parent_folder_ptr);
+  // use an extend of the bucket that has room:
   
-  // find space for new folder:
-    
-  pifs_ptr new_block = pifs_alloc_block (pifs);
-  if (new_block == 0)
-    return NULL;
-    
+  struct block_page *result = NULL;
+  pifs_ptr cur = idx->buckets[bucket];
+  while (cur != 0 && result == NULL)
+    {
+      struct block_page *page = block_cache_read (pifs->bc, cur);
+      struct pifs_folder *folder = (void *) &page->data;
+      if (folder->magic != PIFS_MAGIC_FOLDER)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up (magic = 0x%08X).",
+               cur, folder->magic);
+      if (folder->entries_count > PIFS_COUNT_FOLDER_ENTRIES)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(entries_count = %u).", cur, folder->entries_count);
+      if (folder->bucket_next == cur)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(cur == folder->bucket_next).", cur);
+               
+      if (folder->entries_count < PIFS_COUNT_FOLDER_ENTRIES)
+        result = page;
+      else
+        {
+          cur = folder->bucket_next;
+          block_cache_return (pifs->bc, page);
+        }
+    }
+    
+  // or prepend a new extend to the bucket and to the folder's extends:
+  
+  if (result == NULL && (cur = pifs_alloc_block (pifs)) != 0)
+    {
+      PIFS_DEBUG ("    new extend %u for bucket %u of %u\n", cur,
+                  bucket, head);
+      result = block_cache_write (pifs->bc, cur);
+      struct pifs_folder *folder = (void *) &result->data;
+      memset (folder, 0, sizeof (*folder));
+      folder->magic = PIFS_MAGIC_FOLDER;
+      folder->extends = head_folder->extends;
+      folder->bucket_next = idx->buckets[bucket];
+      head_folder->extends = cur;
+      idx->buckets[bucket] = cur;
+      pifs_journal_dirty (pifs, result);
+      pifs_journal_dirty (pifs, head_page);
+      pifs_journal_dirty (pifs, index_page);
+    }
+    
+  block_cache_return (pifs->bc, index_page);
+  block_cache_return (pifs->bc, head_page);
+  return result;
+}
+
+static struct block_page *
+pifs_create (struct pifs_device  *pifs,
+             pifs_ptr             parent_folder_ptr,
+             const char          *name,
+             size_t               name_len,
+             pifs_ptr            *new_block_)
+{
+  ASSERT (pifs != NULL);
+  ASSERT (parent_folder_ptr != 0);
+  ASSERT (name != NULL);
+  ASSERT (*name != 0);
+  ASSERT (name_len > 0 && name_len <= PIFS_NAME_LENGTH);
+  ASSERT (new_block_ != NULL);
+  
+  PIFS_DEBUG ("PIFS creating '%.*s' in %u.\n", name_len, name,
+              parent_folder_ptr);
+  
+  // find space for new folder:
+    
+  pifs_ptr new_block = pifs_alloc_block (pifs);
+  if (new_block == 0)
+    return NULL;
+    
   // open parent folder:
   
   struct block_page *page = block_cache_read (pifs->bc, parent_folder_ptr);
@@ -890,59 +2082,23 @@ pifs_create (struct pifs_device  *pifs,
     PANIC ("Block %"PRDSNu" of filesystem is messed up (magic = 0x%08X).",
            parent_folder_ptr, folder->magic);
     
-  // extend parent folder if needed:
+  // use the index if the first extend is full:
   
-  pifs_ptr cur = parent_folder_ptr;
-  while (folder->entries_count >= PIFS_COUNT_FOLDER_ENTRIES)
+  if (folder->entries_count >= PIFS_COUNT_FOLDER_ENTRIES)
     {
-      ASSERT (cur == page->nth);
-      
       if (folder->entries_count > PIFS_COUNT_FOLDER_ENTRIES)
         PANIC ("Block %"PRDSNu" of filesystem is messed up "
-               "(entries_count = %u).", cur, folder->entries_count);
-             
-      // traverse extends and allocate a new extend if needed:
-      
-      PIFS_DEBUG ("    folder extend is full: %u -> %u\n", page->nth,
-                  folder->extends);
-                  
-      if (page->nth == folder->extends)
-        PANIC ("Block %"PRDSNu" of filesystem is messed up "
-               "(cur == folder->extends).", page->nth);
+               "(entries_count = %u).", parent_folder_ptr,
+               folder->entries_count);
+      block_cache_return (pifs->bc, page);
       
-      cur = folder->extends;
-      if (cur != 0)
+      page = pifs_index_slot (pifs, parent_folder_ptr, name, name_len);
+      if (page == NULL)
         {
-          block_cache_return (pifs->bc, page);
-          page = block_cache_read (pifs->bc, cur);
-          ASSERT (page != NULL); // assertion is valid when write-locked
-          
-          folder = (void *) &page->data[0];
-          if (folder->magic != PIFS_MAGIC_FOLDER)
-            PANIC ("Block %"PRDSNu" of filesystem is messed up"
-                   "(magic = 0x%08X).", cur, folder->magic);
-        }
-      else
-        {
-          cur = pifs_alloc_block (pifs);
-          PIFS_DEBUG ("      allocated %u\n", cur);
-          if (cur == 0)
-            {
-              block_cache_return (pifs->bc, page);
-              pifs_dealloc_blocks (pifs, new_block, 1);
-              return NULL;
-            }
-          folder->extends = cur;
-          page->dirty = true;
-          block_cache_return (pifs->bc, page);
-          
-          page = block_cache_write (pifs->bc, cur);
-          ASSERT (page != NULL); // assertion is valid when write-locked
-          
-          folder = (void *) &page->data[0];
-          memset (folder, 0, sizeof (*folder));
-          folder->magic = PIFS_MAGIC_FOLDER;
+          pifs_dealloc_blocks (pifs, new_block, 1);
+          return NULL;
         }
+      folder = (void *) &page->data[0];
     }
     
   // update parent folder's children list (or its extend):
@@ -956,8 +2112,9 @@ pifs_create (struct pifs_device  *pifs,
     folder->entries[folder->entries_count].name[name_len] = 0;
   folder->entries[folder->entries_count].block = new_block;
   ++folder->entries_count;
-  page->dirty = true;
+  pifs_journal_dirty (pifs, page);
   block_cache_return (pifs->bc, page);
+  pifs_dentry_insert (pifs, parent_folder_ptr, name, name_len, new_block);
   
   // update parent_folder inode:
   
@@ -977,7 +2134,7 @@ pifs_create (struct pifs_device  *pifs,
   page = block_cache_write (pifs->bc, new_block);
   ASSERT (page != NULL); // we made room for one page w/ a full rw lock
   memset (&page->data, 0, sizeof (page->data));
-  page->dirty = true;
+  pifs_journal_dirty (pifs, page);
   struct pifs_inode_header *inode_header = (void *) &page->data;
   inode_header->parent_folder = parent_folder_ptr;
   
@@ -1004,7 +2161,15 @@ pifs_open_rel (struct pifs_device  *pifs,
   ASSERT ((opts & POO_NO_CREATE) || ((opts & POO_MASK_FILE) ||
                                      (opts & POO_MASK_FOLDER)));
 
-  rwlock_acquire_write (&pifs->pifs_rwlock);
+  // Lookups share the lock, only a creation takes it for write, and then
+  // starts over, as the folder could have changed meanwhile:
+  const char *orig_path = path;
+  bool write = false;
+retry:
+  if (write)
+    rwlock_acquire_write (&pifs->pifs_rwlock);
+  else
+    rwlock_acquire_read (&pifs->pifs_rwlock);
   
   pifs_ptr found_sector;
   found_sector = pifs_open_traverse (pifs, root_sector, &path);
@@ -1034,7 +2199,9 @@ pifs_open_rel (struct pifs_device  *pifs,
       memset (&key, 0, sizeof (key));
       key.pifs = pifs;
       key.sector = found_sector;
+      lock_acquire (&pifs->open_inodes_lock);
       struct hash_elem *e = hash_find (&pifs->open_inodes, &key.elem);
+      lock_release (&pifs->open_inodes_lock);
       if (e != NULL)
         {
           result = hash_entry (e, struct pifs_inode, elem);
@@ -1048,6 +2215,7 @@ pifs_open_rel (struct pifs_device  *pifs,
       // alloc an inode:
       
       result = pifs_alloc_inode (pifs, found_sector);
+      result = pifs_open_inodes_insert (pifs, result);
     }
   else
     {
@@ -1091,26 +2259,43 @@ pifs_open_rel (struct pifs_device  *pifs,
       if (elem_len > PIFS_NAME_LENGTH)
         goto end; // invalid file name
         
+      if (!write)
+        {
+          rwlock_release_read (&pifs->pifs_rwlock);
+          path = orig_path;
+          write = true;
+          goto retry;
+        }
+        
       // create file or folder:
       
       pifs_ptr new_block;
       struct block_page *page;
+      pifs_journal_start (pifs, PIFS_CREDITS_CREATE);
       page = pifs_create (pifs, found_sector, path, elem_len, &new_block);
       if (!page)
-        goto end;
+        {
+          pifs_journal_stop (pifs, PIFS_CREDITS_CREATE);
+          goto end;
+        }
       
       struct pifs_inode_header *inode_header = (void *) &page->data;
       inode_header->magic = must_be_folder ? PIFS_MAGIC_FOLDER
                                            : PIFS_MAGIC_FILE;
       block_cache_return (pifs->bc, page);
+      pifs_journal_stop (pifs, PIFS_CREDITS_CREATE);
       
       result = pifs_alloc_inode (pifs, new_block);
+      result = pifs_open_inodes_insert (pifs, result);
     }
 
 end:
   if (result)
-    ++result->open_count;
-  rwlock_release_write (&pifs->pifs_rwlock);
+    __sync_add_and_fetch (&result->open_count, 1); // pifs_close is lockless
+  if (write)
+    rwlock_release_write (&pifs->pifs_rwlock);
+  else
+    rwlock_release_read (&pifs->pifs_rwlock);
   return result;
 }
 
@@ -1175,10 +2360,17 @@ pifs_close (struct pifs_inode *inode)
   intr_set_level (old_level);
 }
 
+// Reads the entry at *cursor and advances it. The cursor stays valid while
+// the folder is open, as the extends of a folder are freed with it only.
+// Entries removed or added while reading may be skipped or repeated.
 bool
-pifs_readdir (struct pifs_inode *inode, size_t index, off_t *len, char *dest)
+pifs_readdir (struct pifs_inode         *inode,
+              struct pifs_readdir_cursor *cursor,
+              off_t                      *len,
+              char                       *dest)
 {
   ASSERT (inode != NULL);
+  ASSERT (cursor != NULL);
   ASSERT (len != NULL);
   ASSERT (intr_get_level () == INTR_ON);
   
@@ -1188,9 +2380,14 @@ pifs_readdir (struct pifs_inode *inode, size_t index, off_t *len, char *dest)
   rwlock_acquire_read (&inode->pifs->pifs_rwlock);
   
   bool result = false;
-  pifs_ptr cur = inode->sector;
+  if (cursor->sector == 0)
+    {
+      cursor->sector = inode->sector;
+      cursor->slot = 0;
+    }
   for (;;)
     {
+      pifs_ptr cur = cursor->sector;
       struct block_page *page = block_cache_read (inode->pifs->bc, cur);
       if (!page)
         break;
@@ -1203,15 +2400,15 @@ pifs_readdir (struct pifs_inode *inode, size_t index, off_t *len, char *dest)
         PANIC ("Block %"PRDSNu" of filesystem is messed up "
                "(entries_count = %u).", cur, folder->entries_count);
                
-      if (index < folder->entries_count)
+      if (cursor->slot < folder->entries_count)
         {
           // found:
           
-          const char *src = &folder->entries[index].name[0];
+          const char *src = &folder->entries[cursor->slot].name[0];
           off_t actual_len = strnlen (src, PIFS_NAME_LENGTH);
           if (actual_len > *len-1)
             {
-              // the name is too long
+              // the name is too long, the cursor stays
               result = false;
             }
           else
@@ -1219,28 +2416,32 @@ pifs_readdir (struct pifs_inode *inode, size_t index, off_t *len, char *dest)
               result = true;
               memcpy (dest, src, actual_len);
               dest[actual_len] = 0;
+              ++cursor->slot;
             }
           *len = actual_len+1;
           
           block_cache_return (inode->pifs->bc, page);
           break;
         }
+      else if (folder->extends == 0)
+        {
+          // end of folder, the cursor stays to see later additions
+          
+          block_cache_return (inode->pifs->bc, page);
+          *len = 0;
+          break;
+        }
       else
         {
           // proceed:
           
-          index -= folder->entries_count;
           if (cur == folder->extends)
             PANIC ("Block %"PRDSNu" of filesystem is messed up "
                    "(cur == folder->extends).", cur);
-          cur = folder->extends;
+          cursor->sector = folder->extends;
+          cursor->slot = 0;
           
           block_cache_return (inode->pifs->bc, page);
-          if (cur == 0)
-            {
-              *len = 0;
-              break;
-            }
         }
     }
   
@@ -1264,9 +2465,18 @@ pifs_unmark_blocks (struct pifs_device *pifs,
     }
 }
 
+enum pifs_grow_mode
+{
+  PIFS_GROW_EXACT, // allocate the blocks needed
+  PIFS_GROW_PREALLOCATE, // and reserve more for later appends
+  PIFS_GROW_SPARSE, // add holes instead of allocating blocks
+};
+
 // may grow by less bytes than requested or even not at all
 static void
-pifs_grow_file (struct pifs_inode *inode, size_t grow_by)
+pifs_grow_file (struct pifs_inode   *inode,
+                size_t               grow_by,
+                enum pifs_grow_mode  mode)
 {
   ASSERT (inode != NULL);
   
@@ -1283,23 +2493,6 @@ pifs_grow_file (struct pifs_inode *inode, size_t grow_by)
   ASSERT (file->magic == PIFS_MAGIC_FILE);
   ASSERT (file->length == inode->length);
     
-  // first use all currently allocated space:
-  
-  if (inode->length % BLOCK_SECTOR_SIZE != 0)
-    {
-      size_t simple_grow = BLOCK_SECTOR_SIZE - inode->length%BLOCK_SECTOR_SIZE;
-      PIFS_DEBUG ("  Simple growth by %u.\n", simple_grow);
-      if (grow_by < simple_grow)
-        simple_grow = grow_by;
-      grow_by -= simple_grow;
-      inode->length += simple_grow;
-    }
-    
-  if (grow_by == 0)
-    goto end;
-    
-  // allocate more blocks:
-    
   pifs_ptr cur = 0;
   struct block_page *cur_page = NULL;
   struct pifs_file *cur_extend = NULL;
@@ -1325,13 +2518,27 @@ pifs_grow_file (struct pifs_inode *inode, size_t grow_by)
     return true;
   }
   
-  // traverse to last extend:
+  // keeps the extent map in sync, or drops it if it cannot grow:
   
+  auto void pifs_grow_file_map (pifs_ptr start, size_t count);
+  void
+  pifs_grow_file_map (pifs_ptr start, size_t count)
+  {
+    if (inode->extents != NULL && !pifs_extents_append (inode, start, count))
+      pifs_extents_drop (inode);
+  }
+  
+  // traverse to last extend, counting the allocated blocks:
+  
+  size_t capacity = 0;
   cur = inode->sector;
   for (;;)
     {
       if (!open_cur (true))
         goto end;
+      size_t i;
+      for (i = 0; i < cur_extend->blocks_count; ++i)
+        capacity += cur_extend->blocks[i].count;
       if (cur_extend->extends == 0)
         break;
       if (cur == cur_extend->extends)
@@ -1341,16 +2548,99 @@ pifs_grow_file (struct pifs_inode *inode, size_t grow_by)
       block_cache_return (inode->pifs->bc, cur_page);
   }
   
+  // a small file keeps its data in the inode sector:
+  
+  if (inode->inlined && inode->length + grow_by <= PIFS_INLINE_MAX)
+    {
+      inode->length += grow_by;
+      block_cache_return (inode->pifs->bc, cur_page);
+      goto end;
+    }
+  
+  // first use all currently allocated space:
+  
+  if (capacity * BLOCK_SECTOR_SIZE > inode->length)
+    {
+      size_t simple_grow = capacity * BLOCK_SECTOR_SIZE - inode->length;
+      PIFS_DEBUG ("  Simple growth by %u.\n", simple_grow);
+      if (grow_by < simple_grow)
+        simple_grow = grow_by;
+      grow_by -= simple_grow;
+      inode->length += simple_grow;
+    }
+    
+  if (grow_by == 0)
+    {
+      block_cache_return (inode->pifs->bc, cur_page);
+      goto end;
+    }
+    
   // allocated blocks to use:
   
   size_t blocks_to_alloc = DIV_ROUND_UP (grow_by, BLOCK_SECTOR_SIZE);
+  if (mode == PIFS_GROW_PREALLOCATE)
+    blocks_to_alloc += _MIN (_MAX (capacity, blocks_to_alloc),
+                             (size_t) PIFS_PREALLOC_MAX);
   
   struct list allocated_blocks;
   list_init (&allocated_blocks);
-  size_t alloc_count UNUSED = pifs_alloc_multiple (inode->pifs,
-                                                   blocks_to_alloc,
-                                                   &allocated_blocks);
-  PIFS_DEBUG ("  Allocated %u block(s).\n", alloc_count);
+  if (mode != PIFS_GROW_SPARSE)
+    {
+      if (blocks_to_alloc > PIFS_GROW_BLOCKS_MAX) // one step fits in a handle
+        blocks_to_alloc = PIFS_GROW_BLOCKS_MAX;
+      size_t alloc_count UNUSED = pifs_alloc_multiple (inode->pifs,
+                                                       blocks_to_alloc,
+                                                       PIFS_GROW_RUNS_MAX,
+                                                       &allocated_blocks);
+      PIFS_DEBUG ("  Allocated %u block(s).\n", alloc_count);
+    }
+  else
+    {
+      // only the data of a small file needs a block:
+      
+      if (blocks_to_alloc > PIFS_GROW_HOLE_MAX)
+        blocks_to_alloc = PIFS_GROW_HOLE_MAX;
+      bool ok = !inode->inlined || inode->length == 0;
+      if (!ok && pifs_alloc_multiple (inode->pifs, 1, 1, &allocated_blocks))
+        {
+          --blocks_to_alloc;
+          ok = true;
+        }
+      PIFS_DEBUG ("  Adding %u block(s) of holes.\n", blocks_to_alloc);
+      while (ok && blocks_to_alloc > 0)
+        {
+          struct pifs_alloc_multiple_item *ee = malloc (sizeof (*ee));
+          if (ee == NULL)
+            break;
+          ee->ref.start = 0;
+          ee->ref.count = _MIN (blocks_to_alloc,
+                                (size_t) PIFS_COUNT_FILE_REF_COUNT_MAX);
+          blocks_to_alloc -= ee->ref.count;
+          list_push_back (&allocated_blocks, &ee->elem);
+        }
+    }
+  
+  // move the data of a small file to its first block, where the refs go:
+  
+  if (inode->inlined && !list_empty (&allocated_blocks))
+    {
+      struct pifs_alloc_multiple_item *first;
+      first = list_entry (list_front (&allocated_blocks),
+                          struct pifs_alloc_multiple_item, elem);
+      if (inode->length > 0)
+        {
+          struct block_page *data_page;
+          data_page = block_cache_write (inode->pifs->bc, first->ref.start);
+          memset (&data_page->data, 0, sizeof (data_page->data));
+          memcpy (&data_page->data, file->inline_data, inode->length);
+          data_page->dirty = true;
+          // the data must be on disk before the refs are committed:
+          block_cache_flush (inode->pifs->bc, data_page);
+          block_cache_return (inode->pifs->bc, data_page);
+        }
+      memset (file->inline_data, 0, sizeof (file->inline_data));
+      inode->inlined = false;
+    }
   
   // insert blocks:
   
@@ -1361,13 +2651,10 @@ pifs_grow_file (struct pifs_inode *inode, size_t grow_by)
     {
       // advance:
       
-      ASSERT (grow_by != 0);
-      
       struct pifs_file_block_ref ee;
       ee = list_entry (e, struct pifs_alloc_multiple_item, elem)->ref;
       e = list_next (e);
       
-      ASSERT (ee.start != 0);
       ASSERT (ee.count != 0);
       
       // invariants ensured by "traverse to last extend" code block:
@@ -1393,14 +2680,18 @@ pifs_grow_file (struct pifs_inode *inode, size_t grow_by)
                        cur, cur_extend->blocks_count-1);
               
               if (last_ref->count < PIFS_COUNT_FILE_REF_COUNT_MAX &&
-                  last_ref->start+last_ref->count == ee.start)
+                  (last_ref->start == 0 ? ee.start == 0
+                                        : last_ref->start+last_ref->count ==
+                                          ee.start))
                 {
                   size_t amount = ee.count;
                   if (amount + last_ref->count > PIFS_COUNT_FILE_REF_COUNT_MAX)
                     amount = PIFS_COUNT_FILE_REF_COUNT_MAX - last_ref->count;
                     
                   last_ref->count += amount;
-                  ee.start += amount;
+                  pifs_grow_file_map (ee.start, amount);
+                  if (ee.start != 0)
+                    ee.start += amount;
                   ee.count -= amount;
             
                   // increase size:
@@ -1420,13 +2711,13 @@ pifs_grow_file (struct pifs_inode *inode, size_t grow_by)
               
               // allocate new extend if cur is full:
               
-              if (cur_extend->blocks_count == PIFS_COUNT_FILE_REF_COUNT_MAX)
+              if (cur_extend->blocks_count == PIFS_COUNT_FILE_BLOCKS)
                 {
                   pifs_ptr new_cur = pifs_alloc_block (inode->pifs);
                   if (new_cur == 0)
                     break;
                   cur_extend->extends = new_cur;
-                  cur_page->dirty = true;
+                  pifs_journal_dirty (inode->pifs, cur_page);
                   block_cache_return (inode->pifs->bc, cur_page);
                   
                   cur = new_cur;
@@ -1441,6 +2732,7 @@ pifs_grow_file (struct pifs_inode *inode, size_t grow_by)
       
           cur_extend->blocks[cur_extend->blocks_count] = ee;
           ++cur_extend->blocks_count;
+          pifs_grow_file_map (ee.start, ee.count);
           
           if (grow_by > ee.count * (size_t) BLOCK_SECTOR_SIZE)
             {
@@ -1463,7 +2755,7 @@ pifs_grow_file (struct pifs_inode *inode, size_t grow_by)
   
   if (cur_page)
     {
-      cur_page->dirty = true;
+      pifs_journal_dirty (inode->pifs, cur_page);
       block_cache_return (inode->pifs->bc, cur_page);
     }
 
@@ -1476,107 +2768,299 @@ end:
   if (file->length != inode->length)
     {
       file->length = inode->length;
-      page->dirty = true;
+      pifs_journal_dirty (inode->pifs, page);
     }
   block_cache_return (inode->pifs->bc, page);
 }
 
+// Grows the file to length, in steps that are operations of their own.
+// Stops early if the disk is full.
+static void
+pifs_extend_file (struct pifs_inode   *inode,
+                  size_t               length,
+                  enum pifs_grow_mode  mode)
+{
+  while (inode->length < length)
+    {
+      size_t old_length = inode->length;
+      pifs_journal_start (inode->pifs, PIFS_CREDITS_GROW);
+      pifs_grow_file (inode, length - inode->length, mode);
+      pifs_journal_stop (inode->pifs, PIFS_CREDITS_GROW);
+      if (inode->length == old_length)
+        break;
+    }
+}
+
+// Returns true if blocks of [start, start+length[ of the file are in a hole,
+// or if that is unknown.
+static bool
+pifs_extents_hole (struct pifs_inode *inode, size_t start, size_t length)
+{
+  if (inode->inlined || length == 0)
+    return false;
+  if (!pifs_extents_load (inode))
+    return true;
+    
+  size_t nth = start / BLOCK_SECTOR_SIZE;
+  size_t end = DIV_ROUND_UP (start + length, BLOCK_SECTOR_SIZE);
+  while (nth < end)
+    {
+      pifs_ptr sector;
+      size_t run;
+      if (!pifs_extents_lookup (inode, nth, &sector, &run))
+        break;
+      if (sector == 0)
+        return true;
+      nth += run;
+    }
+  return false;
+}
+
+// Zeroes count blocks of a run, and writes them, so that a crash after the
+// refs to them are committed does not expose the former content.
+static void
+pifs_zero_blocks (struct pifs_device *pifs, pifs_ptr start, size_t count)
+{
+  struct block_page *pages[PIFS_ZERO_BATCH];
+  while (count > 0)
+    {
+      size_t n = _MIN (count, (size_t) PIFS_ZERO_BATCH), i;
+      for (i = 0; i < n; ++i)
+        {
+          pages[i] = block_cache_write (pifs->bc, start + i);
+          memset (&pages[i]->data, 0, sizeof (pages[i]->data));
+          pages[i]->dirty = true;
+        }
+      block_cache_flush_many (pifs->bc, pages, n);
+      for (i = 0; i < n; ++i)
+        block_cache_return (pifs->bc, pages[i]);
+      start += n;
+      count -= n;
+    }
+}
+
+// Allocates zeroed blocks for [first, end[ of the hole in ref i of the extend
+// in page, which starts at block offset of the file, as far as one run
+// allows. Splits the extend if it has no room for the pieces of the hole.
+static bool
+pifs_fill_hole_ref (struct pifs_inode *inode,
+                    struct block_page *page,
+                    size_t             i,
+                    size_t             offset,
+                    size_t             first,
+                    size_t             end)
+{
+  struct pifs_device *pifs = inode->pifs;
+  struct pifs_file *extend = (void *) &page->data;
+  size_t count = extend->blocks[i].count;
+  size_t a = _MAX (first, offset), b = _MIN (end, offset + count);
+  ASSERT (extend->blocks[i].start == 0);
+  ASSERT (a < b);
+  
+  pifs_ptr start;
+  size_t run = pifs_alloc_run (pifs, b - a, &start);
+  if (run == 0)
+    return false;
+    
+  struct pifs_file_block_ref pieces[3];
+  size_t n = 0;
+  if (a > offset)
+    pieces[n++] = (struct pifs_file_block_ref) { 0, a - offset };
+  pieces[n++] = (struct pifs_file_block_ref) { start, run };
+  if (a + run < offset + count)
+    pieces[n++] = (struct pifs_file_block_ref) { 0, offset + count - a - run };
+    
+  // move the second half of the refs to a new extend if there is no room:
+  
+  struct block_page *new_page = NULL;
+  if (extend->blocks_count + n - 1 > PIFS_COUNT_FILE_BLOCKS)
+    {
+      pifs_ptr new_cur = pifs_alloc_block (pifs);
+      if (new_cur == 0)
+        {
+          pifs_dealloc_blocks (pifs, start, run);
+          return false;
+        }
+      new_page = block_cache_write (pifs->bc, new_cur);
+      struct pifs_file *new_extend = (void *) &new_page->data;
+      memset (new_extend, 0, sizeof (*new_extend));
+      new_extend->magic = PIFS_MAGIC_FILE;
+      
+      size_t half = extend->blocks_count / 2;
+      new_extend->blocks_count = extend->blocks_count - half;
+      memcpy (new_extend->blocks, &extend->blocks[half],
+              new_extend->blocks_count * sizeof (extend->blocks[0]));
+      new_extend->extends = extend->extends;
+      extend->blocks_count = half;
+      extend->extends = new_cur;
+      pifs_journal_dirty (pifs, new_page);
+      pifs_journal_dirty (pifs, page);
+      
+      if (i >= half)
+        {
+          i -= half;
+          page = new_page;
+          extend = new_extend;
+        }
+    }
+    
+  // replace the ref by the pieces:
+  
+  memmove (&extend->blocks[i + n], &extend->blocks[i + 1],
+           (extend->blocks_count - i - 1) * sizeof (extend->blocks[0]));
+  memcpy (&extend->blocks[i], pieces, n * sizeof (extend->blocks[0]));
+  extend->blocks_count += n - 1;
+  pifs_journal_dirty (pifs, page);
+  if (new_page != NULL)
+    block_cache_return (pifs->bc, new_page);
+    
+  // the zeroes must be on disk before the refs are committed:
+  pifs_zero_blocks (pifs, start, run);
+  return true;
+}
+
+// Allocates blocks for the first hole in the blocks [first, end[ of the
+// file, as far as one run allows. Returns false if there is no hole left,
+// or if the disk is full.
+static bool
+pifs_fill_hole (struct pifs_inode *inode, size_t first, size_t end)
+{
+  struct pifs_device *pifs = inode->pifs;
+  size_t offset = 0;
+  pifs_ptr cur = inode->sector;
+  while (cur != 0 && offset < end)
+    {
+      struct block_page *page = block_cache_read (pifs->bc, cur);
+      ASSERT (page != NULL);
+      struct pifs_file *extend = (void *) &page->data;
+      if (extend->magic != PIFS_MAGIC_FILE)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(magic = 0x%08X).", cur, extend->magic);
+      if (extend->blocks_count > PIFS_COUNT_FILE_BLOCKS)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(blocks_count = %u).", cur, extend->blocks_count);
+               
+      size_t i;
+      for (i = 0; i < extend->blocks_count && offset < end; ++i)
+        {
+          size_t count = extend->blocks[i].count;
+          if (extend->blocks[i].start == 0 && offset + count > first)
+            {
+              bool result = pifs_fill_hole_ref (inode, page, i, offset,
+                                                first, end);
+              block_cache_return (pifs->bc, page);
+              return result;
+            }
+          offset += count;
+        }
+        
+      cur = extend->extends;
+      block_cache_return (pifs->bc, page);
+    }
+  return false;
+}
+
+// Allocates the blocks of the holes in [start, start+length[ of the file,
+// in steps that are operations of their own. Stops early if the disk is full.
+static void
+pifs_fill_holes (struct pifs_inode *inode, size_t start, size_t length)
+{
+  if (!pifs_extents_hole (inode, start, length))
+    return;
+    
+  size_t first = start / BLOCK_SECTOR_SIZE;
+  size_t end = DIV_ROUND_UP (start + length, BLOCK_SECTOR_SIZE);
+  bool filled = false;
+  for (;;)
+    {
+      pifs_journal_start (inode->pifs, PIFS_CREDITS_FILL);
+      bool progress = pifs_fill_hole (inode, first, end);
+      pifs_journal_stop (inode->pifs, PIFS_CREDITS_FILL);
+      if (!progress)
+        break;
+      filled = true;
+    }
+    
+  // rebuild the extent map, as refs were split:
+  if (filled)
+    {
+      pifs_extents_drop (inode);
+      pifs_extents_load (inode);
+    }
+}
+
 typedef void (*pifs_iterater_file_cb) (struct pifs_inode *inode,
                                        size_t             start,
                                        size_t             length,
                                        pifs_ptr           nth,
                                        char              *data);
 
+// Calls cb for every block in [start, start+length[, as far as they are
+// allocated. The blocks are found in the extent map of the inode, or the
+// range of an inlined file in its inode sector.
+// If prefetch, the blocks needed from the current extent are queued for the
+// block cache's prefetcher, so that it reads them with a single request.
+// If holes, cb is called with nth == 0 for the blocks of holes, otherwise
+// the iteration stops at the first hole.
 static off_t
 pifs_iterater_file (struct pifs_inode     *inode,
                     size_t                 start,
                     size_t                 length,
                     pifs_iterater_file_cb  cb,
-                    char                  *data)
+                    char                  *data,
+                    bool                   prefetch,
+                    bool                   holes)
 {
-  off_t result = 0;
-  pifs_ptr cur_extend = inode->sector;
-  size_t nth_block = 0, nth_block_offs = 0;
-  
-  seek:while (cur_extend != 0 && length > 0)
+  if (!pifs_extents_load (inode))
+    return 0;
+    
+  if (inode->inlined)
     {
-      // seek to block:
-     
-      struct block_page *extend_page = block_cache_read (inode->pifs->bc,
-                                                         cur_extend);
-      struct pifs_file *extend = (void *) &extend_page->data;
-      if (extend->magic != PIFS_MAGIC_FILE)
-          PANIC ("Block %"PRDSNu" of filesystem is messed up "
-                 "(magic = 0x%08X).", cur_extend, extend->magic);
-      if (extend->blocks_count > PIFS_COUNT_FILE_BLOCKS)
-        PANIC ("Block %"PRDSNu" of filesystem is messed up "
-               "(blocks_count = %u).", cur_extend, extend->blocks_count);
-      if (extend->blocks_count == 0)
-        {
-          block_cache_return (inode->pifs->bc, extend_page);
-          break;
-        }
+      // the data is in the inode sector, behind the header:
       
-      while (start >= BLOCK_SECTOR_SIZE)
-        {
-          ASSERT (nth_block < extend->blocks_count);
-          struct pifs_file_block_ref *ref = &extend->blocks[nth_block];
-          if (ref->start == 0 || ref->count == 0)
-            PANIC ("Block %"PRDSNu" of filesystem is messed up "
-                   "(ref[%u].start == %u, count == %u).",
-                   cur_extend, nth_block, ref->start, ref->count);
-          ASSERT (nth_block_offs  < ref->count);
-          
-          // advance to next ref if needed:
-          
-          // TODO: advance by multiple block of ref->count at once
-          ++nth_block_offs;
-          if (nth_block_offs == ref->count)
-            {
-              nth_block_offs = 0;
-              ++nth_block;
-            }
-          
-          // advance to next extend if reached end of current one:
-          
-          if (nth_block == extend->blocks_count)
-            {
-              cur_extend = extend->extends;
-              block_cache_return (inode->pifs->bc, extend_page);
-              nth_block = 0;
-              goto seek;
-            }
-            
-          // advance:
-          
-          start -= BLOCK_SECTOR_SIZE;
-        }
-        
-      if (cur_extend == 0)
+      if (start >= inode->length)
+        return 0;
+      if (length > inode->length - start)
+        length = inode->length - start;
+      cb (inode, offsetof (struct pifs_file, inline_data) + start, length,
+          inode->sector, data);
+      return length;
+    }
+    
+  off_t result = 0;
+  pifs_ptr prefetched_begin = 0, prefetched_end = 0;
+  while (length > 0)
+    {
+      size_t offs = start % BLOCK_SECTOR_SIZE;
+      pifs_ptr nth;
+      size_t run;
+      if (!pifs_extents_lookup (inode, start / BLOCK_SECTOR_SIZE, &nth, &run))
         break;
-      struct pifs_file_block_ref ref = extend->blocks[nth_block];
-      size_t blocks_count = extend->blocks_count;
-      block_cache_return (inode->pifs->bc, extend_page);
-      if (nth_block >= blocks_count || ref.start == 0 ||
-          nth_block_offs >= ref.count || start >= BLOCK_SECTOR_SIZE)
+      if (nth == 0 && !holes)
         break;
         
-      // callback and advance:
-      
-      size_t len;
-      if (start == 0 && length >= BLOCK_SECTOR_SIZE)
-        len = BLOCK_SECTOR_SIZE;
-      else
+      size_t len = BLOCK_SECTOR_SIZE - offs;
+      if (len > length)
+        len = length;
+        
+      if (prefetch && nth != 0 &&
+          (nth < prefetched_begin || nth >= prefetched_end))
         {
-          len = BLOCK_SECTOR_SIZE - start;
-          if (len > length)
-            len = length;
+          // sectors of the rest of the request after nth, not counting
+          // from the start of the file:
+          size_t want = (offs + length - 1) / BLOCK_SECTOR_SIZE;
+          if (want > run - 1)
+            want = run - 1;
+          if (want > 0)
+            block_cache_prefetch (inode->pifs->bc, nth + 1, want);
+          prefetched_begin = nth;
+          prefetched_end = nth + 1 + want;
         }
         
-      cb (inode, start, len, ref.start+nth_block_offs, data);
+      cb (inode, offs, len, nth, data);
       
       result += len;
-      start += len; // we need to seek
+      start += len;
       length -= len;
       data += len;
     }
@@ -1593,6 +3077,22 @@ pifs_write_cb (struct pifs_inode  *inode,
 {
   // write a block:
   
+  ASSERT (nth != 0);
+  
+  // inlined data is metadata, as it shares the sector with the header:
+  if (nth == inode->sector)
+    {
+      PIFS_DEBUG ("  Writing inlined data to %u [%u,%u[.\n", nth, start,
+                  start+len);
+      pifs_journal_start (inode->pifs, PIFS_CREDITS_INLINE);
+      struct block_page *page = block_cache_read (inode->pifs->bc, nth);
+      memcpy (&page->data[start], src, len);
+      pifs_journal_dirty (inode->pifs, page);
+      block_cache_return (inode->pifs->bc, page);
+      pifs_journal_stop (inode->pifs, PIFS_CREDITS_INLINE);
+      return;
+    }
+  
   struct block_page *dest;
   if (start == 0 && len == BLOCK_SECTOR_SIZE)
     {
@@ -1621,15 +3121,73 @@ pifs_read_cb (struct pifs_inode  *inode,
                pifs_ptr            nth,
                char               *dest)
 {
-  // read a block:
+  // read a block, or the zeros of a hole:
   
   PIFS_DEBUG ("  Reading from %u [%u,%u[.\n", nth, start, start+len);
   
+  if (nth == 0)
+    {
+      memset (dest, 0, len);
+      return;
+    }
+  
   struct block_page *src = block_cache_read (inode->pifs->bc, nth);
   memcpy (dest, &src->data[start], len);
   block_cache_return (inode->pifs->bc, src);
 }
 
+static void
+pifs_zero_cb (struct pifs_inode  *inode,
+              size_t              start,
+              size_t              len,
+              pifs_ptr            nth,
+              char               *zeros)
+{
+  if (nth != 0) // a hole is zero already
+    pifs_write_cb (inode, start, len, nth, zeros);
+}
+
+// Overwrites [start, start+length[ of the file with zeros, e.g. the gap a
+// write behind the end of the file leaves in its (preallocated) blocks.
+static void
+pifs_zero_range (struct pifs_inode *inode, size_t start, size_t length)
+{
+  static const char zeros[BLOCK_SECTOR_SIZE];
+  while (length > 0)
+    {
+      size_t len = BLOCK_SECTOR_SIZE - start % BLOCK_SECTOR_SIZE;
+      if (len > length)
+        len = length;
+      if (pifs_iterater_file (inode, start, len, pifs_zero_cb,
+                              (char *) zeros, false, true) != (off_t) len)
+        break;
+      start += len;
+      length -= len;
+    }
+}
+
+// Locks the file for reading, or for writing if its extent map has to be
+// loaded or the file has to grow to end. Returns true in the latter case.
+static bool
+pifs_lock_file (struct pifs_inode *inode, size_t end)
+{
+  rwlock_acquire_read (&inode->rwlock);
+  if (inode->extents != NULL && inode->length >= end)
+    return false;
+  rwlock_release_read (&inode->rwlock);
+  rwlock_acquire_write (&inode->rwlock);
+  return true;
+}
+
+static void
+pifs_unlock_file (struct pifs_inode *inode, bool exclusive)
+{
+  if (exclusive)
+    rwlock_release_write (&inode->rwlock);
+  else
+    rwlock_release_read (&inode->rwlock);
+}
+
 off_t
 pifs_write (struct pifs_inode *inode,
             size_t             start,
@@ -1647,19 +3205,32 @@ pifs_write (struct pifs_inode *inode,
            start+length < start || start+length < length || inode->is_directory)
     return -1;
   
-  rwlock_acquire_write (&inode->pifs->pifs_rwlock);
+  // writes to different files, or inside of one, do not exclude each other,
+  // unless they have to fill holes:
+  bool exclusive = pifs_lock_file (inode, start+length);
+  if (!exclusive && pifs_extents_hole (inode, start, length))
+    {
+      rwlock_release_read (&inode->rwlock);
+      rwlock_acquire_write (&inode->rwlock);
+      exclusive = true;
+    }
   
-  // grow file if needed:
+  // grow file if needed, leaving a hole in front of the written range:
     
-  if (inode->length < start+length)
-    pifs_grow_file (inode, start+length - inode->length);
+  size_t old_length = inode->length;
+  pifs_extend_file (inode, start, PIFS_GROW_SPARSE);
+  pifs_extend_file (inode, start+length, PIFS_GROW_PREALLOCATE);
+  pifs_fill_holes (inode, start, length);
+  if (old_length < start && start < inode->length)
+    pifs_zero_range (inode, old_length, start - old_length);
   PIFS_DEBUG ("PIFS size of %u: %u.\n", inode->sector, inode->length);
   
   // write data:
   
-  off_t result = pifs_iterater_file (inode, start, length, pifs_write_cb, src);
+  off_t result = pifs_iterater_file (inode, start, length, pifs_write_cb, src,
+                                    false, false);
   
-  rwlock_release_write (&inode->pifs->pifs_rwlock);
+  pifs_unlock_file (inode, exclusive);
   
   return result;
 }
@@ -1682,17 +3253,320 @@ pifs_read (struct pifs_inode *inode,
            start+length < start || start+length < length || inode->is_directory)
     return -1;
   
-  rwlock_acquire_read (&inode->pifs->pifs_rwlock);
+  // loading a missing extent map changes the inode:
+  bool exclusive = pifs_lock_file (inode, 0);
+  
+  // read data, but not the preallocated blocks behind the end of the file:
+  
+  off_t result = 0;
+  if (start < inode->length)
+    {
+      if (length > inode->length - start)
+        length = inode->length - start;
+      result = pifs_iterater_file (inode, start, length, pifs_read_cb, dest,
+                                   true, true);
+    }
   
-  // read data:
+  pifs_unlock_file (inode, exclusive);
   
-  off_t result = pifs_iterater_file (inode, start, length, pifs_read_cb, dest);
+  return result;
+}
+
+// Allocates [0, length[ of the file in as few runs as possible and extends
+// it to length with zeros. Returns false if there was not enough space.
+bool
+pifs_allocate (struct pifs_inode *inode, size_t length)
+{
+  ASSERT (inode != NULL);
+  ASSERT (intr_get_level () == INTR_ON);
   
-  rwlock_release_read (&inode->pifs->pifs_rwlock);
+  if (length > INT_MAX || inode->is_directory)
+    return false;
+    
+  rwlock_acquire_write (&inode->rwlock);
+  
+  size_t old_length = inode->length;
+  if (old_length < length)
+    {
+      pifs_extend_file (inode, length, PIFS_GROW_EXACT);
+      pifs_zero_range (inode, old_length, inode->length - old_length);
+    }
+  pifs_fill_holes (inode, 0, _MIN (length, inode->length));
+  bool result = inode->length >= length &&
+                !pifs_extents_hole (inode, 0, length);
   
+  rwlock_release_write (&inode->rwlock);
+  
+  return result;
+}
+
+// Copies count blocks from one run to another, and writes the copies.
+static void
+pifs_defrag_copy (struct pifs_device *pifs,
+                  pifs_ptr            from,
+                  pifs_ptr            to,
+                  size_t              count)
+{
+  struct block_page *pages[PIFS_DEFRAG_BATCH];
+  block_cache_prefetch (pifs->bc, from, count);
+  while (count > 0)
+    {
+      size_t n = _MIN (count, (size_t) PIFS_DEFRAG_BATCH), i;
+      for (i = 0; i < n; ++i)
+        {
+          struct block_page *src = block_cache_read (pifs->bc, from + i);
+          pages[i] = block_cache_write (pifs->bc, to + i);
+          memcpy (&pages[i]->data, &src->data, BLOCK_SECTOR_SIZE);
+          pages[i]->dirty = true;
+          block_cache_return (pifs->bc, src);
+        }
+      block_cache_flush_many (pifs->bc, pages, n);
+      for (i = 0; i < n; ++i)
+        block_cache_return (pifs->bc, pages[i]);
+      from += n;
+      to += n;
+      count -= n;
+    }
+}
+
+// Where pifs_defrag continues.
+struct pifs_defrag_cursor
+{
+  size_t   pos; // blocks of the file before the next ref to look at
+  pifs_ptr hint; // where the next run should start, 0 if anywhere
+};
+
+// Moves the blocks of the first ref from the cursor on that does not start
+// at the hint there, if they are free. The copies are written before the
+// ref is changed. Returns false at the end of the file.
+static bool
+pifs_defrag_step (struct pifs_inode *inode, struct pifs_defrag_cursor *c)
+{
+  struct pifs_device *pifs = inode->pifs;
+  size_t offset = 0;
+  pifs_ptr cur = inode->sector;
+  while (cur != 0)
+    {
+      struct block_page *page = block_cache_read (pifs->bc, cur);
+      ASSERT (page != NULL);
+      struct pifs_file *extend = (void *) &page->data;
+      if (extend->magic != PIFS_MAGIC_FILE)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(magic = 0x%08X).", cur, extend->magic);
+      if (extend->blocks_count > PIFS_COUNT_FILE_BLOCKS)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(blocks_count = %u).", cur, extend->blocks_count);
+               
+      size_t i;
+      for (i = 0; i < extend->blocks_count; ++i)
+        {
+          pifs_ptr start = extend->blocks[i].start;
+          size_t count = extend->blocks[i].count;
+          offset += count;
+          if (offset <= c->pos || start == 0)
+            continue; // done, or a hole
+          c->pos = offset;
+          
+          bool attempt = c->hint != 0 && start != c->hint;
+          if (attempt)
+            {
+              size_t got = pifs_alloc_at (pifs, c->hint, count);
+              if (got == count)
+                {
+                  pifs_defrag_copy (pifs, start, c->hint, count);
+                  extend->blocks[i].start = c->hint;
+                  pifs_journal_dirty (pifs, page);
+                  pifs_dealloc_blocks (pifs, start, count);
+                  start = c->hint;
+                }
+              else if (got > 0)
+                pifs_dealloc_blocks (pifs, c->hint, got);
+            }
+          c->hint = start + count;
+          if (attempt)
+            {
+              block_cache_return (pifs->bc, page);
+              return true;
+            }
+        }
+        
+      cur = extend->extends;
+      block_cache_return (pifs->bc, page);
+    }
+  return false;
+}
+
+// Appends count refs to the n refs in dest, merging the ones that follow
+// each other on disk. Returns the new count of refs in dest.
+static size_t
+pifs_defrag_merge (struct pifs_file_block_ref       *dest,
+                   size_t                            n,
+                   const struct pifs_file_block_ref *src,
+                   size_t                            count)
+{
+  size_t i;
+  for (i = 0; i < count; ++i)
+    {
+      struct pifs_file_block_ref ref = src[i];
+      if (n > 0)
+        {
+          struct pifs_file_block_ref *last = &dest[n - 1];
+          if (last->start == 0 ? ref.start == 0
+                               : last->start + last->count == ref.start)
+            {
+              size_t amount = _MIN ((size_t) ref.count,
+                                    PIFS_COUNT_FILE_REF_COUNT_MAX -
+                                    (size_t) last->count);
+              last->count += amount;
+              if (ref.start != 0)
+                ref.start += amount;
+              ref.count -= amount;
+            }
+        }
+      if (ref.count > 0)
+        dest[n++] = ref;
+    }
+  return n;
+}
+
+// Packs the refs of the extend in sector cur and of its successor into as
+// few refs as possible, and moves as many as fit into cur. Frees the
+// successor if it becomes empty. Returns the extend to continue with.
+static pifs_ptr
+pifs_defrag_pack (struct pifs_inode *inode, pifs_ptr cur)
+{
+  struct pifs_device *pifs = inode->pifs;
+  struct block_page *page = block_cache_read (pifs->bc, cur);
+  ASSERT (page != NULL);
+  struct pifs_file *extend = (void *) &page->data;
+  pifs_ptr next = extend->extends;
+  if (next == 0 && extend->blocks_count == 0)
+    {
+      block_cache_return (pifs->bc, page);
+      return 0;
+    }
+    
+  struct pifs_file_block_ref *refs;
+  refs = malloc (2 * PIFS_COUNT_FILE_BLOCKS * sizeof (*refs));
+  if (refs == NULL)
+    {
+      block_cache_return (pifs->bc, page);
+      return 0;
+    }
+  size_t n = pifs_defrag_merge (refs, 0, extend->blocks,
+                                extend->blocks_count);
+                                
+  struct block_page *next_page = NULL;
+  struct pifs_file *next_extend = NULL;
+  if (next != 0)
+    {
+      next_page = block_cache_read (pifs->bc, next);
+      ASSERT (next_page != NULL);
+      next_extend = (void *) &next_page->data;
+      if (next_extend->magic != PIFS_MAGIC_FILE)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(magic = 0x%08X).", next, next_extend->magic);
+      if (next_extend->blocks_count > PIFS_COUNT_FILE_BLOCKS)
+        PANIC ("Block %"PRDSNu" of filesystem is messed up "
+               "(blocks_count = %u).", next, next_extend->blocks_count);
+      n = pifs_defrag_merge (refs, n, next_extend->blocks,
+                             next_extend->blocks_count);
+    }
+    
+  size_t first = _MIN (n, (size_t) PIFS_COUNT_FILE_BLOCKS);
+  size_t size = first * sizeof (*refs);
+  if (first != extend->blocks_count || memcmp (extend->blocks, refs, size))
+    {
+      memcpy (extend->blocks, refs, size);
+      extend->blocks_count = first;
+      pifs_journal_dirty (pifs, page);
+    }
+    
+  pifs_ptr result = next;
+  if (next_page != NULL)
+    {
+      size = (n - first) * sizeof (*refs);
+      if (n > first && (n - first != next_extend->blocks_count ||
+                        memcmp (next_extend->blocks, &refs[first], size)))
+        {
+          memcpy (next_extend->blocks, &refs[first], size);
+          next_extend->blocks_count = n - first;
+          pifs_journal_dirty (pifs, next_page);
+        }
+      else if (n == first)
+        {
+          // all refs fit into cur, unlink the successor:
+          
+          extend->extends = next_extend->extends;
+          pifs_journal_dirty (pifs, page);
+          pifs_dealloc_blocks (pifs, next, 1);
+          result = cur;
+        }
+      block_cache_return (pifs->bc, next_page);
+    }
+    
+  free (refs);
+  block_cache_return (pifs->bc, page);
   return result;
 }
 
+// Moves the blocks of the file into as few runs as possible, one ref per
+// step, then packs its refs into as few extends as possible. Readers and
+// writers are only excluded during a step.
+bool
+pifs_defrag (struct pifs_inode *inode)
+{
+  ASSERT (inode != NULL);
+  ASSERT (intr_get_level () == INTR_ON);
+  
+  if (inode->is_directory)
+    return false;
+  struct pifs_device *pifs = inode->pifs;
+  
+  // move the first run to a free run that can hold the whole file:
+  
+  struct pifs_defrag_cursor c = { 0, 0 };
+  rwlock_acquire_write (&inode->rwlock);
+  pifs_extents_drop (inode); // may be stale if the file was trimmed
+  if (pifs_extents_load (inode) && inode->extents_count > 1)
+    {
+      size_t total = 0, i;
+      for (i = 0; i < inode->extents_count; ++i)
+        if (inode->extents[i].start != 0)
+          total += inode->extents[i].count;
+      pifs_ptr start;
+      if (pifs_find_run (pifs, total, &start) >= total)
+        c.hint = start;
+    }
+  rwlock_release_write (&inode->rwlock);
+  
+  bool more;
+  do
+    {
+      rwlock_acquire_write (&inode->rwlock);
+      pifs_journal_start (pifs, PIFS_CREDITS_DEFRAG);
+      more = pifs_defrag_step (inode, &c);
+      pifs_journal_stop (pifs, PIFS_CREDITS_DEFRAG);
+      pifs_extents_drop (inode);
+      rwlock_release_write (&inode->rwlock);
+    }
+  while (more);
+  
+  // then free the extends that are not needed anymore:
+  
+  pifs_ptr cur = inode->sector;
+  while (cur != 0)
+    {
+      rwlock_acquire_write (&inode->rwlock);
+      pifs_journal_start (pifs, PIFS_CREDITS_DEFRAG);
+      cur = pifs_defrag_pack (inode, cur);
+      pifs_journal_stop (pifs, PIFS_CREDITS_DEFRAG);
+      pifs_extents_drop (inode);
+      rwlock_release_write (&inode->rwlock);
+    }
+  return true;
+}
+
 static bool
 pifs_delete_sub (struct pifs_inode *inode)
 {
@@ -1715,6 +3589,7 @@ pifs_delete_sub (struct pifs_inode *inode)
   
   // Delete from parent_folder:
   
+  pifs_journal_start (inode->pifs, PIFS_CREDITS_UNLINK);
   pifs_ptr s = parent_folder_sector;
   do
     {
@@ -1737,7 +3612,7 @@ pifs_delete_sub (struct pifs_inode *inode)
             memmove (&folder->entries[i], &folder->entries[i+1],
                      sizeof (struct pifs_folder_entry) *
                      (folder->entries_count - i));
-            folder_page->dirty = true;
+            pifs_journal_dirty (inode->pifs, folder_page);
             
             s = 0;
             break;
@@ -1746,6 +3621,7 @@ pifs_delete_sub (struct pifs_inode *inode)
       block_cache_return (inode->pifs->bc, folder_page);
     }
   while (s != 0);
+  pifs_journal_stop (inode->pifs, PIFS_CREDITS_UNLINK);
   
   // Update an open parent_folder inode:
   
@@ -1761,6 +3637,8 @@ pifs_delete_sub (struct pifs_inode *inode)
       --ee->length;
     }
   
+  pifs_dentry_forget (inode->pifs, inode->sector);
+  
   // Delete from pifs's hash:
   
   struct hash_elem *e2 UNUSED;
@@ -21,19 +21,73 @@ struct pifs_attrs // Even though we won't implement attributes ...
 
 typedef char _CASSERT_PIFS_ATTRS_SIZE[0 - !(sizeof (struct pifs_attrs) == 1)];
 
+// Groups of free block summaries, by the length of their longest run:
+// bucket 0 holds full groups, bucket i runs of [2^(i-1), 2^i[ blocks.
+#define PIFS_FREE_BUCKETS 13
+
+// Max. count of metadata sectors in a journal transaction. The journal holds
+// a lease on each until the transaction is committed.
+#define PIFS_JOURNAL_MAX 32
+
+// A transaction may lease at most this % of the cache. The cache must have
+// PIFS_CACHE_MIN pages, so that besides the journal the header, the
+// defragmenter, the prefetcher and the running operations find their pages.
+#define PIFS_JOURNAL_CACHE_PERCENT 25
+#define PIFS_CACHE_MIN 64
+
 struct pifs_device
 {
 /* public (readonly): */
   struct block_cache *bc;
 /* private: */
   struct hash         open_inodes; // [sector -> struct pifs_inode]
-  struct rwlock       pifs_rwlock;
+  struct rwlock       pifs_rwlock; // guards folders; dentries, open_inodes
+                                   // with their locks if held for read
+  struct lock         open_inodes_lock; // guards open_inodes for readers
   struct block_page  *header_block;
   
+  struct lock         alloc_lock; // guards the used_maps and the free_groups
+  struct pifs_free_group *free_groups; // one per pifs_header, by offset
+  size_t              free_groups_count;
+  struct list         free_buckets[PIFS_FREE_BUCKETS]; // of free_groups
+  
+  struct lock         dentries_lock; // guards the dentries for readers
+  struct hash         dentries; // [(folder, name) -> struct pifs_dentry]
+  struct list         dentries_lru; // least recently used dentry first
+  size_t              dentries_count;
+  
+  block_sector_t      journal; // first block of the journal, 0 if none
+  struct lock         journal_lock; // guards the following members
+  struct condition    journal_changed; // a handle stopped or a commit ended
+  size_t              journal_handles; // running operations
+  size_t              journal_credits; // sectors they may still add
+  bool                journal_committing; // no operation may start
+  size_t              journal_count; // sectors in the running transaction
+  struct block_page  *journal_pages[PIFS_JOURNAL_MAX]; // leased until commit
+  uint32_t            journal_sequence; // of the last commit
+  void               *journal_buffer; // descriptor and images of a commit
+  tid_t               journal_thread; // commits every PIFS_JOURNAL_INTERVAL_MS
+  volatile bool       journal_stop; // tells the journal thread to exit
+  struct semaphore    journal_thread_down;
+  
   struct semaphore    deletor_sema;
   struct list         deletor_list;
   tid_t               deletor_thread;
   struct semaphore    deletor_thread_down;
+  
+  struct semaphore    defrag_sema; // ups for every item and on shutdown
+  struct list         defrag_list; // closed, fragmented files
+  tid_t               defrag_thread;
+  volatile bool       defrag_stop; // tells the defragmenter to exit
+  struct semaphore    defrag_thread_down;
+};
+
+// A run of consecutive sectors of a file.
+struct pifs_extent
+{
+  size_t              offset; // index of the first block in the file
+  block_sector_t      start; // sector of the first block
+  size_t              count; // number of blocks
 };
 
 struct pifs_inode
@@ -47,6 +101,13 @@ struct pifs_inode
   block_sector_t      sector;
   size_t              open_count;
   bool                deleted; // will be deleted when closed
+  bool                inlined; // the data is in the inode sector
+  bool                defrag_queued; // was handed to the defragmenter
+  struct rwlock       rwlock; // guards length, extents and blocks of a file
+  struct pifs_extent *extents; // all blocks of a file, ordered by offset,
+                               // NULL if not loaded yet
+  size_t              extents_count;
+  size_t              extents_capacity;
   struct hash_elem    elem; // struct pifs_device::open_inodes
 };
 
@@ -91,11 +152,18 @@ struct pifs_inode *pifs_open2 (struct pifs_device  *pifs,
                                struct pifs_inode   *folder);
 void pifs_close (struct pifs_inode *inode);
 
+// Where pifs_readdir continues in a folder, zero initialize to start.
+struct pifs_readdir_cursor
+{
+  block_sector_t      sector; // extend of the folder, 0 before the first read
+  size_t              slot; // next entry in the extend
+};
+
 // *len includes terminator, returns actual length
-bool pifs_readdir (struct pifs_inode *inode,
-                   size_t             index,
-                   off_t             *len,
-                   char              *dest);
+bool pifs_readdir (struct pifs_inode          *inode,
+                   struct pifs_readdir_cursor *cursor,
+                   off_t                      *len,
+                   char                       *dest);
 
 off_t pifs_read (struct pifs_inode *inode,
                  size_t             start,
@@ -105,6 +173,10 @@ off_t pifs_write (struct pifs_inode *inode,
                   size_t             start,
                   size_t             length,
                   const void        *src);
+// allocates the file up to length bytes at once, zero filling its growth
+bool pifs_allocate (struct pifs_inode *inode, size_t length);
+// moves the blocks of the file into as few runs and extends as possible
+bool pifs_defrag (struct pifs_inode *inode);
 
 bool pifs_delete_file (struct pifs_inode *inode);
 bool pifs_delete_folder (struct pifs_inode *inode);
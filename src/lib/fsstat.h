@@ -0,0 +1,28 @@
+#ifndef __LIB_FSSTAT_H
+#define __LIB_FSSTAT_H
+
+/* Statistics of the file system, as returned by fsstat().
+   Histogram bucket I counts durations of less than
+   FSSTAT_HIST_BASE << I TSC cycles, the last bucket all longer ones. */
+#define FSSTAT_HIST_BUCKETS 16
+#define FSSTAT_HIST_BASE 1024
+
+struct fsstat
+  {
+    /* Block cache. */
+    unsigned cache_pages;       /* Current max. count of cached sectors. */
+    unsigned hits;              /* Accesses that found their sector. */
+    unsigned misses;            /* Accesses that had to read their sector. */
+    unsigned evictions;         /* Pages reused for another sector. */
+    unsigned writebacks;        /* Dirty pages written to the disk. */
+    unsigned stalls;            /* Waits because every page was in use. */
+    unsigned lease_hist[FSSTAT_HIST_BUCKETS];   /* How long pages were used. */
+
+    /* File system device. */
+    unsigned reads;             /* Sectors read. */
+    unsigned writes;            /* Sectors written. */
+    unsigned read_hist[FSSTAT_HIST_BUCKETS];    /* Latencies of reads. */
+    unsigned write_hist[FSSTAT_HIST_BUCKETS];   /* Latencies of writes. */
+  };
+
+#endif /* lib/fsstat.h */
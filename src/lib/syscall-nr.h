@@ -28,7 +28,13 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+
+    /* Extensions. */
+    SYS_FSSTAT,                 /* Reads file system statistics. */
+    SYS_FALLOCATE,              /* Allocates the space of a file up front. */
+    SYS_GETDENTS,               /* Reads many directory entries at once. */
+    SYS_DEFRAG                  /* Moves a file into few runs of sectors. */
   };
 
 #endif /* lib/syscall-nr.h */
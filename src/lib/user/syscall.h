@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <debug.h>
 #include <errno.h>
+#include <fsstat.h>
 
 /* Process identifier. */
 typedef int pid_t;
@@ -46,4 +47,10 @@ bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
 
+/* Extensions. */
+bool fsstat (struct fsstat *);
+bool fallocate (int fd, unsigned length);
+int getdents (int fd, char *buffer, unsigned size);
+bool defrag (int fd);
+
 #endif /* lib/user/syscall.h */
@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($a) = random_bytes (21000);
+my ($b) = random_bytes (20000);
+check_archive ({"a" => [$a], "b" => [$b]});
+pass;
@@ -0,0 +1,65 @@
+/* Writes two files alternately one sector at a time, so that their
+   blocks interleave, defragments both, and checks that their
+   contents are preserved, also after more data is appended. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 20000
+#define CHUNK_SIZE 512
+#define APPEND_SIZE 1000
+static char buf_a[FILE_SIZE + APPEND_SIZE];
+static char buf_b[FILE_SIZE];
+
+static void
+write_chunk (const char *file_name, int fd, const char *buf, size_t ofs,
+             size_t size)
+{
+  int ret_val = write (fd, buf + ofs, size);
+  if (ret_val != (int) size)
+    fail ("write %zu bytes at offset %zu in \"%s\" returned %d",
+          size, ofs, file_name, ret_val);
+}
+
+void
+test_main (void) 
+{
+  int fd_a, fd_b;
+  size_t ofs;
+
+  random_init (0);
+  random_bytes (buf_a, sizeof buf_a);
+  random_bytes (buf_b, sizeof buf_b);
+
+  CHECK (create ("a", 0), "create \"a\"");
+  CHECK (create ("b", 0), "create \"b\"");
+  CHECK ((fd_a = open ("a")) > 1, "open \"a\"");
+  CHECK ((fd_b = open ("b")) > 1, "open \"b\"");
+
+  msg ("write \"a\" and \"b\" alternately");
+  for (ofs = 0; ofs < FILE_SIZE; ofs += CHUNK_SIZE)
+    {
+      size_t size = CHUNK_SIZE;
+      if (size > FILE_SIZE - ofs)
+        size = FILE_SIZE - ofs;
+      write_chunk ("a", fd_a, buf_a, ofs, size);
+      write_chunk ("b", fd_b, buf_b, ofs, size);
+    }
+
+  CHECK (defrag (fd_a), "defrag \"a\"");
+  CHECK (defrag (fd_b), "defrag \"b\"");
+  CHECK (tell (fd_a) == FILE_SIZE, "tell \"a\"");
+
+  msg ("append to \"a\"");
+  write_chunk ("a", fd_a, buf_a, FILE_SIZE, APPEND_SIZE);
+
+  msg ("close \"a\"");
+  close (fd_a);
+  msg ("close \"b\"");
+  close (fd_b);
+
+  check_file ("a", buf_a, sizeof buf_a);
+  check_file ("b", buf_b, sizeof buf_b);
+}
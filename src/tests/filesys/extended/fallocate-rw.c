@@ -0,0 +1,37 @@
+/* Preallocates a file with fallocate(), checks that it reads back
+   as zeros, then overwrites it and checks that a second, shorter
+   fallocate() neither truncates nor changes it. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 23456
+static char buf[FILE_SIZE];
+
+void
+test_main (void) 
+{
+  const char *file_name = "fallocated";
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (fallocate (fd, FILE_SIZE), "fallocate \"%s\"", file_name);
+  CHECK (filesize (fd) == FILE_SIZE, "filesize \"%s\"", file_name);
+  CHECK (tell (fd) == 0, "tell \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, FILE_SIZE);
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, FILE_SIZE) == FILE_SIZE, "write \"%s\"", file_name);
+  CHECK (fallocate (fd, FILE_SIZE / 2), "fallocate \"%s\" again", file_name);
+  CHECK (filesize (fd) == FILE_SIZE, "filesize \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+  check_file (file_name, buf, FILE_SIZE);
+}
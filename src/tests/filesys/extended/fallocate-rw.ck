@@ -0,0 +1,26 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(fallocate-rw) begin
+(fallocate-rw) create "fallocated"
+(fallocate-rw) open "fallocated"
+(fallocate-rw) fallocate "fallocated"
+(fallocate-rw) filesize "fallocated"
+(fallocate-rw) tell "fallocated"
+(fallocate-rw) close "fallocated"
+(fallocate-rw) open "fallocated" for verification
+(fallocate-rw) verified contents of "fallocated"
+(fallocate-rw) close "fallocated"
+(fallocate-rw) open "fallocated"
+(fallocate-rw) write "fallocated"
+(fallocate-rw) fallocate "fallocated" again
+(fallocate-rw) filesize "fallocated"
+(fallocate-rw) close "fallocated"
+(fallocate-rw) open "fallocated" for verification
+(fallocate-rw) verified contents of "fallocated"
+(fallocate-rw) close "fallocated"
+(fallocate-rw) end
+EOF
+pass;
@@ -0,0 +1,8 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+my ($tree);
+$tree->{'dir'}{"file$_"} = [''] foreach 0...39;
+check_archive ($tree);
+pass;
@@ -0,0 +1,61 @@
+/* Lists a directory with getdents() and a buffer that holds only
+   a few names, so that every call has to resume where the previous
+   one stopped, and checks that each entry is returned exactly
+   once. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_CNT 40
+
+static bool seen[FILE_CNT];
+
+void
+test_main (void) 
+{
+  char buf[2 * (READDIR_MAX_LEN + 1)];
+  char name[READDIR_MAX_LEN + 1];
+  int fd, names = 0, i;
+
+  CHECK (mkdir ("dir"), "mkdir \"dir\"");
+  msg ("create %d files in \"dir\"", FILE_CNT);
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      snprintf (name, sizeof name, "dir/file%d", i);
+      if (!create (name, 0))
+        fail ("create \"%s\" failed", name);
+    }
+
+  CHECK ((fd = open ("dir")) > 1, "open \"dir\"");
+  CHECK (getdents (fd, buf, READDIR_MAX_LEN) == -1,
+         "getdents with a buffer too small for a name");
+  msg ("getdents with a buffer of %zu bytes until the end", sizeof buf);
+  for (;;)
+    {
+      int size = getdents (fd, buf, sizeof buf), pos;
+      if (size < 0)
+        fail ("getdents returned %d", size);
+      if (size == 0)
+        break;
+      for (pos = 0; pos < size; pos += strlen (buf + pos) + 1)
+        {
+          const char *entry = buf + pos;
+          int n = atoi (entry + 4);
+          if (strncmp (entry, "file", 4) || n < 0 || n >= FILE_CNT
+              || seen[n])
+            fail ("unexpected entry \"%s\"", entry);
+          seen[n] = true;
+          names++;
+        }
+    }
+  if (names != FILE_CNT)
+    fail ("getdents returned %d names instead of %d", names, FILE_CNT);
+  msg ("each name was returned once");
+  CHECK (getdents (fd, buf, sizeof buf) == 0, "getdents at the end");
+  msg ("close \"dir\"");
+  close (fd);
+}
@@ -0,0 +1,17 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(getdents-resume) begin
+(getdents-resume) mkdir "dir"
+(getdents-resume) create 40 files in "dir"
+(getdents-resume) open "dir"
+(getdents-resume) getdents with a buffer too small for a name
+(getdents-resume) getdents with a buffer of 30 bytes until the end
+(getdents-resume) each name was returned once
+(getdents-resume) getdents at the end
+(getdents-resume) close "dir"
+(getdents-resume) end
+EOF
+pass;
@@ -0,0 +1,10 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($data) = random_bytes (100);
+my ($patch) = random_bytes (50);
+substr ($data, 20, 50) = $patch;
+check_archive ({"small" => [$data]});
+pass;
@@ -0,0 +1,42 @@
+/* Writes a file small enough to be kept in its inode, then
+   overwrites part of it in place and checks its contents. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 100
+#define PATCH_OFS 20
+#define PATCH_SIZE 50
+static char buf[FILE_SIZE];
+static char patch[PATCH_SIZE];
+
+void
+test_main (void) 
+{
+  const char *file_name = "small";
+  int fd;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+  random_bytes (patch, sizeof patch);
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, FILE_SIZE) == FILE_SIZE, "write \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  msg ("seek \"%s\"", file_name);
+  seek (fd, PATCH_OFS);
+  CHECK (write (fd, patch, PATCH_SIZE) == PATCH_SIZE,
+         "overwrite \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  memcpy (buf + PATCH_OFS, patch, PATCH_SIZE);
+  check_file (file_name, buf, FILE_SIZE);
+}
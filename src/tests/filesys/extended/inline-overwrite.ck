@@ -0,0 +1,20 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(inline-overwrite) begin
+(inline-overwrite) create "small"
+(inline-overwrite) open "small"
+(inline-overwrite) write "small"
+(inline-overwrite) close "small"
+(inline-overwrite) open "small"
+(inline-overwrite) seek "small"
+(inline-overwrite) overwrite "small"
+(inline-overwrite) close "small"
+(inline-overwrite) open "small" for verification
+(inline-overwrite) verified contents of "small"
+(inline-overwrite) close "small"
+(inline-overwrite) end
+EOF
+pass;
@@ -290,6 +290,10 @@ parse_options (char **argv)
         scratch_bdev_name = value;
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
+      else if (!strcmp (name, "-fs-cache"))
+        fs_cache_size = (size_t) atoi (value);
+      else if (!strcmp (name, "-fs-cache-max"))
+        fs_cache_max_size = (size_t) atoi (value);
 #endif
       else if (!strcmp (name, "-rs"))
         random_init ((unsigned) atoi (value));
@@ -387,28 +391,32 @@ usage (void)
           "Options must precede actions.\n"
           "Actions are executed in the order specified.\n"
           "\nAvailable actions:\n"
-          "  run 'PROG [ARG...]' Run PROG and wait for it to complete.\n"
+          "  run 'PROG [ARG...]'  Run PROG and wait for it to complete.\n"
 #ifdef FILESYS
-          "  ls                 List files in the root directory.\n"
-          "  cat FILE           Print FILE to the console.\n"
-          "  rm FILE            Delete FILE.\n"
+          "  ls                   List files in the root directory.\n"
+          "  cat FILE             Print FILE to the console.\n"
+          "  rm FILE              Delete FILE.\n"
           "Use these actions indirectly via `pintos' -g and -p options:\n"
-          "  extract            Untar from scratch disk into file system.\n"
-          "  append FILE        Append FILE to tar file on scratch disk.\n"
+          "  extract              Untar from scratch disk into file system.\n"
+          "  append FILE          Append FILE to tar file on scratch disk.\n"
 #endif
           "\nOptions:\n"
-          "  -h                 Print this help message and power off.\n"
-          "  -q                 Power off VM after actions or on panic.\n"
-          "  -r                 Reboot after actions.\n"
+          "  -h                   Print this help message and power off.\n"
+          "  -q                   Power off VM after actions or on panic.\n"
+          "  -r                   Reboot after actions.\n"
 #ifdef FILESYS
-          "  -f                 Format file system disk during startup.\n"
-          "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
-          "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
-          "  -swap=BDEV         Use BDEV for swap instead of default.\n"
+          "  -f                   Format file system disk during startup.\n"
+          "  -filesys=BDEV        Use BDEV for file system instead of "
+          "default.\n"
+          "  -scratch=BDEV        Use BDEV for scratch instead of default.\n"
+          "  -swap=BDEV           Use BDEV for swap instead of default.\n"
+          "  -fs-cache=COUNT      Cache COUNT (at least 64) file system sectors "
+          "initially.\n"
+          "  -fs-cache-max=COUNT  Let the cache grow up to COUNT sectors.\n"
 #endif
-          "  -rs=SEED           Set random number seed to SEED.\n"
-          "  -mlfqs             Use multi-level feedback queue scheduler.\n"
-          "  -ul=COUNT          Limit user memory to COUNT pages.\n"
+          "  -rs=SEED             Set random number seed to SEED.\n"
+          "  -mlfqs               Use multi-level feedback queue scheduler.\n"
+          "  -ul=COUNT            Limit user memory to COUNT pages.\n"
           );
   shutdown_power_off ();
 }
@@ -129,6 +129,7 @@ struct thread
     struct hash swap_pages;
     struct hash vm_pages;
     struct hash mmap_aliases;
+    struct list vm_segments;
 
 #ifdef FILESYS
     /* Owned by filesys */
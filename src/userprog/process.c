@@ -602,8 +602,12 @@ validate_segment (const struct Elf32_Phdr *phdr, struct file *file)
    The pages initialized by this function must be writable by the
    user process if WRITABLE is true, read-only otherwise.
 
+   Nothing is read yet: each page is read from FILE on its first
+   fault, and unchanged pages are read again instead of being
+   swapped out.
+
    Return true if successful, false if a memory allocation error
-   or disk read error occurs. */
+   occurs or the segment overlaps another one. */
 static bool
 load_segment (struct file *file, off_t ofs, uint8_t *upage,
               uint32_t read_bytes, uint32_t zero_bytes, bool writable) 
@@ -612,43 +616,8 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
   ASSERT (pg_ofs (upage) == 0);
   ASSERT (ofs % PGSIZE == 0);
   
-  struct thread *t = thread_current ();
-
-  file_seek (file, ofs);
-  while (read_bytes > 0 || zero_bytes > 0) 
-    {
-      /* Calculate how to fill this page.
-         We will read PAGE_READ_BYTES bytes from FILE
-         and zero the final PAGE_ZERO_BYTES bytes. */
-      size_t page_read_bytes = read_bytes < PGSIZE ? read_bytes : PGSIZE;
-      size_t page_zero_bytes = PGSIZE - page_read_bytes;
-
-      /* Get a page of memory. */
-      if (!vm_alloc_zero (t, upage, !writable))
-        return false;
-      if (page_read_bytes > 0)
-        {
-          struct vm_ensure_group g;
-          vm_ensure_group_init (&g, t, NULL);
-          
-          void *kpage;
-          bool result = vm_ensure_group_add (&g, upage, &kpage) == VMER_OK;
-          result = result && (file_read (file, kpage, page_read_bytes) ==
-                              (int) page_read_bytes);
-          vm_kernel_wrote (t, upage, PGSIZE);
-          
-          vm_ensure_group_destroy (&g);
-          if (!result)
-            return false; 
-        }
-      // memset (kpage + page_read_bytes, 0, page_zero_bytes);
-
-      /* Advance. */
-      read_bytes -= page_read_bytes;
-      zero_bytes -= page_zero_bytes;
-      upage += PGSIZE;
-    }
-  return true;
+  return vm_alloc_segment (thread_current (), upage, file_get_inode (file),
+                           ofs, read_bytes, zero_bytes, !writable);
 }
 
 /* Create a minimal stack by mapping a zeroed page at the top of
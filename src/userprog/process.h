@@ -19,7 +19,6 @@ struct fd
   struct hash_elem  hash_elem;
   struct heap_elem  heap_elem;
   struct file      *file;
-  size_t            nth_readdir;
 };
 
 bool fd_less (const struct hash_elem *a, const struct hash_elem *b, void *t);
@@ -22,25 +22,12 @@
 
 static void syscall_handler (struct intr_frame *);
 
-static struct lock filesys_lock, stdin_lock;
-
-#define SYNC(WHAT)              \
-({                              \
-  lock_acquire (&filesys_lock); \
-  __typeof (WHAT) _r = (WHAT);  \
-  lock_release (&filesys_lock); \
-  _r;                           \
-})
-#define SYNC_VOID(WHAT) \
-({                      \
-  SYNC ( (WHAT, 0) );   \
-  (void) 0;             \
-})
+// The file system locks the files and folders itself.
+static struct lock stdin_lock;
 
 void
 syscall_init (void) 
 {
-  lock_init (&filesys_lock);
   lock_init (&stdin_lock);
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
 }
@@ -163,7 +150,7 @@ syscall_handler_SYS_EXEC (_SYSCALL_HANDLER_ARGS)
   signed len = user_strlen (g, file);
   if (len < 0)
     kill_segv (g);
-  if_->eax = SYNC (process_execute (file));
+  if_->eax = process_execute (file);
   vm_ensure_group_destroy (g);
 }
 
@@ -189,7 +176,7 @@ syscall_handler_SYS_CREATE (_SYSCALL_HANDLER_ARGS)
   signed len = user_strlen (g, filename);
   if (len < 0)
     kill_segv (g);
-  if_->eax = SYNC (filesys_create (filename, initial_size));
+  if_->eax = filesys_create (filename, initial_size);
   vm_ensure_group_destroy (g);
 }
 
@@ -203,7 +190,7 @@ syscall_handler_SYS_REMOVE (_SYSCALL_HANDLER_ARGS)
   signed len = user_strlen (g, filename);
   if (len < 0)
     kill_segv (g);
-  if_->eax = SYNC (filesys_remove (filename));
+  if_->eax = filesys_remove (filename);
   vm_ensure_group_destroy (g);
 }
 
@@ -244,7 +231,7 @@ syscall_handler_SYS_OPEN (_SYSCALL_HANDLER_ARGS)
   else
     fd->fd = 3;
   
-  fd->file = SYNC (filesys_open (filename));
+  fd->file = filesys_open (filename);
   if (!fd->file)
     {
       free (fd);
@@ -277,7 +264,7 @@ syscall_handler_SYS_FILESIZE (_SYSCALL_HANDLER_ARGS)
   
   struct fd *fd_data = retrieve_fd (g->thread, *(unsigned *) arg1);
   vm_ensure_group_destroy (g);
-  if_->eax = fd_data ? SYNC (file_length (fd_data->file)) : -1;
+  if_->eax = fd_data ? file_length (fd_data->file) : -1;
 }
 
 static void
@@ -304,7 +291,7 @@ syscall_handler_SYS_READ (_SYSCALL_HANDLER_ARGS)
           vm_ensure_group_destroy (g);
           return;
         }
-      result = SYNC (file_read (fd_data->file, buffer, length));
+      result = file_read (fd_data->file, buffer, length);
     }
   else
     {
@@ -353,12 +340,10 @@ syscall_handler_SYS_WRITE (_SYSCALL_HANDLER_ARGS)
   struct fd *fd_data = retrieve_fd (g->thread, fd);
   if (fd_data)
     {
-      lock_acquire (&filesys_lock);
       if (!thread_is_file_currently_executed (fd_data->file))
         if_->eax = file_write (fd_data->file, buffer, length);
       else
         if_->eax = 0;
-      lock_release (&filesys_lock);
     }
   else
     if_->eax = -EBADF;
@@ -378,7 +363,7 @@ syscall_handler_SYS_SEEK (_SYSCALL_HANDLER_ARGS)
   struct fd *fd_data = retrieve_fd (g->thread, fd);
   if (!fd_data)
     kill_segv (g);
-  SYNC_VOID (file_seek (fd_data->file, position));
+  file_seek (fd_data->file, position);
 }
 
 static void
@@ -391,7 +376,7 @@ syscall_handler_SYS_TELL (_SYSCALL_HANDLER_ARGS)
   if (!fd_data)
     kill_segv (g);
   vm_ensure_group_destroy (g);
-  if_->eax = SYNC (file_tell (fd_data->file));
+  if_->eax = file_tell (fd_data->file);
 }
 
 static void
@@ -408,7 +393,7 @@ syscall_handler_SYS_CLOSE (_SYSCALL_HANDLER_ARGS)
   heap_delete (&g->thread->fds_heap, &fd_data->heap_elem);
   vm_ensure_group_destroy (g);
   
-  SYNC_VOID (file_close (fd_data->file));
+  file_close (fd_data->file);
   free (fd_data);
 }
 
@@ -422,7 +407,9 @@ syscall_handler_SYS_MMAP (_SYSCALL_HANDLER_ARGS)
   void *base = *(void **) arg2;
   vm_ensure_group_destroy (g);
   
-  if (!fd_data || base < MIN_ALLOC_ADDR || pg_ofs (base) != 0)
+  // mappings are writable, so a running executable cannot be mapped:
+  if (!fd_data || base < MIN_ALLOC_ADDR || pg_ofs (base) != 0 ||
+      file_get_inode (fd_data->file)->deny_write_cnt > 0)
     {
       if_->eax = MAP_FAILED;
       return;
@@ -493,7 +480,7 @@ syscall_handler_SYS_MKDIR (_SYSCALL_HANDLER_ARGS)
     
   SYSCALL_DEBUG ("mkdir (\"%s\")\n", filename);
   
-  if_->eax = SYNC (filesys_create_folder (filename));
+  if_->eax = filesys_create_folder (filename);
   vm_ensure_group_destroy (g);
 }
 
@@ -511,23 +498,7 @@ syscall_handler_SYS_READDIR (_SYSCALL_HANDLER_ARGS)
   if (!ensure_user_memory (g, name, READDIR_MAX_LEN + 1, true))
     kill_segv (g);
     
-  if_->eax = false;
-  lock_acquire (&filesys_lock);
-    
-  struct pifs_inode *inode = file_get_inode (fd_data->file);
-  
-  if (!inode->is_directory || (inode->length <= fd_data->nth_readdir))
-    goto end;
-    
-  off_t len = READDIR_MAX_LEN + 1;
-  if (pifs_readdir (inode, fd_data->nth_readdir, &len, name))
-    {
-      ++fd_data->nth_readdir;
-      if_->eax = true;
-    }
-  
-end:
-  lock_release (&filesys_lock);
+  if_->eax = file_readdir (fd_data->file, name, READDIR_MAX_LEN + 1);
   vm_ensure_group_destroy (g);
 }
 
@@ -555,7 +526,90 @@ syscall_handler_SYS_INUMBER (_SYSCALL_HANDLER_ARGS)
   if (!fd_data)
     kill_segv (g);
   vm_ensure_group_destroy (g);
-  if_->eax = SYNC (file_get_inode (fd_data->file)->sector);
+  if_->eax = file_get_inode (fd_data->file)->sector;
+}
+
+static void
+syscall_handler_SYS_FSSTAT (_SYSCALL_HANDLER_ARGS)
+{
+  // bool fsstat (struct fsstat *);
+  ENSURE_USER_ARGS (1);
+  
+  struct fsstat *stats = *(struct fsstat **) arg1;
+  if (!ensure_user_memory (g, stats, sizeof (*stats), true))
+    kill_segv (g);
+    
+  filesys_get_stats (stats);
+  vm_kernel_wrote (g->thread, stats, sizeof (*stats));
+  vm_ensure_group_destroy (g);
+  if_->eax = true;
+}
+
+static void
+syscall_handler_SYS_FALLOCATE (_SYSCALL_HANDLER_ARGS)
+{
+  // bool fallocate (int fd, unsigned length);
+  ENSURE_USER_ARGS (2);
+  
+  struct fd *fd_data = retrieve_fd (g->thread, *(unsigned *) arg1);
+  unsigned length = *(unsigned *) arg2;
+  vm_ensure_group_destroy (g);
+  
+  if (!fd_data || length > INT_MAX)
+    {
+      if_->eax = false;
+      return;
+    }
+    
+  if (!thread_is_file_currently_executed (fd_data->file))
+    if_->eax = file_allocate (fd_data->file, length);
+  else
+    if_->eax = false;
+}
+
+static void
+syscall_handler_SYS_GETDENTS (_SYSCALL_HANDLER_ARGS)
+{
+  // int getdents (int fd, char *buffer, unsigned size);
+  // Returns the bytes filled with null terminated names, 0 at the end of the
+  // directory, or -1 if size cannot hold a name of READDIR_MAX_LEN.
+  ENSURE_USER_ARGS (3);
+  
+  struct fd *fd_data = retrieve_fd (g->thread, *(unsigned *) arg1);
+  if (!fd_data)
+    kill_segv (g);
+  char *buffer = *(char **) arg2;
+  unsigned size = *(unsigned *) arg3;
+  if (size > INT_MAX || !ensure_user_memory (g, buffer, size, true))
+    kill_segv (g);
+  if (size < READDIR_MAX_LEN + 1)
+    {
+      vm_ensure_group_destroy (g);
+      if_->eax = -1;
+      return;
+    }
+  
+  // fill in null terminated names as long as they fit:
+  
+  unsigned pos = 0;
+  while (pos < size && file_readdir (fd_data->file, &buffer[pos], size - pos))
+    pos += strlen (&buffer[pos]) + 1;
+  
+  vm_kernel_wrote (g->thread, buffer, pos);
+  vm_ensure_group_destroy (g);
+  if_->eax = pos;
+}
+
+static void
+syscall_handler_SYS_DEFRAG (_SYSCALL_HANDLER_ARGS)
+{
+  // bool defrag (int fd);
+  ENSURE_USER_ARGS (1);
+  
+  struct fd *fd_data = retrieve_fd (g->thread, *(unsigned *) arg1);
+  vm_ensure_group_destroy (g);
+  
+  if_->eax = fd_data ? file_defrag (fd_data->file) : false;
 }
 
 static void
@@ -597,6 +651,10 @@ syscall_handler (struct intr_frame *if_)
     _HANDLE (SYS_READDIR);
     _HANDLE (SYS_ISDIR);
     _HANDLE (SYS_INUMBER);
+    _HANDLE (SYS_FSSTAT);
+    _HANDLE (SYS_FALLOCATE);
+    _HANDLE (SYS_GETDENTS);
+    _HANDLE (SYS_DEFRAG);
     default:
       kill_segv (&g);
   }
@@ -68,3 +68,27 @@ void allocator_free (struct allocator *a, void *base, size_t amount)
   ASSERT (bitmap_all (a->used_map, pos, amount));
   bitmap_set_multiple (a->used_map, pos, amount, false);
 }
+
+size_t
+allocator_capacity (struct allocator *a)
+{
+  ASSERT (a != NULL);
+  return bitmap_size (a->used_map);
+}
+
+void *
+allocator_get (struct allocator *a, size_t pos)
+{
+  ASSERT (a != NULL);
+  ASSERT (pos < bitmap_size (a->used_map));
+  return bitmap_test (a->used_map, pos) ? item_pos (a, pos) : NULL;
+}
+
+bool
+allocator_contains (struct allocator *a, const void *item)
+{
+  ASSERT (a != NULL);
+  const uint8_t *end = item_pos (a, bitmap_size (a->used_map));
+  return (const uint8_t *) item >= (const uint8_t *) a->items &&
+         (const uint8_t *) item < end;
+}
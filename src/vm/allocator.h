@@ -22,4 +22,10 @@ void allocator_destroy (struct allocator *a);
 void *allocator_alloc (struct allocator *a, size_t amount);
 void allocator_free (struct allocator *a, void *base, size_t amount);
 
+// count of members
+size_t allocator_capacity (struct allocator *a);
+// member pos if it is allocated, NULL otherwise
+void *allocator_get (struct allocator *a, size_t pos);
+bool allocator_contains (struct allocator *a, const void *item);
+
 #endif
@@ -5,7 +5,34 @@ static inline void
 assert_filling (struct lru *l UNUSED)
 {
   ASSERT (l != NULL);
-  ASSERT ((l->item_count == 0) == list_empty (&l->lru_list));
+  ASSERT (l->fifo_count <= l->item_count);
+  ASSERT ((l->item_count - l->fifo_count == 0) == list_empty (&l->lru_list));
+  ASSERT ((l->fifo_count == 0) == list_empty (&l->fifo_list));
+}
+
+// LRU_POLICY_2Q: whether the fifo_list is to be disposed before the lru_list
+static inline bool
+fifo_first (struct lru *l)
+{
+  if (l->fifo_count == 0)
+    return false;
+  return l->fifo_count == l->item_count ||
+         l->fifo_count * 100 >= l->item_count * LRU_2Q_FIFO_PERCENT;
+}
+
+// elems of LRU_POLICY_LRU lists don't need to be zeroed
+static inline bool
+in_fifo (struct lru *l, struct lru_elem *e)
+{
+  return l->policy == LRU_POLICY_2Q && e->in_fifo;
+}
+
+static inline struct lru_elem *
+list_least (struct list *list)
+{
+  if (list_empty (list))
+    return NULL;
+  return list_entry (list_back (list), struct lru_elem, elem);
 }
 
 void
@@ -16,8 +43,10 @@ lru_init (struct lru         *l,
 {
   ASSERT (l != NULL);
   
-  memset (l, sizeof (*l), 0);
+  memset (l, 0, sizeof (*l));
   list_init (&l->lru_list);
+  list_init (&l->fifo_list);
+  l->policy = LRU_POLICY_LRU;
   l->lru_size = size;
   l->dispose_action = dispose_action;
   l->aux = aux;
@@ -27,13 +56,18 @@ void
 lru_free (struct lru *l)
 {
   assert_filling (l);
-  while (!list_empty (&l->lru_list))
-    {
-      struct list_elem *e = list_front (&l->lru_list);
-      ASSERT (e != NULL);
-      lru_dispose (l, list_entry (e, struct lru_elem, elem), true);
-    }
+  struct lru_elem *e;
+  while ((e = lru_peek_least (l)) != NULL)
+    lru_dispose (l, e, true);
+  assert_filling (l);
+}
+
+void
+lru_set_policy (struct lru *l, enum lru_policy policy)
+{
   assert_filling (l);
+  ASSERT (l->item_count == 0);
+  l->policy = policy;
 }
 
 void
@@ -47,10 +81,22 @@ lru_use (struct lru *l, struct lru_elem *e)
       ++l->item_count;
       if (l->lru_size > 0 && l->item_count > l->lru_size)
         lru_dispose (l, lru_peek_least (l), true);
+        
+      if (l->policy == LRU_POLICY_2Q && !e->referenced)
+        {
+          e->referenced = true;
+          e->in_fifo = true;
+          ++l->fifo_count;
+          list_push_front (&l->fifo_list, &e->elem);
+          assert_filling (l);
+          return;
+        }
     }
   else
     {
       ASSERT (e->lru_list == l);
+      if (in_fifo (l, e))
+        return; // a FIFO retains the order of insertion
       list_remove (&e->elem);
     }
   list_push_front (&l->lru_list, &e->elem);
@@ -71,6 +117,11 @@ lru_dispose (struct lru *l, struct lru_elem *e, bool run_dispose_action)
   
   list_remove_properly (&e->elem);
   e->lru_list = NULL;
+  if (in_fifo (l, e))
+    {
+      e->in_fifo = false;
+      --l->fifo_count;
+    }
   
   --l->item_count;
   if (run_dispose_action && l->dispose_action != NULL)
@@ -79,11 +130,39 @@ lru_dispose (struct lru *l, struct lru_elem *e, bool run_dispose_action)
   assert_filling (l);
 }
 
+void
+lru_unreference (struct lru_elem *e)
+{
+  ASSERT (e != NULL);
+  e->referenced = false;
+}
+
 struct lru_elem *
 lru_peek_least (struct lru *l)
 {
   assert_filling (l);
   if (l->item_count == 0)
     return NULL;
-  return list_entry (list_back (&l->lru_list), struct lru_elem, elem);
+  if (fifo_first (l))
+    return list_least (&l->fifo_list);
+  struct lru_elem *result = list_least (&l->lru_list);
+  return result != NULL ? result : list_least (&l->fifo_list);
+}
+
+struct lru_elem *
+lru_peek_next (struct lru *l, struct lru_elem *e)
+{
+  assert_filling (l);
+  ASSERT (e != NULL);
+  ASSERT (e->lru_list == l);
+  
+  // lru_peek_least's order: the list to dispose first, then the other one
+  bool fifo = in_fifo (l, e);
+  struct list *list = fifo ? &l->fifo_list : &l->lru_list;
+  struct list_elem *prev = list_prev (&e->elem);
+  if (prev != list_rend (list))
+    return list_entry (prev, struct lru_elem, elem);
+  if (fifo == fifo_first (l))
+    return list_least (fifo ? &l->lru_list : &l->fifo_list);
+  return NULL;
 }
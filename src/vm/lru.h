@@ -12,6 +12,8 @@ struct lru_elem
   void             *datum;
   struct list_elem  elem;
   struct lru       *lru_list;
+  bool              referenced; // LRU_POLICY_2Q: was used before
+  bool              in_fifo;    // LRU_POLICY_2Q: elem is in lru::fifo_list
   char              end[0];
 };
 
@@ -32,12 +34,28 @@ lru_is_interior (const struct lru_elem *elem)
 
 typedef void lru_dispose_action (struct lru_elem *e, void *aux);
 
+enum lru_policy
+{
+  LRU_POLICY_LRU, // plain least recently used
+  LRU_POLICY_2Q,  // first use enters a FIFO, only reuse enters the LRU
+};
+
+// With LRU_POLICY_2Q elements that were used only once are disposed first,
+// as long as they make up LRU_2Q_FIFO_PERCENT of the items.
+// So a long scan won't push out elements that are used repeatedly.
+// Its elems have to be zeroed before they are used for another item.
+#define LRU_2Q_FIFO_PERCENT 25
+
 struct lru
 {
   struct list         lru_list;
   size_t              lru_size, item_count;
   lru_dispose_action *dispose_action;
   void               *aux;
+  
+  enum lru_policy     policy;
+  struct list         fifo_list;  // LRU_POLICY_2Q: elems used once
+  size_t              fifo_count; // elems in fifo_list
 };
 
 void lru_init (struct lru         *l,
@@ -45,11 +63,17 @@ void lru_init (struct lru         *l,
                lru_dispose_action  dispose_action,
                void               *aux);
 void lru_free (struct lru *l);
+// must be called while l is empty
+void lru_set_policy (struct lru *l, enum lru_policy policy);
 
 void lru_use (struct lru *l, struct lru_elem *e);
 void lru_dispose (struct lru *l, struct lru_elem *e, bool run_dispose_action);
+// the next lru_use of e counts as its first use again
+void lru_unreference (struct lru_elem *e);
 
 struct lru_elem *lru_peek_least (struct lru *l);
+// next more recently used element than e, or NULL
+struct lru_elem *lru_peek_next (struct lru *l, struct lru_elem *e);
 
 static inline struct lru_elem *
 lru_pop_least (struct lru *l)
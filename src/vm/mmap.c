@@ -137,15 +137,20 @@ mmap_region_hash (const struct hash_elem *e, void *aux UNUSED)
   struct mmap_region *ee = hash_entry (e, struct mmap_region, regions_elem);
   ASSERT (ee->magic == REGION_MAGIC);
   ASSERT (ee->inode != NULL);
-  return (unsigned) ee->inode;
+  return (unsigned) ee->inode ^ ee->text;
 }
 
+// An inode has separate regions for mmap() and for the shared text.
 static bool
 mmap_region_less (const struct hash_elem *a,
                   const struct hash_elem *b,
                   void *aux UNUSED)
 {
-  return mmap_region_hash (a, NULL) < mmap_region_hash (b, NULL);
+  struct mmap_region *aa = hash_entry (a, struct mmap_region, regions_elem);
+  struct mmap_region *bb = hash_entry (b, struct mmap_region, regions_elem);
+  if (aa->inode != bb->inode)
+    return (unsigned) aa->inode < (unsigned) bb->inode;
+  return aa->text < bb->text;
 }
 
 static unsigned
@@ -397,7 +402,9 @@ mmap_alias_pages_count (struct mmap_alias *alias)
 }
 
 mapid_t
-mmap_alias_acquire (struct thread *owner, struct pifs_inode *inode)
+mmap_alias_acquire (struct thread     *owner,
+                    struct pifs_inode *inode,
+                    bool               text)
 {
   ASSERT (owner != NULL);
   ASSERT (inode != NULL);
@@ -407,6 +414,7 @@ mmap_alias_acquire (struct thread *owner, struct pifs_inode *inode)
   memset (&key, 0, sizeof (key));
   key.magic = REGION_MAGIC;
   key.inode = inode;
+  key.text = text;
   
   struct hash_elem *e_region = hash_find (&mmap_regions, &key.regions_elem);
   struct mmap_region *region;
@@ -425,6 +433,7 @@ mmap_alias_acquire (struct thread *owner, struct pifs_inode *inode)
       region->magic = REGION_MAGIC;
       ++inode->open_count;
       region->inode = inode;
+      region->text = text;
       region->length = inode->length; // TODO: remove member?
       list_init (&region->aliases);
     }
@@ -12,6 +12,7 @@ struct pifs_inode;
 struct mmap_region
 {
   struct pifs_inode *inode;
+  bool               text; // read-only pages of an executable, not mmap()'d
   size_t             length;
   struct list        aliases;
   struct hash        kpages;
@@ -60,7 +61,9 @@ void mmap_init (void);
 void mmap_init_thread (struct thread *owner);
 void mmap_clean (struct thread *owner);
 
-mapid_t mmap_alias_acquire (struct thread *owner, struct pifs_inode *inode);
+mapid_t mmap_alias_acquire (struct thread     *owner,
+                            struct pifs_inode *inode,
+                            bool               text);
 void mmap_alias_dispose (struct thread *owner, struct mmap_alias *alias);
 
 struct mmap_upage *mmap_retreive_upage (struct vm_page *vm_page);
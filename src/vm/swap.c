@@ -194,13 +194,7 @@ swap_alloc_and_write (struct thread *owner,
   
   ee->cksum = cksum (src, PGSIZE);
   block_sector_t sector = swap_page_to_sector (ee->id);
-  int i;
-  for (i = 0; i < PGSIZE/BLOCK_SECTOR_SIZE; ++i)
-    {
-      block_write (swap_disk, sector, src);
-      src += BLOCK_SECTOR_SIZE;
-      ++sector;
-    }
+  block_write_multiple (swap_disk, sector, PGSIZE/BLOCK_SECTOR_SIZE, src);
   
   //printf ("[OUT] %p  -> %4x (0x%8x)\n", ee->user_addr, ee->id, ee->cksum);
     
@@ -238,14 +232,7 @@ swap_read_and_retain (struct thread *owner,
     return false;
   
   block_sector_t sector = swap_page_to_sector (ee->id);
-  int i;
-  uint8_t *v = dest;
-  for (i = 0; i < PGSIZE/BLOCK_SECTOR_SIZE; ++i)
-    {
-      block_read (swap_disk, sector, v);
-      v += BLOCK_SECTOR_SIZE;
-      ++sector;
-    }
+  block_read_multiple (swap_disk, sector, PGSIZE/BLOCK_SECTOR_SIZE, dest);
   
   uint32_t read_cksum = cksum (dest, PGSIZE);
   bool result = read_cksum == ee->cksum;
@@ -267,15 +254,21 @@ swap_read_and_retain (struct thread *owner,
   return result;
 }
 
-static unsigned
-swap_page_hash (const struct hash_elem *e, void *t UNUSED)
+static inline struct swap_page *
+swap_page_entry (const struct hash_elem *e, void *t UNUSED)
 {
-  typedef char _CASSERT[0 - !(sizeof (unsigned) == sizeof (void *))];
   ASSERT (e != NULL);
   ASSERT (t != NULL);
   struct swap_page *ee = hash_entry (e, struct swap_page, hash_elem);
   ASSERT (ee->thread == t);
-  return (unsigned) ee->user_addr;
+  return ee;
+}
+
+static unsigned
+swap_page_hash (const struct hash_elem *e, void *t)
+{
+  // mix the page number, the low bits of user_addr are always zero
+  return hash_int ((int) pg_no (swap_page_entry (e, t)->user_addr));
 }
 
 static bool
@@ -283,7 +276,7 @@ swap_page_less (const struct hash_elem *a,
                 const struct hash_elem *b,
                 void *t)
 {
-  return swap_page_hash (a, t) < swap_page_hash (b, t);
+  return swap_page_entry (a, t)->user_addr < swap_page_entry (b, t)->user_addr;
 }
 
 void
@@ -12,7 +12,9 @@
 #include "threads/malloc.h"
 #include "threads/interrupt.h"
 #include "threads/synch.h"
+#include "threads/loader.h"
 #include "userprog/pagedir.h"
+#include "filesys/filesys.h"
 
 #define VMLP_MAGIC (('V'<<16) + ('L'<<8) + 'P')
 typedef char _CASSERT_VMLP_MAGIC24[0 - !(VMLP_MAGIC < (1<<24))];
@@ -22,6 +24,65 @@ static bool vm_is_initialized;
 static struct lru pages_lru;
 static struct lock vm_lock;
 
+// vm_tick examines at most VM_TICK_PAGES pages of pages_lru per tick,
+// resuming where the last tick stopped, so the timer interrupt doesn't
+// grow with the resident set.
+#define VM_TICK_PAGES 8
+static struct vm_page *vm_clock_hand;
+
+static void
+vm_lru_dispose (struct vm_page *ee)
+{
+  ASSERT (ee != NULL);
+  if (vm_clock_hand == ee)
+    vm_clock_hand = NULL;
+  lru_dispose (&pages_lru, &ee->lru_elem, false);
+}
+
+// Frame table, indexed by physical frame number.
+// Owners are frame.page->thread, or frame.mmap->upages for mmap'd pages.
+// A pinned frame is kept out of pages_lru, so eviction never picks it.
+struct vm_frame
+{
+  struct vm_page    *page; // resident page, NULL if not used by the vm
+  struct mmap_kpage *mmap; // VMPPT_MMAP_KPAGE: its mappings
+  unsigned           pins; // vm_ensure_groups using the frame
+};
+static struct vm_frame *vm_frames;
+
+static inline struct vm_frame *
+vm_frame_of (void *kpage)
+{
+  ASSERT (kpage != NULL);
+  ASSERT (pg_ofs (kpage) == 0);
+  
+  uintptr_t nth = vtop (kpage) >> PGBITS;
+  ASSERT (nth < ram_pages);
+  return &vm_frames[nth];
+}
+
+static void
+vm_frame_attach (void *kpage, struct vm_page *page, struct mmap_kpage *mmap)
+{
+  ASSERT (page != NULL);
+  ASSERT ((mmap != NULL) == (page->type == VMPPT_MMAP_KPAGE));
+  
+  struct vm_frame *frame = vm_frame_of (kpage);
+  ASSERT (frame->page == NULL);
+  frame->page = page;
+  frame->mmap = mmap;
+  frame->pins = 0;
+}
+
+static void
+vm_frame_release (void *kpage)
+{
+  struct vm_frame *frame = vm_frame_of (kpage);
+  frame->page = NULL;
+  frame->mmap = NULL;
+  frame->pins = 0;
+}
+
 static inline void
 assert_t_addr (struct thread *t UNUSED, const void *addr UNUSED)
 {
@@ -40,6 +101,10 @@ vm_init (void)
   lru_init (&pages_lru, 0, NULL, NULL);
   lock_init (&vm_lock);
   
+  vm_frames = calloc (ram_pages, sizeof (*vm_frames));
+  if (vm_frames == NULL)
+    PANIC ("Could not allocate the frame table.");
+  
   size_t user_pool_size;
   palloc_fill_ratio (NULL, NULL, NULL, &user_pool_size);
   
@@ -65,7 +130,9 @@ vm_thread_page_hash (const struct hash_elem *e, void *t)
   typedef char _CASSERT[0 - !(sizeof (unsigned) == sizeof (void *))];
   
   ASSERT (t != NULL);
-  return (unsigned) vmlp_entry (e,t)->user_addr;
+  // user_addr is page aligned and hash.c takes the low bits for the bucket,
+  // so the page number has to be mixed
+  return hash_int ((int) pg_no (vmlp_entry (e,t)->user_addr));
 }
 
 static bool
@@ -73,9 +140,20 @@ vm_thread_page_less (const struct hash_elem *a,
                      const struct hash_elem *b,
                      void *t)
 {
-  return vm_thread_page_hash (a,t) < vm_thread_page_hash (b,t);
+  return vmlp_entry (a,t)->user_addr < vmlp_entry (b,t)->user_addr;
 }
 
+// A segment of the executable. Its pages are VMPPT_EXEC until written to.
+struct vm_segment
+{
+  uint8_t           *base;        // first page
+  size_t             pages_count;
+  struct pifs_inode *inode;       // held open until vm_clean
+  size_t             ofs;         // file offset of base
+  size_t             read_bytes;  // the rest of the segment is zeroed
+  struct list_elem   elem;        // for thread.vm_segments
+};
+
 void
 vm_init_thread (struct thread *t)
 {
@@ -90,6 +168,7 @@ vm_init_thread (struct thread *t)
   
   swap_init_thread (t);
   hash_init (&t->vm_pages, &vm_thread_page_hash, &vm_thread_page_less, t);
+  list_init (&t->vm_segments);
   mmap_init_thread (t);
   
   lock_release (&vm_lock);
@@ -104,7 +183,7 @@ vm_dispose_real (struct vm_page *ee)
   ASSERT (ee != NULL);
   ASSERT (ee->vmlp_magic == VMLP_MAGIC);
   
-  lru_dispose (&pages_lru, &ee->lru_elem, false);
+  vm_lru_dispose (ee);
   if (ee->thread)
     hash_delete (&ee->thread->vm_pages, &ee->thread_elem);
   
@@ -114,6 +193,7 @@ vm_dispose_real (struct vm_page *ee)
     case VMPPT_EMPTY:
     case VMPPT_MMAP_ALIAS:
     case VMPPT_MMAP_KPAGE:
+    case VMPPT_EXEC:
       break;
       
     case VMPPT_SWAPPED:
@@ -131,12 +211,16 @@ vm_dispose_real (struct vm_page *ee)
         {
           pagedir_clear_page (ee->thread->pagedir, ee->user_addr);
           if (ee->type != VMPPT_MMAP_ALIAS)
-            palloc_free_page (kpage);
+            {
+              vm_frame_release (kpage);
+              palloc_free_page (kpage);
+            }
         }
     }
   else
     {
       ASSERT (ee->type == VMPPT_MMAP_KPAGE);
+      vm_frame_release (ee->user_addr);
       palloc_free_page (ee->user_addr);
     }
   
@@ -169,31 +253,48 @@ vm_clean (struct thread *t)
   hash_destroy (&t->vm_pages, &vm_clean_sub);
   swap_clean (t);
   
+  while (!list_empty (&t->vm_segments))
+    {
+      struct list_elem *e = list_pop_front (&t->vm_segments);
+      struct vm_segment *segment = list_entry (e, struct vm_segment, elem);
+      pifs_close (segment->inode);
+      free (segment);
+    }
+  
   lock_release (&vm_lock);
   intr_set_level (old_level);
 }
 
-static bool
-vm_alloc_zero_real (struct thread *t, void *addr, bool readonly)
+static struct vm_page *
+vm_alloc_page_real (struct thread     *t,
+                    void              *addr,
+                    bool               readonly,
+                    enum vm_page_type  type)
 {
   assert_t_addr (t, addr);
   ASSERT (intr_get_level () == INTR_OFF);
   ASSERT (lock_held_by_current_thread (&vm_lock));
   
-  //printf ("   ALLOC ZERO: %8p\n", addr);
-  
   struct vm_page *page = calloc (1, sizeof (*page));
   if (!page)
-    return false;
+    return NULL;
     
-  page->type       = VMPPT_EMPTY;
+  page->type       = type;
   page->thread     = t;
   page->user_addr  = addr;
   page->vmlp_magic = VMLP_MAGIC;
   page->readonly   = !!readonly;
   hash_insert (&t->vm_pages, &page->thread_elem);
   
-  return true;
+  return page;
+}
+
+static bool
+vm_alloc_zero_real (struct thread *t, void *addr, bool readonly)
+{
+  //printf ("   ALLOC ZERO: %8p\n", addr);
+  
+  return vm_alloc_page_real (t, addr, readonly, VMPPT_EMPTY) != NULL;
 }
 
 bool
@@ -224,6 +325,125 @@ vm_get_logical_page (struct thread *t, void *user_addr)
   return vmlp_entry (e,t);
 }
 
+bool
+vm_alloc_segment (struct thread     *t,
+                  void              *base,
+                  struct pifs_inode *inode,
+                  size_t             ofs,
+                  size_t             read_bytes,
+                  size_t             zero_bytes,
+                  bool               readonly)
+{
+  ASSERT (inode != NULL);
+  ASSERT ((read_bytes + zero_bytes) % PGSIZE == 0);
+  ASSERT (ofs % PGSIZE == 0);
+  ASSERT (intr_get_level () == INTR_ON);
+  
+  enum intr_level old_level;
+  lock_acquire2 (&vm_lock, &old_level);
+  
+  bool result = false;
+  if (read_bytes > 0)
+    {
+      struct vm_segment *segment = calloc (1, sizeof (*segment));
+      if (!segment)
+        goto end;
+      segment->base        = base;
+      segment->pages_count = (read_bytes + zero_bytes) / PGSIZE;
+      segment->inode       = inode;
+      segment->ofs         = ofs;
+      segment->read_bytes  = read_bytes;
+      __sync_add_and_fetch (&inode->open_count, 1);
+      list_push_back (&t->vm_segments, &segment->elem);
+    }
+  
+  // Read-only pages are shared through the executable's text mmap_region,
+  // so all processes running it use the same frames. It is separate from
+  // the region of mmap(), and munmap() cannot dispose its alias.
+  struct mmap_alias *alias = NULL;
+  if (readonly && read_bytes > 0)
+    {
+      mapid_t id = mmap_alias_acquire (t, inode, true);
+      if (id != MAP_FAILED)
+        alias = mmap_retreive_alias (t, id);
+    }
+  
+  size_t i;
+  for (i = 0; i < (read_bytes + zero_bytes) / PGSIZE; ++i)
+    {
+      void *addr = base + i*PGSIZE;
+      // overlapping segments cannot be loaded lazily
+      if (vm_get_logical_page (t, addr) != NULL)
+        goto end;
+      enum vm_page_type type = i*PGSIZE < read_bytes ? VMPPT_EXEC
+                                                     : VMPPT_EMPTY;
+      struct vm_page *page = vm_alloc_page_real (t, addr, readonly, type);
+      if (!page)
+        goto end;
+      
+      // mmap'd pages are zeroed after the end of the file only,
+      // so a partial page must be the file's last one
+      size_t nth_page = (ofs + i*PGSIZE) / PGSIZE;
+      if (alias != NULL && type == VMPPT_EXEC &&
+          nth_page < mmap_alias_pages_count (alias) &&
+          ((i+1)*PGSIZE <= read_bytes || ofs + read_bytes >= inode->length))
+        {
+          page->type = VMPPT_MMAP_ALIAS;
+          if (!mmap_alias_map_upage (alias, page, nth_page))
+            page->type = VMPPT_EXEC;
+        }
+    }
+  result = true;
+  
+end:
+  lock_release (&vm_lock);
+  intr_set_level (old_level);
+  return result;
+}
+
+static struct vm_segment *
+vm_segment_of (struct thread *t, void *user_addr)
+{
+  ASSERT (lock_held_by_current_thread (&vm_lock));
+  
+  struct list_elem *e;
+  for (e = list_begin (&t->vm_segments); e != list_end (&t->vm_segments);
+       e = list_next (e))
+    {
+      struct vm_segment *ee = list_entry (e, struct vm_segment, elem);
+      if ((uint8_t *) user_addr >= ee->base &&
+          (uint8_t *) user_addr < ee->base + ee->pages_count*PGSIZE)
+        return ee;
+    }
+  return NULL;
+}
+
+// Fills the frame of a VMPPT_EXEC page. Releases vm_lock during the read,
+// the page is kept out of pages_lru meanwhile, so it cannot be evicted.
+static bool
+vm_segment_read (struct vm_page *ee, void *kpage)
+{
+  ASSERT (ee->type == VMPPT_EXEC);
+  ASSERT (lock_held_by_current_thread (&vm_lock));
+  ASSERT (intr_get_level () == INTR_ON);
+  
+  struct vm_segment *segment = vm_segment_of (ee->thread, ee->user_addr);
+  ASSERT (segment != NULL);
+  
+  size_t page_ofs = (uint8_t *) ee->user_addr - segment->base;
+  ASSERT (page_ofs < segment->read_bytes);
+  size_t len = segment->read_bytes - page_ofs;
+  if (len > PGSIZE)
+    len = PGSIZE;
+  
+  vm_lru_dispose (ee);
+  lock_release (&vm_lock);
+  off_t read = pifs_read (segment->inode, segment->ofs + page_ofs, len, kpage);
+  memset (kpage + len, 0, PGSIZE - len);
+  lock_acquire (&vm_lock);
+  return read == (off_t) len;
+}
+
 /* Called when swap needed room and disposed an unchanged page.
  * Not called when disposal was initiated through swap_dispose|swap_clean.
  * Called once per disposed page.
@@ -282,6 +502,7 @@ vm_kernel_wrote (struct thread *t, void *user_addr, size_t amount)
         case VMPPT_USED:
         case VMPPT_MMAP_KPAGE:
         case VMPPT_MMAP_ALIAS:
+        case VMPPT_EXEC:
           break;
           
         case VMPPT_SWAPPED:
@@ -309,6 +530,44 @@ enum vm_page_usage
   VMPU_DIRTY,
 };
 
+// the bits of a shared mmap'd page are spread over the pagedirs mapping it
+static enum vm_page_usage
+vm_handle_kpage_usage (struct vm_page *ee)
+{
+  ASSERT (ee->type == VMPPT_MMAP_KPAGE);
+  
+  struct mmap_kpage *kpage = vm_frame_of (ee->user_addr)->mmap;
+  ASSERT (kpage != NULL);
+  ASSERT (kpage->kernel_page == ee);
+  
+  enum vm_page_usage result = VMPU_CLEAR;
+  struct list_elem *e;
+  for (e = list_begin (&kpage->upages); e != list_end (&kpage->upages);
+       e = list_next (e))
+    {
+      struct mmap_upage *upage = list_entry (e, struct mmap_upage, kpage_elem);
+      struct vm_page *alias = upage->vm_page;
+      uint32_t *pd = alias->thread->pagedir;
+      if (pagedir_is_dirty (pd, alias->user_addr))
+        {
+          kpage->dirty = true;
+          pagedir_set_dirty (pd, alias->user_addr, false);
+          pagedir_set_accessed (pd, alias->user_addr, false);
+          result = VMPU_DIRTY;
+        }
+      else if (pagedir_is_accessed (pd, alias->user_addr))
+        {
+          pagedir_set_accessed (pd, alias->user_addr, false);
+          if (result == VMPU_CLEAR)
+            result = VMPU_ACCESSED;
+        }
+    }
+  
+  if (result != VMPU_CLEAR)
+    lru_use (&pages_lru, &ee->lru_elem);
+  return result;
+}
+
 static enum vm_page_usage
 vm_handle_page_usage (struct vm_page *ee)
 {
@@ -319,17 +578,14 @@ vm_handle_page_usage (struct vm_page *ee)
   
   enum vm_page_usage result;
   if (!ee->thread)
-    {
-      ASSERT (ee->type == VMPPT_MMAP_KPAGE);
-      // TODO: check refs
-      return VMPU_CLEAR;
-    }
+    return vm_handle_kpage_usage (ee);
     
   if (!ee->readonly && pagedir_is_dirty (ee->thread->pagedir, ee->user_addr))
     {
       switch (ee->type)
         {
         case VMPPT_EMPTY:
+        case VMPPT_EXEC:
           ee->type = VMPPT_USED;
           break;
           
@@ -381,18 +637,6 @@ vm_handle_page_usage (struct vm_page *ee)
   return result;
 }
 
-static void
-vm_tick_sub (struct hash_elem *e, void *t UNUSED)
-{
-  ASSERT (intr_get_level () == INTR_OFF);
-  ASSERT (e != NULL);
-  ASSERT (t != NULL);
-  
-  struct vm_page *ee = hash_entry (e, struct vm_page, thread_elem);
-  ASSERT (ee->thread == t);
-  vm_handle_page_usage (ee);
-}
-
 void
 vm_tick (struct thread *t)
 {
@@ -404,8 +648,21 @@ vm_tick (struct thread *t)
     return;
   if (!lock_try_acquire (&vm_lock))
     return;
-    
-  hash_apply (&t->vm_pages, &vm_tick_sub);
+  
+  // CLOCK hand over all resident pages, from the least recently used end
+  struct lru_elem *e = vm_clock_hand != NULL ? &vm_clock_hand->lru_elem
+                                             : lru_peek_least (&pages_lru);
+  size_t i;
+  for (i = 0; i < VM_TICK_PAGES && e != NULL; ++i)
+    {
+      struct vm_page *ee = lru_entry (e, struct vm_page, lru_elem);
+      ASSERT (ee->vmlp_magic == VMLP_MAGIC);
+      // vm_handle_page_usage may move ee to the front
+      e = lru_peek_next (&pages_lru, e);
+      vm_handle_page_usage (ee);
+    }
+  vm_clock_hand = e != NULL ? lru_entry (e, struct vm_page, lru_elem) : NULL;
+  
   lock_release (&vm_lock);
 }
 
@@ -416,15 +673,15 @@ vm_mmap_evict_real (struct mmap_kpage *kpage)
   ASSERT (intr_get_level () == INTR_OFF);
   ASSERT (lock_held_by_current_thread (&vm_lock));
   
-  bool dirty = kpage->dirty;
   while (!list_empty (&kpage->upages))
     {
       struct list_elem *e = list_pop_front (&kpage->upages);
       struct mmap_upage *ee = list_entry (e, struct mmap_upage, kpage_elem);
+      struct vm_page *alias = ee->vm_page;
       ee->kpage = NULL;
-      if (!dirty)
-        dirty = pagedir_is_dirty (ee->vm_page->thread->pagedir,
-                                  ee->vm_page->user_addr);
+      if (pagedir_is_dirty (alias->thread->pagedir, alias->user_addr))
+        kpage->dirty = true;
+      pagedir_clear_page (alias->thread->pagedir, alias->user_addr);
     }
   
   if (kpage->dirty)
@@ -437,7 +694,7 @@ vm_mmap_evict_real (struct mmap_kpage *kpage)
   hash_delete (&kpage->region->kpages, &kpage->region_elem);
   
   struct vm_page *result = kpage->kernel_page;
-  lru_dispose (&pages_lru, &result->lru_elem, false);
+  vm_lru_dispose (result);
   ASSERT (result->thread == NULL);
   free (kpage);
   return result;
@@ -487,12 +744,14 @@ vm_free_a_page (void)
           kpage = ee->user_addr;
         }
       ASSERT (kpage != NULL);
+      ASSERT (vm_frame_of (kpage)->page == ee);
       
       switch (ee->type)
         {
         case VMPPT_EMPTY:
+        case VMPPT_EXEC: // unchanged, will be read again
           {
-            lru_dispose (&pages_lru, &ee->lru_elem, false);
+            vm_lru_dispose (ee);
             pagedir_clear_page (ee->thread->pagedir, ee->user_addr);
             result = true;
             break;
@@ -503,7 +762,7 @@ vm_free_a_page (void)
             result = swap_must_retain (ee->thread, ee->user_addr);
             if (result)
               {
-                lru_dispose (&pages_lru, &ee->lru_elem, false);
+                vm_lru_dispose (ee);
                 pagedir_clear_page (ee->thread->pagedir, ee->user_addr);
                 break;
               }
@@ -522,7 +781,7 @@ vm_free_a_page (void)
             intr_disable ();
             
             if (result)
-              lru_dispose (&pages_lru, &ee->lru_elem, false);
+              vm_lru_dispose (ee);
             else
               {
                 lru_use (&pages_lru, &ee->lru_elem);
@@ -536,8 +795,12 @@ vm_free_a_page (void)
           
         case VMPPT_MMAP_KPAGE:
           {
-            ASSERT (0);
-            // TODO
+            struct mmap_kpage *mmap = vm_frame_of (kpage)->mmap;
+            ASSERT (mmap != NULL);
+            struct vm_page *kernel_page UNUSED = vm_mmap_evict_real (mmap);
+            ASSERT (kernel_page == ee);
+            free (ee);
+            result = true;
             break;
           }
           
@@ -549,20 +812,17 @@ vm_free_a_page (void)
         }
       break;
     }
+  if (result)
+    vm_frame_release (kpage);
     
   intr_enable();
   return result ? kpage : NULL;
 }
 
 static void *
-vm_alloc_kpage (struct vm_page *ee)
+vm_alloc_frame (void)
 {
-  ASSERT (ee != NULL);
-  ASSERT (ee->user_addr != NULL);
-  ASSERT (ee->thread != NULL);
-  ASSERT (ee->vmlp_magic == VMLP_MAGIC);
   ASSERT (lock_held_by_current_thread (&vm_lock));
-  ASSERT (pagedir_get_page (ee->thread->pagedir, ee->user_addr) == NULL);
   ASSERT (intr_get_level () == INTR_ON);
   
   int i, j;
@@ -570,15 +830,7 @@ vm_alloc_kpage (struct vm_page *ee)
     {
       void *kpage = vm_palloc ();
       if (kpage != NULL)
-        {
-          if (pagedir_set_page (ee->thread->pagedir, ee->user_addr, kpage,
-                                !ee->readonly))
-            {
-              lru_use (&pages_lru, &ee->lru_elem);
-              return kpage;
-            }
-          palloc_free_page (kpage);
-        }
+        return kpage;
       for (j = 0; j < 5; ++j)
         {
           kpage = vm_free_a_page ();
@@ -592,6 +844,32 @@ vm_alloc_kpage (struct vm_page *ee)
   return NULL;
 }
 
+static void *
+vm_alloc_kpage (struct vm_page *ee)
+{
+  ASSERT (ee != NULL);
+  ASSERT (ee->user_addr != NULL);
+  ASSERT (ee->thread != NULL);
+  ASSERT (ee->type != VMPPT_MMAP_ALIAS);
+  ASSERT (ee->vmlp_magic == VMLP_MAGIC);
+  ASSERT (lock_held_by_current_thread (&vm_lock));
+  ASSERT (pagedir_get_page (ee->thread->pagedir, ee->user_addr) == NULL);
+  ASSERT (intr_get_level () == INTR_ON);
+  
+  void *kpage = vm_alloc_frame ();
+  if (kpage == NULL)
+    return NULL;
+  if (!pagedir_set_page (ee->thread->pagedir, ee->user_addr, kpage,
+                         !ee->readonly))
+    {
+      palloc_free_page (kpage);
+      return NULL;
+    }
+  vm_frame_attach (kpage, ee, NULL);
+  lru_use (&pages_lru, &ee->lru_elem);
+  return kpage;
+}
+
 void *
 vm_palloc (void)
 {
@@ -602,6 +880,8 @@ vm_palloc (void)
     lock_acquire (&vm_lock);
   
   void *kpage = palloc_get_page (PAL_USER);
+  if (kpage == NULL && filesys_cache_shrink ())
+    kpage = palloc_get_page (PAL_USER);
   if (kpage == NULL)
     kpage = vm_free_a_page ();
     
@@ -622,43 +902,41 @@ vm_ensure_mmap_alias (struct vm_page *vm_page, void **kpage_)
   struct mmap_upage *mmap_upage = mmap_retreive_upage (vm_page);
   ASSERT (mmap_upage != NULL);
   
-  if (mmap_upage->kpage != NULL || mmap_assign_kpage (mmap_upage))
+  *kpage_ = NULL;
+  if (mmap_upage->kpage == NULL && !mmap_assign_kpage (mmap_upage))
     {
-      ASSERT (mmap_upage->kpage->kernel_page != NULL);
-      *kpage_ = mmap_upage->kpage->kernel_page;
-      return VMER_OK;
-    }
-  
-  *kpage_ = vm_alloc_kpage (vm_page);
-  if (!*kpage_)
-    {
-      *kpage_ = NULL;
-      return VMER_OOM;
-    }
-    
-  struct vm_page *kernel_page = calloc (1, sizeof (*kernel_page));
-  if (!kernel_page)
-    {
-      palloc_free_page (*kpage_);
-      *kpage_ = NULL;
-      return VMER_OOM;
+      void *frame = vm_alloc_frame ();
+      if (!frame)
+        return VMER_OOM;
+        
+      struct vm_page *kernel_page = calloc (1, sizeof (*kernel_page));
+      if (!kernel_page)
+        {
+          palloc_free_page (frame);
+          return VMER_OOM;
+        }
+      kernel_page->user_addr  = frame;
+      kernel_page->vmlp_magic = VMLP_MAGIC;
+      kernel_page->type       = VMPPT_MMAP_KPAGE;
+      
+      if (!mmap_load_kpage (mmap_upage, kernel_page))
+        {
+          free (kernel_page);
+          palloc_free_page (frame);
+          return VMER_SEGV;
+        }
+      ASSERT (mmap_upage->kpage != NULL);
+      
+      vm_frame_attach (frame, kernel_page, mmap_upage->kpage);
+      lru_use (&pages_lru, &kernel_page->lru_elem);
     }
   
-  kernel_page->user_addr  = *kpage_;
-  kernel_page->vmlp_magic = VMLP_MAGIC;
-  kernel_page->type       = VMPPT_MMAP_KPAGE;
-    
-  if (!mmap_load_kpage (mmap_upage, kernel_page))
-    {
-      free (kernel_page);
-      palloc_free_page (*kpage_);
-      *kpage_ = NULL;
-      return VMER_SEGV;
-    }
-  ASSERT (mmap_upage->kpage != NULL);
-    
-  lru_use (&pages_lru, &kernel_page->lru_elem);
-  return true;
+  void *kpage = mmap_upage->kpage->kernel_page->user_addr;
+  if (!pagedir_set_page (vm_page->thread->pagedir, vm_page->user_addr, kpage,
+                         !vm_page->readonly))
+    return VMER_OOM;
+  *kpage_ = kpage;
+  return VMER_OK;
 }
 
 enum vm_ensure_result
@@ -725,13 +1003,19 @@ vm_ensure (struct thread *t, void *user_addr, void **kpage_)
         break;
         
       case VMPPT_SWAPPED:
-        if (swap_read_and_retain (ee->thread, ee->user_addr, *kpage_))
+      case VMPPT_EXEC:
+        if (ee->type == VMPPT_EXEC ?
+            vm_segment_read (ee, *kpage_) :
+            swap_read_and_retain (ee->thread, ee->user_addr, *kpage_))
           {
             result = VMER_OK;
             lru_use (&pages_lru, &ee->lru_elem);
           }
         else
           {
+            vm_lru_dispose (ee);
+            pagedir_clear_page (ee->thread->pagedir, ee->user_addr);
+            vm_frame_release (*kpage_);
             result = VMER_SEGV;
           }
         break;
@@ -843,6 +1127,7 @@ struct vm_ensure_group_entry
   struct hash_elem  elem;
   struct vm_page   *kernel_page;
   struct vm_page   *user_page;
+  struct vm_frame  *frame;
 };
 
 static struct vm_ensure_group_entry *
@@ -916,8 +1201,11 @@ vm_ensure_group_dispose_real (struct hash_elem *e, void *t UNUSED)
   ASSERT (ee->user_page->vmlp_magic == VMLP_MAGIC);
   ASSERT (ee->kernel_page != NULL);
   ASSERT (ee->kernel_page->vmlp_magic == VMLP_MAGIC);
+  ASSERT (ee->frame->page == ee->kernel_page);
+  ASSERT (ee->frame->pins > 0);
   
-  lru_use (&pages_lru, &ee->kernel_page->lru_elem);
+  if (--ee->frame->pins == 0)
+    lru_use (&pages_lru, &ee->kernel_page->lru_elem);
     
   free (ee);
 }
@@ -989,35 +1277,26 @@ vm_ensure_group_add (struct vm_ensure_group *g, void *user_addr, void **kpage_)
       goto end;
     }
   
-  if (user_page->type == VMPPT_MMAP_ALIAS)
-    {
-      struct mmap_upage *upage = mmap_retreive_upage (user_page);
-      ASSERT (upage != NULL);
-      ASSERT (upage->kpage != NULL);
-      ASSERT (upage->kpage->kernel_page != NULL);
-      kernel_page = upage->kpage->kernel_page;
-    }
-  else
-    kernel_page = user_page;
+  struct vm_frame *frame = vm_frame_of (*kpage_);
+  kernel_page = frame->page;
+  ASSERT (kernel_page != NULL);
+  ASSERT (kernel_page->type == VMPPT_MMAP_KPAGE ?
+          user_page->type == VMPPT_MMAP_ALIAS : kernel_page == user_page);
   
-  if (lru_is_interior (&kernel_page->lru_elem))
+  entry = calloc (1, sizeof (*entry));
+  if (entry == NULL)
     {
-      ASSERT (kernel_page->type == VMPPT_MMAP_KPAGE ?
-          user_page->type == VMPPT_MMAP_ALIAS :
-          user_page->type != VMPPT_MMAP_ALIAS);
-          
-      entry = calloc (1, sizeof (*entry));
-      if (entry == NULL)
-        {
-          result = VMER_OOM;
-          goto end;
-        }
-      entry->user_page = user_page;
-      entry->kernel_page = kernel_page;
-      struct hash_elem *e UNUSED = hash_insert (&g->entries, &entry->elem);
-      ASSERT (e == NULL);
-      lru_dispose (&pages_lru, &kernel_page->lru_elem, false);
+      *kpage_ = NULL;
+      result = VMER_OOM;
+      goto end;
     }
+  entry->user_page = user_page;
+  entry->kernel_page = kernel_page;
+  entry->frame = frame;
+  struct hash_elem *e UNUSED = hash_insert (&g->entries, &entry->elem);
+  ASSERT (e == NULL);
+  if (frame->pins++ == 0)
+    vm_lru_dispose (kernel_page);
     
 end:
   intr_set_level (old_level);
@@ -1090,7 +1369,7 @@ vm_mmap_acquire (struct thread *owner, struct pifs_inode *inode)
   enum intr_level old_level;
   lock_acquire2 (&vm_lock, &old_level);
   
-  mapid_t result = mmap_alias_acquire (owner, inode);
+  mapid_t result = mmap_alias_acquire (owner, inode, false);
   
   lock_release (&vm_lock);
   intr_set_level (old_level);
@@ -1118,7 +1397,7 @@ vm_mmap_dispose (struct thread *owner, mapid_t id)
   enum intr_level old_level;
   lock_acquire2 (&vm_lock, &old_level);
   struct mmap_alias *alias = mmap_retreive_alias (owner, id);
-  if (alias != NULL)
+  if (alias != NULL && !alias->region->text)
     {
       intr_enable ();
       mmap_alias_dispose (owner, alias);
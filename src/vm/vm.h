@@ -23,6 +23,7 @@ enum vm_page_type
                       // OR removed from RAM
   VMPPT_MMAP_ALIAS,   // upage belongs to an mmap'd region
   VMPPT_MMAP_KPAGE,   // page is being used by (multiple) VMPPT_MMAP_ALIAS pages
+  VMPPT_EXEC,         // backed by the executable, not read yet or unchanged
   
   VMPPT_COUNT
 };
@@ -53,6 +54,14 @@ void vm_clean (struct thread *t);
 // vm_(alloc_and_)ensure return kpage or NULL, if failed
 
 bool vm_alloc_zero (struct thread *t, void *user_addr, bool readonly);
+// pages of an executable's segment, read from inode on their first fault
+bool vm_alloc_segment (struct thread     *t,
+                       void              *base,
+                       struct pifs_inode *inode,
+                       size_t             ofs,
+                       size_t             read_bytes,
+                       size_t             zero_bytes,
+                       bool               readonly);
 void *vm_alloc_and_ensure (struct thread *t, void *user_addr, bool readonly);
 void vm_dispose (struct thread *t, void *user_addr);
 